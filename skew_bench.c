@@ -0,0 +1,752 @@
+/*
+ *  @(#) $Id: skew_bench.c 2014-05-08 $
+ *  Copyright (C) 2014 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ *  Times the resampling core on a synthetic hexagonal lattice, each
+ *  interpolation type through its specialized kernel and through the
+ *  generic loop, and checks the two agree.  The 16-bit bilinear path is
+ *  compared with the floating point one, and pure horizontal and vertical
+ *  shears are timed against each other, as are the core's aligned, pooled
+ *  buffers and plain g_malloc() ones.  Run by `make bench'.
+ *
+ *      skew-bench [--train] [--counters] [--batch] [--log FILE]
+ *                 [SIZE [REPEAT]]
+ *
+ *  With --log the kernel throughputs are appended to FILE together with
+ *  the build variant (LTO, PGO, -march) and compared with the last plain
+ *  build found there.  --train is the training run of the profile-guided
+ *  build.  --counters reads the hardware counters (Linux perf events)
+ *  around every timed stage, the spectrum included, and reports them per
+ *  output pixel; the data TLB misses show what huge pages save.  --batch
+ *  corrects a batch of fields the way the mosaic does, on one NUMA node,
+ *  two and so on, and with an unpinned thread pool, to show how the
+ *  throughput scales across sockets.  Counters the machine lacks are
+ *  shown as dashes; where none can be opened, as in most containers, the
+ *  run goes on without.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <libprocess/gwyprocess.h>
+#include "skew_core.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define BENCH_HSKEW 3.0
+#define BENCH_VSKEW -2.0
+#define BENCH_SHEAR 20.0
+
+#ifndef SKEW_BUILD_VARIANT
+#define SKEW_BUILD_VARIANT "plain"
+#endif
+
+enum {
+    BENCH_CYCLES,
+    BENCH_INSTRUCTIONS,
+    BENCH_LLC_MISSES,
+    BENCH_BRANCH_MISSES,
+    BENCH_DTLB_MISSES,
+    BENCH_NCOUNTERS
+};
+
+/* A batch of fields to correct, as the mosaic has. */
+typedef struct {
+    GwyDataField *source;
+    gdouble itrans[6];
+    gint newxres;
+    gint newyres;
+} BenchBatch;
+
+/* Counter totals of one timed stage; negative where unavailable. */
+typedef struct {
+    gdouble value[BENCH_NCOUNTERS];
+    gdouble pixels;
+} BenchCount;
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+static gint bench_fds[BENCH_NCOUNTERS] = { -1, -1, -1, -1, -1 };
+#endif
+
+static const struct {
+    GwyInterpolationType interp;
+    const gchar *name;
+} bench_types[] = {
+    { GWY_INTERPOLATION_LINEAR,  "linear",  },
+    { GWY_INTERPOLATION_KEY,     "key",     },
+    { GWY_INTERPOLATION_BSPLINE, "bspline", },
+    { GWY_INTERPOLATION_OMOMS,   "omoms",   },
+    { GWY_INTERPOLATION_SCHAUM,  "schaum",  },
+    { GWY_INTERPOLATION_NNA,     "nna",     },
+};
+
+/* Three cosines 120 degrees apart, period 8 pixels, plus a little noise. */
+static GwyDataField*
+bench_lattice(gint res)
+{
+    GwyDataField *dfield;
+    gdouble *d;
+    gdouble k = 2.0*G_PI/8.0;
+    gint i, j;
+    dfield = gwy_data_field_new(res, res, res, res, FALSE);
+    d = gwy_data_field_get_data(dfield);
+    for (i = 0; i < res; i++)
+    {
+        for (j = 0; j < res; j++)
+            d[i*res + j] = cos(k*j) + cos(k*(-0.5*j + 0.8660254037844386*i))
+                           + cos(k*(-0.5*j - 0.8660254037844386*i))
+                           + 0.05*g_random_double();
+    }
+    return dfield;
+}
+
+/* The inverse of the pixel shear skew_lattice applies, with the frame
+ * shifted and enlarged to hold the sheared image. */
+static GwyDataField*
+bench_target(GwyDataField *source, gdouble hskew, gdouble vskew,
+             gdouble *itrans)
+{
+    gdouble th, tv, D, x, y, lowx, highx, lowy, highy;
+    gint xres, yres, k;
+    xres = gwy_data_field_get_xres(source);
+    yres = gwy_data_field_get_yres(source);
+    th = tan(hskew*G_PI/180.0);
+    tv = tan(vskew*G_PI/180.0);
+    lowx = highx = lowy = highy = 0.0;
+    for (k = 1; k < 4; k++)
+    {
+        x = (k & 1)*xres + th*(k >> 1)*yres;
+        y = tv*(k & 1)*xres + (k >> 1)*yres;
+        lowx = MIN(lowx, x);
+        highx = MAX(highx, x);
+        lowy = MIN(lowy, y);
+        highy = MAX(highy, y);
+    }
+    D = 1.0 - th*tv;
+    itrans[0] = 1.0/D;
+    itrans[1] = -tv/D;
+    itrans[2] = -th/D;
+    itrans[3] = 1.0/D;
+    itrans[4] = (lowx - th*lowy)/D;
+    itrans[5] = (lowy - tv*lowx)/D;
+    return gwy_data_field_new(GWY_ROUND(highx - lowx),
+                              GWY_ROUND(highy - lowy),
+                              GWY_ROUND(highx - lowx),
+                              GWY_ROUND(highy - lowy), FALSE);
+}
+
+/* Opens the counters for this process and the threads it creates later, so
+ * it must be called before the first OpenMP region starts the thread pool.
+ * Each counter is opened on its own, so that a machine lacking one still
+ * reports the others.  Returns FALSE if none could be opened. */
+static gboolean
+bench_counters_open(void)
+{
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    static const struct {
+        guint32 type;
+        guint64 config;
+    } configs[BENCH_NCOUNTERS] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,    },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,  },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,  },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, },
+        {
+            PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_DTLB
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        },
+    };
+    struct perf_event_attr attr;
+    gboolean any = FALSE;
+    gint k, err = 0;
+    for (k = 0; k < BENCH_NCOUNTERS; k++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = configs[k].type;
+        attr.config = configs[k].config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                           | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        bench_fds[k] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (bench_fds[k] >= 0)
+            any = TRUE;
+        else
+            err = errno;
+    }
+    if (!any)
+        fprintf(stderr, "Hardware counters unavailable: %s\n",
+                g_strerror(err));
+    return any;
+#else
+    fprintf(stderr, "Hardware counters are not supported on this system\n");
+    return FALSE;
+#endif
+}
+
+static void
+bench_counters_start(void)
+{
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    gint k;
+    for (k = 0; k < BENCH_NCOUNTERS; k++)
+    {
+        if (bench_fds[k] < 0)
+            continue;
+        ioctl(bench_fds[k], PERF_EVENT_IOC_RESET, 0);
+        ioctl(bench_fds[k], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+/* Stops the counters and reads them, scaled up for the time the kernel had
+ * them multiplexed out. */
+static void
+bench_counters_stop(BenchCount *count)
+{
+    gint k;
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    guint64 buf[3];
+    for (k = 0; k < BENCH_NCOUNTERS; k++)
+    {
+        count->value[k] = -1.0;
+        if (bench_fds[k] < 0)
+            continue;
+        ioctl(bench_fds[k], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(bench_fds[k], buf, sizeof(buf)) == sizeof(buf) && buf[2])
+            count->value[k] = (gdouble)buf[0]*buf[1]/buf[2];
+    }
+#else
+    for (k = 0; k < BENCH_NCOUNTERS; k++)
+        count->value[k] = -1.0;
+#endif
+}
+
+static void
+bench_counters_close(void)
+{
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    gint k;
+    for (k = 0; k < BENCH_NCOUNTERS; k++)
+    {
+        if (bench_fds[k] >= 0)
+            close(bench_fds[k]);
+        bench_fds[k] = -1;
+    }
+#endif
+}
+
+static void
+bench_print_count_header(void)
+{
+    printf("%-16s %6s %10s %10s %12s %12s %12s\n", "counters", "IPC",
+           "cycles/px", "instr/px", "LLC miss/px", "br miss/px",
+           "dTLB miss/px");
+}
+
+static void
+bench_print_count(const gchar *name, const BenchCount *count)
+{
+    const gdouble *v = count->value;
+    gchar ipc[16];
+    gint k;
+    if (v[BENCH_CYCLES] > 0.0 && v[BENCH_INSTRUCTIONS] >= 0.0)
+        g_snprintf(ipc, sizeof(ipc), "%6.2f",
+                   v[BENCH_INSTRUCTIONS]/v[BENCH_CYCLES]);
+    else
+        g_snprintf(ipc, sizeof(ipc), "%6s", "-");
+    printf("%-16s %s", name, ipc);
+    for (k = 0; k < BENCH_NCOUNTERS; k++)
+    {
+        if (v[k] >= 0.0)
+            printf(" %*.3f", k < BENCH_LLC_MISSES ? 10 : 12,
+                   v[k]/count->pixels);
+        else
+            printf(" %*s", k < BENCH_LLC_MISSES ? 10 : 12, "-");
+    }
+    printf("\n");
+}
+
+/* The 16-bit path has only bilinear interpolation. */
+static void
+bench_fixed(GwyDataField *source, GwyDataField *dest, const gdouble *itrans,
+            G_GNUC_UNUSED GwyInterpolationType interp, gdouble fill_value)
+{
+    skew_affine_fixed(source, dest, itrans, fill_value);
+}
+
+/* The modulus spectrum of the whole field, the path perform_fft() takes
+ * outside Welch averaging, less the window. */
+static void
+bench_spectrum(GwyDataField *source, GwyDataField *dest,
+               G_GNUC_UNUSED const gdouble *itrans,
+               G_GNUC_UNUSED GwyInterpolationType interp,
+               G_GNUC_UNUSED gdouble fill_value)
+{
+    GwyDataField *re, *im;
+    const gdouble *dre, *dim;
+    gdouble *d;
+    gint i, n;
+    re = gwy_data_field_new_alike(source, FALSE);
+    im = gwy_data_field_new_alike(source, FALSE);
+    gwy_data_field_2dfft_raw(source, NULL, re, im,
+                             GWY_TRANSFORM_DIRECTION_FORWARD);
+    dre = gwy_data_field_get_data_const(re);
+    dim = gwy_data_field_get_data_const(im);
+    d = gwy_data_field_get_data(dest);
+    n = gwy_data_field_get_xres(dest)*gwy_data_field_get_yres(dest);
+    for (i = 0; i < n; i++)
+        d[i] = hypot(dre[i], dim[i]);
+    gwy_data_field_invalidate(dest);
+    g_object_unref(re);
+    g_object_unref(im);
+}
+
+/* Times repeat calls of resample; count, if not NULL, gets the counter
+ * totals over them. */
+static gdouble
+bench_run(void (*resample)(GwyDataField*, GwyDataField*, const gdouble*,
+                           GwyInterpolationType, gdouble),
+          GwyDataField *source, GwyDataField *dest, const gdouble *itrans,
+          GwyInterpolationType interp, gint repeat, BenchCount *count)
+{
+    GTimer *timer;
+    gdouble t;
+    gint r;
+    if (count)
+        bench_counters_start();
+    timer = g_timer_new();
+    for (r = 0; r < repeat; r++)
+        resample(source, dest, itrans, interp, -3.0);
+    t = g_timer_elapsed(timer, NULL)/repeat;
+    g_timer_destroy(timer);
+    if (count)
+    {
+        bench_counters_stop(count);
+        count->pixels = (gdouble)repeat*gwy_data_field_get_xres(dest)
+                        *gwy_data_field_get_yres(dest);
+    }
+    return t;
+}
+
+/* Each interpolation type through its kernel and through the generic
+ * loop, then the 16-bit path against the linear kernel.  The kernel
+ * throughputs go to mpxs, in the order of bench_types with q15 last. */
+static void
+bench_kernels(GwyDataField *source, gint repeat, gboolean counters,
+              gdouble *mpxs)
+{
+    BenchCount kcount[G_N_ELEMENTS(bench_types) + 1],
+               gcount[G_N_ELEMENTS(bench_types) + 1];
+    gchar name[16];
+    GwyDataField *fast, *slow;
+    gdouble itrans[6];
+    gdouble tfast, tslow, mpix, diff;
+    const gdouble *a, *b;
+    gint i, k, n;
+    fast = bench_target(source, BENCH_HSKEW, BENCH_VSKEW, itrans);
+    slow = gwy_data_field_new_alike(fast, FALSE);
+    n = gwy_data_field_get_xres(fast)*gwy_data_field_get_yres(fast);
+    mpix = n/1e6;
+    printf("%dx%d -> %dx%d, %d repeats\n",
+           gwy_data_field_get_xres(source), gwy_data_field_get_yres(source),
+           gwy_data_field_get_xres(fast), gwy_data_field_get_yres(fast),
+           repeat);
+    printf("%-8s %4s %10s %10s %8s %10s\n",
+           "interp", "taps", "kernel/ms", "generic/ms", "speedup", "max diff");
+    for (k = 0; k < (gint)G_N_ELEMENTS(bench_types); k++)
+    {
+        tfast = bench_run(skew_affine, source, fast, itrans,
+                          bench_types[k].interp, repeat,
+                          counters ? kcount + k : NULL);
+        tslow = bench_run(skew_affine_generic, source, slow, itrans,
+                          bench_types[k].interp, repeat,
+                          counters ? gcount + k : NULL);
+        a = gwy_data_field_get_data_const(fast);
+        b = gwy_data_field_get_data_const(slow);
+        diff = 0.0;
+        for (i = 0; i < n; i++)
+            diff = MAX(diff, fabs(a[i] - b[i]));
+        printf("%-8s %4d %10.2f %10.2f %8.2f %10.2g%s\n",
+               bench_types[k].name,
+               gwy_interpolation_get_support_size(bench_types[k].interp),
+               1e3*tfast, 1e3*tslow, tslow/tfast, diff,
+               skew_affine_specialized(bench_types[k].interp)
+               ? "" : "  (generic)");
+        mpxs[k] = mpix/tfast;
+    }
+    tfast = bench_run(bench_fixed, source, slow, itrans,
+                      GWY_INTERPOLATION_LINEAR, repeat,
+                      counters ? kcount + k : NULL);
+    tslow = bench_run(skew_affine, source, fast, itrans,
+                      GWY_INTERPOLATION_LINEAR, repeat,
+                      counters ? gcount + k : NULL);
+    a = gwy_data_field_get_data_const(fast);
+    b = gwy_data_field_get_data_const(slow);
+    diff = 0.0;
+    for (i = 0; i < n; i++)
+        diff = MAX(diff, fabs(a[i] - b[i]));
+    printf("%-8s %4d %10.2f %10.2f %8.2f %10.2g  (vs linear kernel)\n",
+           "q15", 2, 1e3*tfast, 1e3*tslow, tslow/tfast, diff);
+    mpxs[k] = mpix/tfast;
+    printf("%.1f Mpx per resample\n", mpix);
+    if (counters)
+    {
+        bench_print_count_header();
+        for (k = 0; k < (gint)G_N_ELEMENTS(bench_types); k++)
+        {
+            g_snprintf(name, sizeof(name), "%s", bench_types[k].name);
+            bench_print_count(name, kcount + k);
+            g_snprintf(name, sizeof(name), "%s/gen", bench_types[k].name);
+            bench_print_count(name, gcount + k);
+        }
+        bench_print_count("q15", kcount + k);
+    }
+    g_object_unref(slow);
+    g_object_unref(fast);
+}
+
+/* A pure vertical shear should cost what a horizontal one does. */
+static void
+bench_shears(GwyDataField *source, gint repeat, gboolean counters)
+{
+    BenchCount count[2];
+    GwyDataField *dest;
+    gdouble itrans[6];
+    gdouble t;
+    gint k;
+    for (k = 0; k < 2; k++)
+    {
+        dest = bench_target(source, k ? 0.0 : BENCH_SHEAR,
+                            k ? BENCH_SHEAR : 0.0, itrans);
+        t = bench_run(skew_affine, source, dest, itrans,
+                      GWY_INTERPOLATION_LINEAR, repeat,
+                      counters ? count + k : NULL);
+        printf("%s shear by %g deg: %.2f ms, %.1f Mpx/s\n",
+               k ? "vertical" : "horizontal", BENCH_SHEAR, 1e3*t,
+               gwy_data_field_get_xres(dest)*gwy_data_field_get_yres(dest)
+               /1e6/t);
+        g_object_unref(dest);
+    }
+    if (counters)
+    {
+        bench_print_count_header();
+        bench_print_count("h shear", count);
+        bench_print_count("v shear", count + 1);
+    }
+}
+
+/* The kernels that need buffers of their own, with the core's allocator
+ * and with plain g_malloc().  Each gets a warm-up call first, so the pool
+ * holds the buffers as it does from the second update of the dialog on. */
+static void
+bench_buffers(GwyDataField *source, gint repeat, gboolean counters)
+{
+    static const gchar *modes[2] = { "aligned", "plain" };
+    BenchCount count[4];
+    GwyDataField *dest;
+    gdouble itrans[6];
+    gdouble t, mpix;
+    gchar name[24];
+    gint k, m;
+    dest = bench_target(source, BENCH_HSKEW, BENCH_VSKEW, itrans);
+    mpix = gwy_data_field_get_xres(dest)*gwy_data_field_get_yres(dest)/1e6;
+    for (m = 0; m < 2; m++)
+    {
+        skew_buffer_set_plain(m);
+        for (k = 0; k < 2; k++)
+        {
+            if (k)
+                bench_fixed(source, dest, itrans, GWY_INTERPOLATION_LINEAR,
+                            -3.0);
+            else
+                skew_affine(source, dest, itrans, GWY_INTERPOLATION_BSPLINE,
+                            -3.0);
+            t = bench_run(k ? bench_fixed : skew_affine, source, dest, itrans,
+                          k ? GWY_INTERPOLATION_LINEAR
+                          : GWY_INTERPOLATION_BSPLINE,
+                          repeat, counters ? count + 2*m + k : NULL);
+            printf("%s buffers, %s: %.2f ms, %.1f Mpx/s\n",
+                   modes[m], k ? "q15" : "bspline", 1e3*t, mpix/t);
+        }
+    }
+    skew_buffer_set_plain(FALSE);
+    if (counters)
+    {
+        bench_print_count_header();
+        for (m = 0; m < 4; m++)
+        {
+            g_snprintf(name, sizeof(name), "%s/%s",
+                       (m & 1) ? "q15" : "bspline", modes[m/2]);
+            bench_print_count(name, count + m);
+        }
+    }
+    g_object_unref(dest);
+}
+
+/* One field of the batch: a private copy of the source and a new result,
+ * both first touched by the thread correcting them, like
+ * skew_correct_field() does. */
+static void
+bench_batch_item(G_GNUC_UNUSED gint i, gpointer user_data)
+{
+    BenchBatch *batch = (BenchBatch*)user_data;
+    GwyDataField *copy, *dest;
+    copy = gwy_data_field_duplicate(batch->source);
+    dest = gwy_data_field_new(batch->newxres, batch->newyres,
+                              batch->newxres, batch->newyres, FALSE);
+    gwy_data_field_fill(dest, -3.0);
+    skew_affine(copy, dest, batch->itrans, GWY_INTERPOLATION_LINEAR, -3.0);
+    g_object_unref(dest);
+    g_object_unref(copy);
+}
+
+/* The batch on 1, 2, ... NUMA nodes, then on a plain OpenMP loop over all
+ * threads with nothing pinned and everything allocated wherever. */
+static void
+bench_batch(GwyDataField *source, gint repeat)
+{
+    BenchBatch batch;
+    GwyDataField *dest;
+    GTimer *timer;
+    gdouble t, mpix, base = 0.0;
+    gint nnodes, nitems, k, r, i;
+    dest = bench_target(source, BENCH_HSKEW, BENCH_VSKEW, batch.itrans);
+    batch.source = source;
+    batch.newxres = gwy_data_field_get_xres(dest);
+    batch.newyres = gwy_data_field_get_yres(dest);
+    g_object_unref(dest);
+    nnodes = skew_numa_nodes();
+#ifdef _OPENMP
+    nitems = 4*omp_get_max_threads();
+#else
+    nitems = 4;
+#endif
+    mpix = (gdouble)nitems*batch.newxres*batch.newyres/1e6;
+    printf("batch of %d fields, %d NUMA node%s\n",
+           nitems, nnodes, nnodes == 1 ? "" : "s");
+    timer = g_timer_new();
+    for (k = 1; k <= nnodes; k++)
+    {
+        g_timer_start(timer);
+        for (r = 0; r < repeat; r++)
+            skew_batch_run(nitems, bench_batch_item, &batch, k);
+        t = g_timer_elapsed(timer, NULL)/repeat;
+        if (k == 1)
+            base = t;
+        printf("%d node%s: %.2f ms, %.1f Mpx/s, scaling %.2f\n",
+               k, k == 1 ? "" : "s", 1e3*t, mpix/t, base/t);
+    }
+    g_timer_start(timer);
+    for (r = 0; r < repeat; r++)
+    {
+#ifdef _OPENMP
+#pragma omp parallel for private(i) schedule(dynamic)
+#endif
+        for (i = 0; i < nitems; i++)
+            bench_batch_item(i, &batch);
+    }
+    t = g_timer_elapsed(timer, NULL)/repeat;
+    printf("unpinned: %.2f ms, %.1f Mpx/s, scaling %.2f\n",
+           1e3*t, mpix/t, base/t);
+    g_timer_destroy(timer);
+}
+
+/* The spectrum, to tell whether it or the resampling dominates. */
+static void
+bench_spectra(GwyDataField *source, gint repeat, gboolean counters)
+{
+    BenchCount count;
+    GwyDataField *dest;
+    gdouble t;
+    dest = gwy_data_field_new_alike(source, FALSE);
+    t = bench_run(bench_spectrum, source, dest, NULL,
+                  GWY_INTERPOLATION_LINEAR, repeat,
+                  counters ? &count : NULL);
+    printf("spectrum: %.2f ms, %.1f Mpx/s\n", 1e3*t,
+           gwy_data_field_get_xres(dest)*gwy_data_field_get_yres(dest)
+           /1e6/t);
+    if (counters)
+    {
+        bench_print_count_header();
+        bench_print_count("spectrum", &count);
+    }
+    g_object_unref(dest);
+}
+
+/* Prints the gain of each kernel over the last plain build logged for the
+ * same size, then appends this build's numbers to the log. */
+static void
+bench_compare_variants(const gchar *logname, gint res, const gdouble *mpxs)
+{
+    gdouble base[G_N_ELEMENTS(bench_types) + 1];
+    gchar variant[64], name[16];
+    const gchar *kname;
+    gdouble v;
+    gint k, size;
+    FILE *fh;
+    for (k = 0; k <= (gint)G_N_ELEMENTS(bench_types); k++)
+        base[k] = 0.0;
+    if ((fh = fopen(logname, "r")))
+    {
+        while (fscanf(fh, "%63s %d %15s %lf", variant, &size, name, &v) == 4)
+        {
+            if (strcmp(variant, "plain") || size != res)
+                continue;
+            for (k = 0; k <= (gint)G_N_ELEMENTS(bench_types); k++)
+            {
+                kname = (k < (gint)G_N_ELEMENTS(bench_types))
+                        ? bench_types[k].name : "q15";
+                if (!strcmp(name, kname))
+                    base[k] = v;
+            }
+        }
+        fclose(fh);
+    }
+    printf("build variant: %s\n", SKEW_BUILD_VARIANT);
+    for (k = 0; k <= (gint)G_N_ELEMENTS(bench_types); k++)
+    {
+        kname = (k < (gint)G_N_ELEMENTS(bench_types))
+                ? bench_types[k].name : "q15";
+        if (base[k] > 0.0)
+            printf("%-8s %8.1f Mpx/s, plain %8.1f Mpx/s, gain %+.1f%%\n",
+                   kname, mpxs[k], base[k], 100.0*(mpxs[k]/base[k] - 1.0));
+        else
+            printf("%-8s %8.1f Mpx/s, no plain build logged\n",
+                   kname, mpxs[k]);
+    }
+    if (!(fh = fopen(logname, "a")))
+    {
+        fprintf(stderr, "Cannot append to %s\n", logname);
+        return;
+    }
+    for (k = 0; k <= (gint)G_N_ELEMENTS(bench_types); k++)
+        fprintf(fh, "%s %d %s %.3f\n", SKEW_BUILD_VARIANT, res,
+                (k < (gint)G_N_ELEMENTS(bench_types))
+                ? bench_types[k].name : "q15", mpxs[k]);
+    fclose(fh);
+}
+
+/* The profile-guided build's training run: the core over the sizes and
+ * skews it meets in practice, with the interpolations the module uses. */
+static void
+bench_train(void)
+{
+    static const gint sizes[] = { 256, 512, 1024, 2048 };
+    static const gdouble skews[][2] = {
+        { 3.0, 0.0 }, { -8.0, 0.0 }, { 0.0, 5.0 }, { 0.0, -12.0 },
+        { 2.0, -1.5 }, { 15.0, 10.0 },
+    };
+    GwyDataField *source, *dest;
+    gdouble itrans[6];
+    gint i, k;
+    for (i = 0; i < (gint)G_N_ELEMENTS(sizes); i++)
+    {
+        source = bench_lattice(sizes[i]);
+        for (k = 0; k < (gint)G_N_ELEMENTS(skews); k++)
+        {
+            dest = bench_target(source, skews[k][0], skews[k][1], itrans);
+            skew_affine(source, dest, itrans, GWY_INTERPOLATION_LINEAR,
+                        -3.0);
+            skew_affine_fixed(source, dest, itrans, -3.0);
+            if (!(k % 3))
+                skew_affine(source, dest, itrans, GWY_INTERPOLATION_KEY,
+                            -3.0);
+            g_object_unref(dest);
+        }
+        g_object_unref(source);
+        printf("trained on %dx%d\n", sizes[i], sizes[i]);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    GwyDataField *source;
+    gdouble mpxs[G_N_ELEMENTS(bench_types) + 1];
+    const gchar *logname = NULL;
+    gboolean train = FALSE, counters = FALSE, batch = FALSE;
+    gint res, repeat, i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+        if (!strcmp(argv[i], "--train"))
+            train = TRUE;
+        else if (!strcmp(argv[i], "--counters"))
+            counters = TRUE;
+        else if (!strcmp(argv[i], "--batch"))
+            batch = TRUE;
+        else if (!strcmp(argv[i], "--log") && i+1 < argc)
+            logname = argv[++i];
+        else
+            break;
+    }
+    res = (i < argc) ? atoi(argv[i]) : 1024;
+    repeat = (i+1 < argc) ? atoi(argv[i+1]) : 5;
+    if (res < 8 || repeat < 1)
+    {
+        fprintf(stderr, "Usage: %s [--train] [--counters] [--batch] "
+                "[--log FILE] [SIZE [REPEAT]]\n", argv[0]);
+        return 1;
+    }
+    if (counters && !train)
+        counters = bench_counters_open();
+    gwy_process_type_init();
+    g_random_set_seed(42);
+    if (train)
+    {
+        bench_train();
+        return 0;
+    }
+    source = bench_lattice(res);
+    if (batch)
+    {
+        bench_batch(source, repeat);
+        g_object_unref(source);
+        bench_counters_close();
+        return 0;
+    }
+    bench_kernels(source, repeat, counters, mpxs);
+    bench_shears(source, repeat, counters);
+    bench_buffers(source, repeat, counters);
+    bench_spectra(source, repeat, counters);
+    if (logname)
+        bench_compare_variants(logname, res, mpxs);
+    g_object_unref(source);
+    bench_counters_close();
+    return 0;
+}
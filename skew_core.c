@@ -0,0 +1,843 @@
+/*
+ *  @(#) $Id: skew_core.c 2014-05-08 $
+ *  Copyright (C) 2014 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <libprocess/datafield.h>
+#include <libprocess/interpolation.h>
+#include "skew_core.h"
+#include "skew_probes.h"
+
+#ifdef G_OS_WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+#if defined(HAVE_SCHED_SETAFFINITY) || defined(HAVE_SCHED_GETCPU)
+#include <sched.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* Output columns resampled together.  The kernels go through the output in
+ * strips this wide, row by row within a strip, so the source rows a strip
+ * row reads stay in cache for the next one however steep the vertical
+ * shear is, and the writes stream. */
+enum { AFFINE_STRIP = 16 };
+
+/* Buffers of the core start on a cache line.  Those of at least a huge
+ * page are rounded to whole huge pages, so the kernel can back them with
+ * transparent huge pages entirely, and up to BUFFER_POOL of them are kept
+ * after release for the next update, which mostly needs the same sizes. */
+enum {
+    BUFFER_ALIGN = 64,
+    BUFFER_POOL = 4,
+    BUFFER_HUGE_PAGE = 2 << 20,
+};
+
+typedef struct {
+    gpointer mem;
+    gsize size;
+    gint node;
+} PooledBuffer;
+
+static PooledBuffer buffer_pool[BUFFER_POOL];
+static gboolean buffer_plain = FALSE;
+
+/* The NUMA nodes the process may run on, as sysfs lists them, numbered
+ * densely.  Where there is no such list all CPUs form one node and
+ * nothing is pinned. */
+enum {
+    NUMA_MAX_NODES = 64,
+    NUMA_MAX_CPUS = 1024,
+};
+
+typedef struct {
+    gint nnodes;
+    gint node_ncpus[NUMA_MAX_NODES];
+    gint cpu_node[NUMA_MAX_CPUS];
+} NumaTopology;
+
+static NumaTopology numa;
+
+/* The work of one node in skew_batch_run(), a cache line each. */
+typedef struct {
+    volatile gint next;
+    gint end;
+    gint pad[14];
+} BatchQueue;
+
+/* A resampling loop specialized for one interpolation type.  a is the
+ * inverse transform already shifted to pixel centres.  The written values
+ * are added to stats. */
+typedef void (*AffineKernel)(const gdouble *cdata, gint xres, gint yres,
+                             gdouble *data, gint newxres, gint newyres,
+                             const gdouble *a, gdouble fill_value,
+                             SkewStats *stats);
+
+static gpointer      buffer_aligned      (gsize size,
+                                          gsize align);
+static void          buffer_release      (gpointer mem);
+static void          numa_init           (void);
+static gint          numa_current_node   (void);
+static const gdouble* affine_coefficients(GwyDataField *source,
+                                          GwyInterpolationType interp,
+                                          gdouble **buffer);
+static AffineKernel  affine_kernel       (GwyInterpolationType interp);
+static void          affine_shift        (const gdouble *invtrans,
+                                          gdouble *a);
+
+/* Mirror boundary condition, the same as gwy_interpolation uses; st is
+ * the half-width of the support. */
+static inline gint
+affine_mirror(gint i, gint res, gint st)
+{
+    if (G_LIKELY(i >= 0 && i < res))
+        return i;
+    i = (i + 2*st*res) % (2*res);
+    if (i >= res)
+        i = 2*res-1 - i;
+    return i;
+}
+
+/* The separable weights of the types with a specialized kernel, the same
+ * polynomials gwy_interpolation_interpolate_2d() evaluates. */
+static inline void
+affine_weights_linear(gdouble x, gdouble *w)
+{
+    w[0] = 1.0 - x;
+    w[1] = x;
+}
+
+static inline void
+affine_weights_key(gdouble x, gdouble *w)
+{
+    w[0] = (-0.5 + (1.0 - x/2.0)*x)*x;
+    w[1] = 1.0 + (-2.5 + 1.5*x)*x*x;
+    w[2] = (0.5 + (2.0 - 1.5*x)*x)*x;
+    w[3] = (-0.5 + x/2.0)*x*x;
+}
+
+static inline void
+affine_weights_bspline(gdouble x, gdouble *w)
+{
+    w[0] = (1.0 + x*(-3.0 + x*(3.0 - x)))/6.0;
+    w[1] = (4.0 + x*x*(-6.0 + 3.0*x))/6.0;
+    w[2] = (1.0 + x*(3.0 + x*(3.0 - 3.0*x)))/6.0;
+    w[3] = x*x*x/6.0;
+}
+
+static inline void
+affine_weights_omoms(gdouble x, gdouble *w)
+{
+    w[0] = 4.0/21.0 + (-11.0/21.0 + (0.5 - x/6.0)*x)*x;
+    w[1] = 13.0/21.0 + (1.0/14.0 + (-1.0 + x/2.0)*x)*x;
+    w[2] = 4.0/21.0 + (3.0/7.0 + (0.5 - x/2.0)*x)*x;
+    w[3] = (1.0/42.0 + x*x/6.0)*x;
+}
+
+static inline void
+affine_weights_schaum(gdouble x, gdouble *w)
+{
+    w[0] = -x*(x - 1.0)*(x - 2.0)/6.0;
+    w[1] = (x*x - 1.0)*(x - 2.0)/2.0;
+    w[2] = -x*(x + 1.0)*(x - 2.0)/2.0;
+    w[3] = x*(x*x - 1.0)/6.0;
+}
+
+/* Fully unrolled taps: r is a row, j the column indices, w the x weights. */
+#define AFFINE_ROW2(r, j, w) \
+    ((w)[0]*(r)[(j)[0]] + (w)[1]*(r)[(j)[1]])
+#define AFFINE_ROW4(r, j, w) \
+    ((w)[0]*(r)[(j)[0]] + (w)[1]*(r)[(j)[1]] \
+     + (w)[2]*(r)[(j)[2]] + (w)[3]*(r)[(j)[3]])
+#define AFFINE_SUM2(c, xres, i, j, wx, wy) \
+    ((wy)[0]*AFFINE_ROW2((c) + (i)[0]*(xres), j, wx) \
+     + (wy)[1]*AFFINE_ROW2((c) + (i)[1]*(xres), j, wx))
+#define AFFINE_SUM4(c, xres, i, j, wx, wy) \
+    ((wy)[0]*AFFINE_ROW4((c) + (i)[0]*(xres), j, wx) \
+     + (wy)[1]*AFFINE_ROW4((c) + (i)[1]*(xres), j, wx) \
+     + (wy)[2]*AFFINE_ROW4((c) + (i)[2]*(xres), j, wx) \
+     + (wy)[3]*AFFINE_ROW4((c) + (i)[3]*(xres), j, wx))
+
+/* The loop of skew_affine_generic() with the support size a constant and
+ * the weights inlined, going through the output in strips. */
+#define AFFINE_KERNEL(name, N, weights) \
+static void \
+name(const gdouble *cdata, gint xres, gint yres, \
+     gdouble *data, gint newxres, gint newyres, \
+     const gdouble *a, gdouble fill_value, SkewStats *stats) \
+{ \
+    gdouble wx[N], wy[N]; \
+    gint ii[N], jj[N]; \
+    gint newi, newj, oldi, oldj, k, col, colend; \
+    gdouble x, y, v; \
+    for (col = 0; col < newxres; col += AFFINE_STRIP) \
+    { \
+        colend = MIN(col + AFFINE_STRIP, newxres); \
+        for (newj = 0; newj < newyres; newj++) \
+        { \
+            for (newi = col; newi < colend; newi++) \
+            { \
+                x = a[0]*newi + a[2]*newj + a[4]; \
+                y = a[1]*newi + a[3]*newj + a[5]; \
+                if (y > yres || x > xres || y < 0.0 || x < 0.0) \
+                { \
+                    data[newi + newxres*newj] = fill_value; \
+                    skew_stats_add(stats, fill_value); \
+                    continue; \
+                } \
+                oldi = (gint)floor(y); \
+                oldj = (gint)floor(x); \
+                weights(x - oldj, wx); \
+                weights(y - oldi, wy); \
+                for (k = 0; k < N; k++) \
+                { \
+                    ii[k] = affine_mirror(oldi - (N - 1)/2 + k, yres, N/2); \
+                    jj[k] = affine_mirror(oldj - (N - 1)/2 + k, xres, N/2); \
+                } \
+                v = AFFINE_SUM##N(cdata, xres, ii, jj, wx, wy); \
+                data[newi + newxres*newj] = v; \
+                skew_stats_add(stats, v); \
+            } \
+        } \
+    } \
+}
+
+AFFINE_KERNEL(affine_kernel_linear, 2, affine_weights_linear)
+AFFINE_KERNEL(affine_kernel_key, 4, affine_weights_key)
+AFFINE_KERNEL(affine_kernel_bspline, 4, affine_weights_bspline)
+AFFINE_KERNEL(affine_kernel_omoms, 4, affine_weights_omoms)
+AFFINE_KERNEL(affine_kernel_schaum, 4, affine_weights_schaum)
+
+/* NNA weights are not separable and round is not worth it, those stay
+ * with the generic loop. */
+static AffineKernel
+affine_kernel(GwyInterpolationType interp)
+{
+    switch (interp)
+    {
+        case GWY_INTERPOLATION_LINEAR:
+            return affine_kernel_linear;
+        case GWY_INTERPOLATION_KEY:
+            return affine_kernel_key;
+        case GWY_INTERPOLATION_BSPLINE:
+            return affine_kernel_bspline;
+        case GWY_INTERPOLATION_OMOMS:
+            return affine_kernel_omoms;
+        case GWY_INTERPOLATION_SCHAUM:
+            return affine_kernel_schaum;
+        default:
+            return NULL;
+    }
+}
+
+gboolean
+skew_affine_specialized(GwyInterpolationType interp)
+{
+    return affine_kernel(interp) != NULL;
+}
+
+/* The inverse transform moved to pixel centres, as skew_affine_generic()
+ * does it. */
+static void
+affine_shift(const gdouble *invtrans, gdouble *a)
+{
+    a[0] = invtrans[0];
+    a[1] = invtrans[1];
+    a[2] = invtrans[2];
+    a[3] = invtrans[3];
+    a[4] = invtrans[4] + 0.5*(invtrans[0] + invtrans[1] - 1.0);
+    a[5] = invtrans[5] + 0.5*(invtrans[2] + invtrans[3] - 1.0);
+}
+
+/* The interpolation coefficients of source, which are the data themselves
+ * for an interpolating basis.  Otherwise they are computed in a buffer,
+ * returned in buffer for skew_buffer_free(), NULL if none was needed. */
+static const gdouble*
+affine_coefficients(GwyDataField *source, GwyInterpolationType interp,
+                    gdouble **buffer)
+{
+    gint xres, yres;
+    *buffer = NULL;
+    if (gwy_interpolation_has_interpolating_basis(interp))
+        return gwy_data_field_get_data_const(source);
+    xres = gwy_data_field_get_xres(source);
+    yres = gwy_data_field_get_yres(source);
+    *buffer = skew_buffer_alloc(xres*yres*sizeof(gdouble));
+    memcpy(*buffer, gwy_data_field_get_data_const(source),
+           xres*yres*sizeof(gdouble));
+    gwy_interpolation_resolve_coeffs_2d(xres, yres, xres, *buffer, interp);
+    return *buffer;
+}
+
+static gpointer
+buffer_aligned(gsize size, gsize align)
+{
+    gpointer mem;
+#ifdef G_OS_WIN32
+    if (!(mem = _aligned_malloc(size, align)))
+#else
+    if (posix_memalign(&mem, align, size))
+#endif
+        g_error("Failed to allocate %" G_GSIZE_FORMAT " bytes", size);
+    return mem;
+}
+
+static void
+buffer_release(gpointer mem)
+{
+#ifdef G_OS_WIN32
+    _aligned_free(mem);
+#else
+    free(mem);
+#endif
+}
+
+/* A buffer of size bytes aligned to 64 bytes, for skew_buffer_free(). */
+gpointer
+skew_buffer_alloc(gsize size)
+{
+    gpointer mem = NULL;
+    gint i, node;
+    if (buffer_plain)
+        return g_malloc(size);
+    if (size < BUFFER_HUGE_PAGE)
+        return buffer_aligned(MAX(size, 1), BUFFER_ALIGN);
+    size = (size + BUFFER_HUGE_PAGE - 1)/BUFFER_HUGE_PAGE*BUFFER_HUGE_PAGE;
+    node = numa_current_node();
+#ifdef _OPENMP
+#pragma omp critical(skew_buffer_pool)
+#endif
+    for (i = 0; i < BUFFER_POOL; i++)
+    {
+        if (buffer_pool[i].mem && buffer_pool[i].size == size
+            && buffer_pool[i].node == node)
+        {
+            mem = buffer_pool[i].mem;
+            buffer_pool[i].mem = NULL;
+            break;
+        }
+    }
+    if (mem)
+        return mem;
+    mem = buffer_aligned(size, BUFFER_HUGE_PAGE);
+#ifdef MADV_HUGEPAGE
+    madvise(mem, size, MADV_HUGEPAGE);
+#endif
+    return mem;
+}
+
+/* Releases a buffer of skew_buffer_alloc(), size being what was asked for;
+ * huge ones go to the pool while it has room.  They stay on the node that
+ * first touched them, so only threads of that node get them back. */
+void
+skew_buffer_free(gsize size, gpointer mem)
+{
+    gint i, node;
+    if (!mem)
+        return;
+    if (buffer_plain)
+    {
+        g_free(mem);
+        return;
+    }
+    if (size >= BUFFER_HUGE_PAGE)
+    {
+        size = (size + BUFFER_HUGE_PAGE - 1)/BUFFER_HUGE_PAGE
+               *BUFFER_HUGE_PAGE;
+        node = numa_current_node();
+#ifdef _OPENMP
+#pragma omp critical(skew_buffer_pool)
+#endif
+        for (i = 0; i < BUFFER_POOL; i++)
+        {
+            if (!buffer_pool[i].mem)
+            {
+                buffer_pool[i].mem = mem;
+                buffer_pool[i].size = size;
+                buffer_pool[i].node = node;
+                mem = NULL;
+                break;
+            }
+        }
+    }
+    if (mem)
+        buffer_release(mem);
+}
+
+/* Returns the pooled buffers to the system, when the dialog closes. */
+void
+skew_buffer_trim(void)
+{
+    gint i;
+#ifdef _OPENMP
+#pragma omp critical(skew_buffer_pool)
+#endif
+    for (i = 0; i < BUFFER_POOL; i++)
+    {
+        if (buffer_pool[i].mem)
+            buffer_release(buffer_pool[i].mem);
+        buffer_pool[i].mem = NULL;
+    }
+}
+
+/* Makes skew_buffer_alloc() plain g_malloc(), for the benchmark to compare.
+ * No buffer may be outstanding when this is switched. */
+void
+skew_buffer_set_plain(gboolean plain)
+{
+    skew_buffer_trim();
+    buffer_plain = plain;
+}
+
+void
+skew_stats_merge(SkewStats *stats, const SkewStats *other)
+{
+    stats->min = MIN(stats->min, other->min);
+    stats->max = MAX(stats->max, other->max);
+    stats->sum += other->sum;
+    stats->sum2 += other->sum2;
+    stats->n += other->n;
+}
+
+void
+skew_stats_attach(GwyDataField *dfield, const SkewStats *stats)
+{
+    g_object_set_data_full(G_OBJECT(dfield), SKEW_STATS_KEY,
+                           g_memdup(stats, sizeof(SkewStats)), g_free);
+}
+
+/* Drops the sums before the field leaves the module, where whoever edits it
+ * next knows nothing about them. */
+void
+skew_stats_detach(GwyDataField *dfield)
+{
+    g_object_set_data(G_OBJECT(dfield), SKEW_STATS_KEY, NULL);
+}
+
+/* The attached sums if they still cover the whole field, NULL otherwise. */
+const SkewStats*
+skew_stats_get(GwyDataField *dfield)
+{
+    const SkewStats *stats;
+    stats = g_object_get_data(G_OBJECT(dfield), SKEW_STATS_KEY);
+    if (!stats
+        || stats->n != (gwy_data_field_get_xres(dfield)
+                        *gwy_data_field_get_yres(dfield)))
+        return NULL;
+    return stats;
+}
+
+/* Resamples source into dest through the inverse pixel transform invtrans,
+ * using the specialized kernel of interp if there is one.  The statistics
+ * of dest are attached to it. */
+void
+skew_affine(GwyDataField *source, GwyDataField *dest, const gdouble *invtrans,
+            GwyInterpolationType interp, gdouble fill_value)
+{
+    AffineKernel kernel;
+    SkewStats stats;
+    const gdouble *cdata;
+    gdouble *coeff;
+    gdouble a[6];
+    g_return_if_fail(GWY_IS_DATA_FIELD(source));
+    g_return_if_fail(GWY_IS_DATA_FIELD(dest));
+    g_return_if_fail(invtrans);
+    SKEW_PROBE6(affine_entry,
+                gwy_data_field_get_xres(source),
+                gwy_data_field_get_yres(source),
+                gwy_data_field_get_xres(dest),
+                gwy_data_field_get_yres(dest), (gint)interp, 0);
+    if (!(kernel = affine_kernel(interp)))
+        skew_affine_generic(source, dest, invtrans, interp, fill_value);
+    else
+    {
+        affine_shift(invtrans, a);
+        cdata = affine_coefficients(source, interp, &coeff);
+        skew_stats_init(&stats);
+        kernel(cdata, gwy_data_field_get_xres(source),
+               gwy_data_field_get_yres(source),
+               gwy_data_field_get_data(dest),
+               gwy_data_field_get_xres(dest), gwy_data_field_get_yres(dest),
+               a, fill_value, &stats);
+        skew_buffer_free(gwy_data_field_get_xres(source)
+                         *gwy_data_field_get_yres(source)*sizeof(gdouble),
+                         coeff);
+        gwy_data_field_invalidate(dest);
+        skew_stats_attach(dest, &stats);
+    }
+    SKEW_PROBE2(affine_return,
+                gwy_data_field_get_xres(dest), gwy_data_field_get_yres(dest));
+}
+
+/* Any interpolation type, through gwy_interpolation_interpolate_2d(). */
+void
+skew_affine_generic(GwyDataField *source, GwyDataField *dest,
+                    const gdouble *invtrans,
+                    GwyInterpolationType interp, gdouble fill_value)
+{
+    SkewStats stats;
+    gdouble *data, *coeff, *cbuf;
+    const gdouble *cdata;
+    gint xres, yres, newxres, newyres;
+    gint newi, newj, oldi, oldj, i, j, ii, jj, suplen, sf, st;
+    gdouble x, y, v;
+    gdouble axx, axy, ayx, ayy, bx, by;
+    gboolean vset;
+    g_return_if_fail(GWY_IS_DATA_FIELD(source));
+    g_return_if_fail(GWY_IS_DATA_FIELD(dest));
+    g_return_if_fail(invtrans);
+    axx = invtrans[0];
+    axy = invtrans[1];
+    ayx = invtrans[2];
+    ayy = invtrans[3];
+    bx = invtrans[4];
+    by = invtrans[5];
+    suplen = gwy_interpolation_get_support_size(interp);
+    g_return_if_fail(suplen > 0);
+    coeff = g_newa(gdouble, suplen*suplen);
+    sf = -((suplen - 1)/2);
+    st = suplen/2;
+    xres = gwy_data_field_get_xres(source);
+    yres = gwy_data_field_get_yres(source);
+    newxres = gwy_data_field_get_xres(dest);
+    newyres = gwy_data_field_get_yres(dest);
+    cdata = affine_coefficients(source, interp, &cbuf);
+    data = gwy_data_field_get_data(dest);
+    bx += 0.5*(axx + axy - 1.0);
+    by += 0.5*(ayx + ayy - 1.0);
+    skew_stats_init(&stats);
+    for (newi = 0; newi < newxres; newi++)
+    {
+        for (newj = 0; newj < newyres; newj++)
+        {
+            x = axx*newi + ayx*newj + bx;
+            y = axy*newi + ayy*newj + by;
+            vset = FALSE;
+            if (y > yres || x > xres || y < 0.0 || x < 0.0) {
+                v = fill_value;
+                vset = TRUE;
+            }
+            if (!vset) {
+                oldi = (gint)floor(y);
+                y -= oldi;
+                oldj = (gint)floor(x);
+                x -= oldj;
+                for (i = sf; i <= st; i++) {
+                    ii = (oldi + i + 2*st*yres) % (2*yres);
+                    if (G_UNLIKELY(ii >= yres))
+                        ii = 2*yres-1 - ii;
+                    for (j = sf; j <= st; j++) {
+                        jj = (oldj + j + 2*st*xres) % (2*xres);
+                        if (G_UNLIKELY(jj >= xres))
+                            jj = 2*xres-1 - jj;
+                        coeff[(i - sf)*suplen + j - sf] = cdata[ii*xres + jj];
+                    }
+                }
+                v = gwy_interpolation_interpolate_2d(x, y, suplen, coeff,
+                                                     interp);
+            }
+            data[newi + newxres*newj] = v;
+            skew_stats_add(&stats, v);
+        }
+    }
+    skew_buffer_free(xres*yres*sizeof(gdouble), cbuf);
+    gwy_data_field_invalidate(dest);
+    skew_stats_attach(dest, &stats);
+}
+
+/* Bilinear resampling of 16-bit samples with Q15 weights.  Each product
+ * fits 31 bits and the two weights of a pair sum to 1 << 15, so the row
+ * and column passes accumulate in 32 bits and round once each. */
+void
+skew_resample_q15(const guint16 *src, gint xres, gint yres,
+                  guint16 *dest, gint newxres, gint newyres,
+                  const gdouble *invtrans, guint16 fill)
+{
+    const guint16 *r0, *r1;
+    gdouble a[6];
+    gdouble x, y;
+    guint32 wx, wy, v0, v1;
+    gint newi, newj, oldi, oldj, j0, j1, col, colend;
+    affine_shift(invtrans, a);
+    for (col = 0; col < newxres; col += AFFINE_STRIP)
+    {
+        colend = MIN(col + AFFINE_STRIP, newxres);
+        for (newj = 0; newj < newyres; newj++)
+        {
+            for (newi = col; newi < colend; newi++)
+            {
+                x = a[0]*newi + a[2]*newj + a[4];
+                y = a[1]*newi + a[3]*newj + a[5];
+                if (y > yres || x > xres || y < 0.0 || x < 0.0)
+                {
+                    dest[newi + newxres*newj] = fill;
+                    continue;
+                }
+                oldi = (gint)floor(y);
+                oldj = (gint)floor(x);
+                wx = (guint32)((x - oldj)*32768.0 + 0.5);
+                wy = (guint32)((y - oldi)*32768.0 + 0.5);
+                r0 = src + affine_mirror(oldi, yres, 1)*xres;
+                r1 = src + affine_mirror(oldi + 1, yres, 1)*xres;
+                j0 = affine_mirror(oldj, xres, 1);
+                j1 = affine_mirror(oldj + 1, xres, 1);
+                v0 = ((32768 - wx)*r0[j0] + wx*r0[j1] + 16384) >> 15;
+                v1 = ((32768 - wx)*r1[j0] + wx*r1[j1] + 16384) >> 15;
+                dest[newi + newxres*newj]
+                    = (guint16)(((32768 - wy)*v0 + wy*v1 + 16384) >> 15);
+            }
+        }
+    }
+}
+
+/* skew_affine() with bilinear interpolation done on 16-bit samples.  The
+ * values, fill included, are quantized to 65536 levels spanning their
+ * range and scaled back to physical units in dest, where the statistics
+ * are gathered; the result is within two levels of the floating point
+ * one. */
+void
+skew_affine_fixed(GwyDataField *source, GwyDataField *dest,
+                  const gdouble *invtrans, gdouble fill_value)
+{
+    const gdouble *d;
+    SkewStats stats;
+    gdouble *o;
+    guint16 *src, *buf;
+    gdouble min, max, q;
+    gint xres, yres, newxres, newyres, k;
+    g_return_if_fail(GWY_IS_DATA_FIELD(source));
+    g_return_if_fail(GWY_IS_DATA_FIELD(dest));
+    g_return_if_fail(invtrans);
+    xres = gwy_data_field_get_xres(source);
+    yres = gwy_data_field_get_yres(source);
+    newxres = gwy_data_field_get_xres(dest);
+    newyres = gwy_data_field_get_yres(dest);
+    SKEW_PROBE6(affine_entry, xres, yres, newxres, newyres,
+                (gint)GWY_INTERPOLATION_LINEAR, 1);
+    gwy_data_field_get_min_max(source, &min, &max);
+    min = MIN(min, fill_value);
+    max = MAX(max, fill_value);
+    q = (max > min) ? 65535.0/(max - min) : 0.0;
+    src = skew_buffer_alloc(xres*yres*sizeof(guint16));
+    buf = skew_buffer_alloc(newxres*newyres*sizeof(guint16));
+    d = gwy_data_field_get_data_const(source);
+    for (k = 0; k < xres*yres; k++)
+        src[k] = (guint16)((d[k] - min)*q + 0.5);
+    skew_resample_q15(src, xres, yres, buf, newxres, newyres, invtrans,
+                      (guint16)((fill_value - min)*q + 0.5));
+    o = gwy_data_field_get_data(dest);
+    q = (max - min)/65535.0;
+    skew_stats_init(&stats);
+    for (k = 0; k < newxres*newyres; k++)
+    {
+        o[k] = min + q*buf[k];
+        skew_stats_add(&stats, o[k]);
+    }
+    skew_buffer_free(xres*yres*sizeof(guint16), src);
+    skew_buffer_free(newxres*newyres*sizeof(guint16), buf);
+    gwy_data_field_invalidate(dest);
+    skew_stats_attach(dest, &stats);
+    SKEW_PROBE2(affine_return, newxres, newyres);
+}
+
+static void
+numa_init(void)
+{
+    static gsize initialized = 0;
+    gchar path[64];
+    gchar *list, *end;
+    const gchar *p;
+    glong first, last, c;
+    gint k, n;
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t allowed;
+    gboolean have_allowed;
+#endif
+    if (!g_once_init_enter(&initialized))
+        return;
+#ifdef HAVE_SCHED_SETAFFINITY
+    CPU_ZERO(&allowed);
+    have_allowed = !sched_getaffinity(0, sizeof(allowed), &allowed);
+#endif
+    for (c = 0; c < NUMA_MAX_CPUS; c++)
+        numa.cpu_node[c] = -1;
+    for (k = 0; k < NUMA_MAX_NODES; k++)
+    {
+        g_snprintf(path, sizeof(path),
+                   "/sys/devices/system/node/node%d/cpulist", k);
+        if (!g_file_get_contents(path, &list, NULL, NULL))
+            continue;
+        n = 0;
+        for (p = list; *p && *p != '\n'; p = (*end == ',') ? end + 1 : end)
+        {
+            first = last = strtol(p, &end, 10);
+            if (end == p)
+                break;
+            if (*end == '-')
+            {
+                p = end + 1;
+                last = strtol(p, &end, 10);
+            }
+            for (c = MAX(first, 0); c <= last && c < NUMA_MAX_CPUS; c++)
+            {
+#ifdef HAVE_SCHED_SETAFFINITY
+                if (have_allowed && !CPU_ISSET(c, &allowed))
+                    continue;
+#endif
+                numa.cpu_node[c] = numa.nnodes;
+                n++;
+            }
+        }
+        g_free(list);
+        if (n)
+            numa.node_ncpus[numa.nnodes++] = n;
+    }
+    if (!numa.nnodes)
+    {
+        for (c = 0; c < NUMA_MAX_CPUS; c++)
+            numa.cpu_node[c] = -1;
+        numa.nnodes = 1;
+#ifdef _OPENMP
+        numa.node_ncpus[0] = omp_get_num_procs();
+#else
+        numa.node_ncpus[0] = 1;
+#endif
+    }
+    g_once_init_leave(&initialized, 1);
+}
+
+/* The node of the CPU the calling thread runs on. */
+static gint
+numa_current_node(void)
+{
+#ifdef HAVE_SCHED_GETCPU
+    gint cpu;
+    numa_init();
+    cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < NUMA_MAX_CPUS && numa.cpu_node[cpu] >= 0)
+        return numa.cpu_node[cpu];
+#endif
+    return 0;
+}
+
+/* The number of NUMA nodes skew_batch_run() can spread over. */
+gint
+skew_numa_nodes(void)
+{
+    numa_init();
+    return numa.nnodes;
+}
+
+/* Calls func for items 0 to n-1 on threads pinned to NUMA nodes, at most
+ * max_nodes of them if it is positive.  The items are split among the
+ * nodes in proportion to their threads, in contiguous runs, and a thread
+ * takes from its own node's queue and only when that is empty from the
+ * others.  What func allocates and fills is then first touched, and thus
+ * placed, on the node that works on it.  func must be thread-safe. */
+void
+skew_batch_run(gint n, SkewBatchFunc func, gpointer user_data,
+               gint max_nodes)
+{
+    BatchQueue *queues;
+    gint used[NUMA_MAX_NODES];
+    gint *thread_node;
+    gint nnodes, nthreads, k, t, start;
+    g_return_if_fail(func);
+    if (n <= 0)
+        return;
+    numa_init();
+    nnodes = numa.nnodes;
+    if (max_nodes > 0)
+        nnodes = MIN(nnodes, max_nodes);
+    nthreads = 0;
+    for (k = 0; k < nnodes; k++)
+    {
+        nthreads += numa.node_ncpus[k];
+        used[k] = 0;
+    }
+#ifdef _OPENMP
+    nthreads = MIN(nthreads, omp_get_max_threads());
+#else
+    nthreads = 1;
+#endif
+    nthreads = CLAMP(nthreads, 1, n);
+    thread_node = g_new(gint, nthreads);
+    for (t = k = 0; t < nthreads; k = (k + 1) % nnodes)
+    {
+        if (used[k] < numa.node_ncpus[k])
+        {
+            thread_node[t++] = k;
+            used[k]++;
+        }
+    }
+    queues = buffer_aligned(nnodes*sizeof(BatchQueue), BUFFER_ALIGN);
+    for (k = start = 0; k < nnodes; k++)
+    {
+        queues[k].next = start;
+        start = (k == nnodes-1) ? n : start + (gint)((gint64)n*used[k]
+                                                     /nthreads);
+        queues[k].end = start;
+    }
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads)
+#endif
+    {
+        BatchQueue *q;
+        gint node, item, j;
+#ifdef HAVE_SCHED_SETAFFINITY
+        cpu_set_t saved, mask;
+        gboolean pinned = FALSE;
+        gint c;
+#endif
+#ifdef _OPENMP
+        node = thread_node[omp_get_thread_num()];
+#else
+        node = thread_node[0];
+#endif
+#ifdef HAVE_SCHED_SETAFFINITY
+        CPU_ZERO(&mask);
+        for (c = 0; c < NUMA_MAX_CPUS; c++)
+        {
+            if (numa.cpu_node[c] == node)
+                CPU_SET(c, &mask);
+        }
+        if (CPU_COUNT(&mask) && !sched_getaffinity(0, sizeof(saved), &saved))
+            pinned = !sched_setaffinity(0, sizeof(mask), &mask);
+#endif
+        for (j = 0; j < nnodes; j++)
+        {
+            q = queues + (node + j) % nnodes;
+            while ((item = g_atomic_int_add(&q->next, 1)) < q->end)
+                func(item, user_data);
+        }
+#ifdef HAVE_SCHED_SETAFFINITY
+        if (pinned)
+            sched_setaffinity(0, sizeof(saved), &saved);
+#endif
+    }
+    buffer_release(queues);
+    g_free(thread_node);
+}
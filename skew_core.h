@@ -0,0 +1,125 @@
+/*
+ *  @(#) $Id: skew_core.h 2014-05-08 $
+ *  Copyright (C) 2014 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ *  The resampling core of skew_lattice.  It only needs libprocess, so the
+ *  benchmark can be built against it without the GUI.
+ */
+
+#ifndef __SKEW_CORE_H__
+#define __SKEW_CORE_H__
+
+#include <math.h>
+#include <libprocess/datafield.h>
+#include <libprocess/interpolation.h>
+
+/* Sums of the values a kernel wrote, attached to the field it wrote them
+ * to under SKEW_STATS_KEY, so that nobody has to scan the field again for
+ * its range.  They stay valid until the field is written again; whoever
+ * writes it attaches new ones or removes them. */
+#define SKEW_STATS_KEY "skew-stats"
+
+typedef struct {
+    gdouble min;
+    gdouble max;
+    gdouble sum;
+    gdouble sum2;
+    gint n;
+} SkewStats;
+
+/* One item of the work skew_batch_run() distributes. */
+typedef void (*SkewBatchFunc)(gint i, gpointer user_data);
+
+static inline void
+skew_stats_init(SkewStats *stats)
+{
+    stats->min = G_MAXDOUBLE;
+    stats->max = -G_MAXDOUBLE;
+    stats->sum = stats->sum2 = 0.0;
+    stats->n = 0;
+}
+
+static inline void
+skew_stats_add(SkewStats *stats, gdouble v)
+{
+    if (v < stats->min)
+        stats->min = v;
+    if (v > stats->max)
+        stats->max = v;
+    stats->sum += v;
+    stats->sum2 += v*v;
+    stats->n++;
+}
+
+static inline gdouble
+skew_stats_avg(const SkewStats *stats)
+{
+    return stats->n ? stats->sum/stats->n : 0.0;
+}
+
+static inline gdouble
+skew_stats_rms(const SkewStats *stats)
+{
+    gdouble avg = skew_stats_avg(stats);
+    return stats->n ? sqrt(MAX(stats->sum2/stats->n - avg*avg, 0.0)) : 0.0;
+}
+
+void     skew_affine              (GwyDataField *source,
+                                   GwyDataField *dest,
+                                   const gdouble *invtrans,
+                                   GwyInterpolationType interp,
+                                   gdouble fill_value);
+void     skew_affine_generic      (GwyDataField *source,
+                                   GwyDataField *dest,
+                                   const gdouble *invtrans,
+                                   GwyInterpolationType interp,
+                                   gdouble fill_value);
+gboolean skew_affine_specialized  (GwyInterpolationType interp);
+gpointer skew_buffer_alloc        (gsize size);
+void     skew_buffer_free         (gsize size,
+                                   gpointer mem);
+void     skew_buffer_trim         (void);
+void     skew_buffer_set_plain    (gboolean plain);
+gint     skew_numa_nodes          (void);
+void     skew_batch_run           (gint n,
+                                   SkewBatchFunc func,
+                                   gpointer user_data,
+                                   gint max_nodes);
+void     skew_stats_merge         (SkewStats *stats,
+                                   const SkewStats *other);
+void     skew_stats_attach        (GwyDataField *dfield,
+                                   const SkewStats *stats);
+void     skew_stats_detach        (GwyDataField *dfield);
+const SkewStats* skew_stats_get   (GwyDataField *dfield);
+void     skew_affine_fixed        (GwyDataField *source,
+                                   GwyDataField *dest,
+                                   const gdouble *invtrans,
+                                   gdouble fill_value);
+void     skew_resample_q15        (const guint16 *src,
+                                   gint xres,
+                                   gint yres,
+                                   guint16 *dest,
+                                   gint newxres,
+                                   gint newyres,
+                                   const gdouble *invtrans,
+                                   guint16 fill);
+
+#endif /* __SKEW_CORE_H__ */
@@ -1,1497 +1,6255 @@
-/*
- *  @(#) $Id: skew_lattice.c 2014-05-08 $
- *  Copyright (C) 2014 Jeffrey J. Schwartz.
- *  E-mail: schwartz@physics.ucla.edu
- *
- *  This program is free software; you can redistribute it and/or modify
- *  it under the terms of the GNU General Public License as published by
- *  the Free Software Foundation; either version 2 of the License, or
- *  (at your option) any later version.
- *
- *  This program is distributed in the hope that it will be useful,
- *  but WITHOUT ANY WARRANTY; without even the implied warranty of
- *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
- *  GNU General Public License for more details.
- *
- *  You should have received a copy of the GNU General Public License
- *  along with this program; if not, write to the Free Software
- *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
- *  Boston, MA 02110-1301, USA.
- */
-
-/*
- *  This program skews SPM images in an attempt to compensate for
- *  lateral drift during imaging. Skewing the images by sequential
- *  lateral translations of subsequent rows/cols in the image is 
- *  used to regularize the lattice to its known parameters. Angles
- *  between lattice features may be measured in the program to aid
- *  the user to determining the optimal skew amount.
- */
-
-#include "config.h"
-#include <string.h>
-#include <gtk/gtk.h>
-#include <app/gwyapp.h>
-#include <app/gwymoduleutils.h>
-#include <libprocess/stats.h>
-#include <libprocess/filters.h>
-#include <libprocess/inttrans.h>
-#include <libprocess/datafield.h>
-#include <libprocess/gwyprocess.h>
-#include <libgwyddion/gwymath.h>
-#include <libgwydgets/gwydataview.h>
-#include <libgwydgets/gwydgetutils.h>
-#include <libgwydgets/gwynullstore.h>
-#include <libgwydgets/gwylayer-basic.h>
-#include <libgwydgets/gwyradiobuttons.h>
-#include <libgwymodule/gwymodule-process.h>
-
-#define skew_lattice_RUN_MODES (GWY_RUN_INTERACTIVE)
-#define PI 3.14159265358979323846
-
-typedef struct _GwyToolLevel3      GwyToolLevel3;
-
-typedef struct _GwyToolLevel3Class GwyToolLevel3Class;
-
-struct _GwyToolLevel3
-{
-    GwyPlainTool parent_instance;
-    GtkTreeView *treeview;
-    GtkTreeModel *model;
-    GtkObject *radius;
-    gint32 rpx;
-    GtkWidget *instant_apply;
-    GtkWidget *set_zero;
-    GtkWidget *apply;
-    GType layer_type_point;
-};
-
-enum
-{
-    COLUMN_I,
-    COLUMN_X,
-    COLUMN_Y,
-    COLUMN_Z,
-    NCOLUMNS
-};
-
-enum
-{
-    PREVIEW_SIZE = 512
-};
-
-typedef enum {
-    IMAGE_DATA,
-    IMAGE_FFT,
-    IMAGE_CORRECTED,
-    IMAGE_FFT_CORRECTED,
-} ImageMode;
-
-typedef enum {
-    ZOOM_1 = 1,
-    ZOOM_2 = 2,
-} ZoomMode;
-
-typedef enum {
-    HORIZONTAL,
-    VERTICAL,
-} ShiftMode;
-
-typedef struct {
-    gdouble lower;
-    gdouble upper;
-    gfloat Xskew;
-    gfloat Yskew;
-    gdouble angle1;
-    gdouble angle2;
-    ImageMode image_mode;
-    ZoomMode zoom_mode;
-    gint copy_row_start;
-    gint copy_col_start;
-    gdouble background_fill;
-    gboolean background;
-    gint newxres;
-    gint newyres;
-} ThresholdArgs;
-
-typedef struct {
-    gdouble min, max;
-} ThresholdRanges;
-
-typedef struct {
-    ThresholdArgs *args;
-    ThresholdRanges *ranges;
-    GtkWidget *dialog;
-    GtkWidget *view;
-    GtkWidget *lower;
-    GtkWidget *upper;
-    GtkWidget *hskewtxt;
-    GtkWidget *vskewtxt;
-    GwyContainer *mydata;
-    GwyContainer *container;
-    GwyDataField *dfield;
-    GwyDataField *image;
-    GwyDataField *corr_image;
-    GwyDataField *corr_fft;
-    GwyDataField *disp_data;
-    gint id;
-    GwySelection *selection;
-    GwySIValueFormat *original_XY_Format;
-    GwySIValueFormat *XY_Format;
-    GwySIValueFormat *Z_Format;
-    GwySIUnit *Image_XY_Units;
-    GwySIUnit *Image_Z_Units;
-    GwyToolLevel3 *tool;
-    GSList *image_mode_radios;
-    GSList *zoom_mode_radios;
-    GtkObject *skew_Xadjust;
-    GtkWidget *skew_Xslider;
-    GtkObject *skew_Yadjust;
-    GtkWidget *skew_Yslider;
-    GtkWidget *Angle1;
-    GtkWidget *Angle2;
-    gdouble p[4][3];
-    GwyVectorLayer *vlayer;
-} ThresholdControls;
-
-static gboolean module_register             (void);
-
-static void     skew_lattice                 (GwyContainer *data, GwyRunType run);
-static void     perform_fft                 (GwyDataField *dfield,
-                                                GwyContainer *data);
-static void     selection_changed           (ThresholdControls *controls);
-static void     clear_points                (ThresholdControls *controls);
-static void     peak_find                   (ThresholdControls *controls,
-                                                gdouble *point, guint idx);
-static void     skew_do                     (ThresholdControls *controls);
-static void     skew_create_output          (GwyContainer *data, 
-                                                GwyDataField *dfield,
-                                                ThresholdControls *controls);
-static void     skew_lattice_dialog             (ThresholdControls *controls,
-                                            ThresholdRanges *ranges,
-                                            GwyContainer *data,
-                                            GwyDataField *dfield,
-                                            gint id);
-static void     threshold_set_to_full_range(ThresholdControls *controls);
-static void     threshold_lower_changed    (ThresholdControls *controls);
-static void     threshold_upper_changed    (ThresholdControls *controls);
-static void     preview                    (ThresholdControls *controls);
-static void     threshold_do               (ThresholdArgs *args,
-                                            GwyDataField *dfield);
-static void     threshold_load_args        (ThresholdControls *controls);
-static void     threshold_save_args        (ThresholdControls *controls);
-static void     zoom_mode_changed          (GtkToggleButton *button,
-                                            ThresholdControls *controls);
-static void     image_mode_changed         (GtkToggleButton *button,
-                                            ThresholdControls *controls);
-static void     gwy_tool_level3_render_cell    (GtkCellLayout *layout,
-                            GtkCellRenderer *renderer, GtkTreeModel *model,
-                            GtkTreeIter *iter, gpointer user_data);
-static void     gwy_tool_level3_radius_changed(GwyToolLevel3 *tool);
-static void     fft_postprocess            (GwyDataField *dfield);
-static void     set_dfield_modulus         (GwyDataField *re, GwyDataField *im,
-                                                GwyDataField *target);
-static void radio_buttons_attach_to_table  (GSList *group,
-                                                GtkTable *table, gint row);
-static void     skew_update_angles      (ThresholdControls *controls);
-static void     get_angles              (ThresholdControls *controls);
-static void     reFind_Peaks            (ThresholdControls *controls);
-static void     zoom_adjust_peaks       (ThresholdControls *controls);
-static void     skew_Xadjusted          (ThresholdControls *controls);
-static void     skew_Yadjusted          (ThresholdControls *controls);
-static void     skew_process            (ThresholdControls *controls);
-static void     reset_Xskew             (ThresholdControls *controls);
-static void     reset_Yskew             (ThresholdControls *controls);
-static void     hskew_changed           (ThresholdControls *controls);
-static void     vskew_changed           (ThresholdControls *controls);
-static gdouble  matrix_det              (const gdouble *m);
-static void     invert_matrix           (gdouble *dest, const gdouble *src);
-static gdouble  deg2rad                 (const gdouble deg);
-static void     mult_3matrix            (gdouble *dest, const gdouble *mat1,
-                                        const gdouble *mat2);
-static void     affine                  (GwyDataField *source,
-                                        GwyDataField *dest,
-                                        const gdouble *invtrans,
-                                        GwyInterpolationType interp,
-                                        gdouble fill_value);
-
-static const ThresholdArgs threshold_defaults = {
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 3, 1, 0, 0, 0.0, FALSE, 0, 0
-};
-
-
-static GwyModuleInfo module_info = {
-    GWY_MODULE_ABI_VERSION, &module_register,
-    N_("Tool to correct for lateral drift during scanning probe imaging; "
-    "skews image to obtain regular lattice shape."),
-    "Jeffrey J. Schwartz <schwartz@physics.ucla.edu>",
-    "1.0",
-    "Jeffrey J. Schwartz",
-    "May 2014",
-};
-
-GWY_MODULE_QUERY(module_info)
-
-static gboolean
-module_register(void)
-{
-    gwy_process_func_register("skew_lattice",
-                (GwyProcessFunc)&skew_lattice,
-                N_("/_Correct Data/_Skew Lattice"),
-                NULL, skew_lattice_RUN_MODES, GWY_MENU_FLAG_DATA,
-                N_("Skews image to form regular lattice"));
-    return TRUE;
-}
-
-static void
-skew_lattice(GwyContainer *data, GwyRunType run)
-{
-    ThresholdControls controls;
-    ThresholdArgs args;
-    ThresholdRanges ranges;
-    GwyDataField *dfield;
-    GQuark quark;
-    gint id;
-    GwyToolLevel3 tool;
-    tool.rpx = 3;
-    args = threshold_defaults;
-    controls.args = &args;
-    controls.tool = &tool;
-    g_return_if_fail(run & skew_lattice_RUN_MODES);
-    gwy_app_data_browser_get_current(GWY_APP_DATA_FIELD, &dfield,
-                                     GWY_APP_DATA_FIELD_ID, &id,
-                                     GWY_APP_DATA_FIELD_KEY, &quark, 0);
-    g_return_if_fail(dfield);
-    if (run == GWY_RUN_INTERACTIVE)
-    {
-        skew_lattice_dialog(&controls, &ranges, data,
-            gwy_data_field_duplicate(dfield), id);
-        gwy_data_field_data_changed(dfield);
-    }
-}
-
-static void
-threshold_format_value(ThresholdControls *controls,
-                       GtkEntry *entry, gdouble value)
-{
-    gchar *s;
-    s = g_strdup_printf("%.*f",
-                        controls->original_XY_Format->precision+1,
-                        value/controls->original_XY_Format->magnitude);
-    gtk_entry_set_text(GTK_ENTRY(entry), s);
-    g_free(s);
-}
-
-static GtkWidget*
-threshold_entry_attach(ThresholdControls *controls,
-                       GtkTable *table, gint row,
-                       gdouble value, const gchar *name)
-{
-    GtkWidget *label, *entry;
-    label = gtk_label_new_with_mnemonic(name);
-    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
-    gtk_table_attach(table, label, 0, 1, row, row+1, GTK_FILL, 0, 0, 0);
-    entry = gtk_entry_new();
-    gwy_widget_set_activate_on_unfocus(entry, TRUE);
-    gtk_entry_set_width_chars(GTK_ENTRY(entry), 8);
-    threshold_format_value(controls, GTK_ENTRY(entry), value);
-    gtk_table_attach(table, entry, 1, 3, row, row+1, GTK_FILL, 0, 0, 0);
-    label = gtk_label_new(controls->original_XY_Format->units);
-    gtk_label_set_markup(GTK_LABEL(label),
-                                    controls->original_XY_Format->units);
-    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
-    gtk_table_attach(table, label, 3, 4, row, row+1, GTK_FILL, 0, 0, 0);
-    return entry;
-}
-
-static void
-skew_lattice_dialog(ThresholdControls *controls, ThresholdRanges *ranges,
-                 GwyContainer *data, GwyDataField *dfield, gint id)
-{
-    GtkWidget *dialog, *hbox, *button, *label;
-    GtkTable *table;
-    GwyVectorLayer *vlayer;
-    gint response, row;
-    GwyPixmapLayer *layer;
-    controls->image = gwy_data_field_duplicate(dfield);
-    controls->corr_image = gwy_data_field_duplicate(controls->image);
-    controls->container = data;
-    controls->id = id;    
-    controls->ranges = ranges;
-    controls->dfield = dfield;
-    controls->disp_data = gwy_data_field_new_alike(dfield, TRUE);
-    controls->original_XY_Format = gwy_data_field_get_value_format_xy
-                            (dfield, GWY_SI_UNIT_FORMAT_MARKUP, NULL);
-    controls->Image_XY_Units = gwy_data_field_get_si_unit_xy(controls->image);
-    controls->Image_Z_Units = gwy_data_field_get_si_unit_z(controls->image);
-    controls->mydata = gwy_container_new();
-    perform_fft(controls->dfield, controls->mydata);
-    controls->corr_fft = gwy_data_field_duplicate(controls->dfield);
-    gwy_data_field_get_min_max(dfield, &ranges->min, &ranges->max);
-    controls->XY_Format = gwy_data_field_get_value_format_xy
-                            (dfield, GWY_SI_UNIT_FORMAT_MARKUP, NULL);
-    controls->Z_Format = gwy_data_field_get_value_format_z
-                            (dfield, GWY_SI_UNIT_FORMAT_MARKUP, NULL);
-    dialog = gtk_dialog_new_with_buttons(_("Skew Lattice"), NULL, 0,
-                            GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
-                            GTK_STOCK_OK, GTK_RESPONSE_OK, NULL);
-    gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_OK);
-    controls->dialog = dialog;
-    hbox = gtk_hbox_new(FALSE, 2);
-    gtk_box_pack_start(GTK_BOX(GTK_DIALOG(dialog)->vbox), hbox,
-                       FALSE, FALSE, 4);
-    table = GTK_TABLE(gtk_table_new(4, 4, FALSE));
-    gtk_table_set_row_spacings(table, 2);
-    gtk_table_set_col_spacings(table, 6);
-    gtk_container_set_border_width(GTK_CONTAINER(table), 4);
-    gtk_box_pack_start(GTK_BOX(hbox), GTK_WIDGET(table), TRUE, TRUE, 4);
-    label = gtk_label_new("Data Display");
-    gtk_label_set_markup(GTK_LABEL(label),
-        "<b>Data Display</b>\n(FFT: Modulus, Hanning window, subtract mean)");
-    gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
-    gtk_misc_set_alignment(GTK_MISC(label), 0.5, 0.5);
-    gtk_table_attach(table, label, 0, 4, 0, 1, GTK_FILL, 0, 0, 0);
-    gwy_app_sync_data_items(data, controls->mydata, id, 0, FALSE,
-                GWY_DATA_ITEM_PALETTE, GWY_DATA_ITEM_MASK_COLOR,
-                GWY_DATA_ITEM_RANGE, GWY_DATA_ITEM_REAL_SQUARE, 0);
-    gwy_container_set_object_by_name(controls->mydata, "/0/data", dfield);
-    controls->view = gwy_data_view_new(controls->mydata);
-    layer = gwy_layer_basic_new();
-    g_object_set(layer, "data-key", "/0/data",
-                 "gradient-key", "/0/base/palette",
-                 "range-type-key", "/0/base/range-type",
-                 "min-max-key", "/0/base", NULL);
-    gwy_data_view_set_data_prefix(GWY_DATA_VIEW(controls->view), "/0/data");
-    gwy_data_view_set_base_layer(GWY_DATA_VIEW(controls->view), layer);
-    gwy_set_data_preview_size(GWY_DATA_VIEW(controls->view), PREVIEW_SIZE);
-    vlayer = g_object_new(g_type_from_name("GwyLayerPoint"),
-                  "selection-key", "/0/select/point", NULL);
-    controls->vlayer = vlayer;
-    gwy_data_view_set_top_layer(GWY_DATA_VIEW(controls->view), vlayer);
-    controls->selection = gwy_vector_layer_ensure_selection(vlayer);
-    gwy_selection_set_max_objects(controls->selection, 4);
-    g_signal_connect_swapped(controls->selection, "changed",
-                         G_CALLBACK(selection_changed), controls);
-    gtk_table_attach(table, controls->view, 0, 4, 1, 2, GTK_FILL, 0, 0, 0);
-    label = gtk_label_new("Select four sequential peaks "
-                          "in the first ring around center");
-    gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
-    gtk_misc_set_alignment(GTK_MISC(label), 0.5, 0.5);
-    gtk_table_attach(table, label, 0, 4, 2, 3, GTK_FILL, 0, 0, 0);
-    controls->Angle1 = gtk_label_new("Angle 123:");
-    gtk_label_set_markup(GTK_LABEL(controls->Angle1), "<b>Angle 123:</b>");
-    gtk_label_set_width_chars (GTK_LABEL(controls->Angle1), 15);
-    gtk_misc_set_alignment(GTK_MISC(controls->Angle1), 0.0, 0.0);
-    gtk_table_attach(table, controls->Angle1, 2, 3,
-                                            3, 4, GTK_FILL, 0, 0, 0);
-    controls->Angle2 = gtk_label_new("Angle 234:");
-    gtk_label_set_markup(GTK_LABEL(controls->Angle2), "<b>Angle 234:</b>");
-    gtk_label_set_width_chars (GTK_LABEL(controls->Angle2), 15);
-    gtk_misc_set_alignment(GTK_MISC(controls->Angle2), 0.0, 1.0);
-    gtk_table_attach(table, controls->Angle2, 3, 4,
-                                            3, 4, GTK_FILL, 0, 0, 0);
-    table = GTK_TABLE(gtk_table_new(7, 4, FALSE));
-    gtk_table_set_row_spacings(table, 2);
-    gtk_table_set_col_spacings(table, 6);
-    gtk_container_set_border_width(GTK_CONTAINER(table), 4);
-    gtk_box_pack_start(GTK_BOX(hbox), GTK_WIDGET(table), TRUE, TRUE, 4);
-    row = 0;
-    label = gtk_label_new("Display Zoom: ");
-    gtk_label_set_markup(GTK_LABEL(label), "<b>Zoom:</b>");
-    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.0);
-    gtk_table_attach(table, label, 0, 1, row, row+1, GTK_FILL, 0, 0, 0);
-    row++;    
-    controls->zoom_mode_radios
-        = gwy_radio_buttons_createl(G_CALLBACK(zoom_mode_changed), controls,
-                                    controls->args->zoom_mode,
-                                    _("×1"), ZOOM_1,
-                                    _("×2"), ZOOM_2,
-                                    NULL);
-    radio_buttons_attach_to_table(controls->zoom_mode_radios, table, row);
-    row++;
-    label = gtk_label_new("Specify intensity range:");
-    gtk_label_set_markup(GTK_LABEL(label), "<b>Specify intensity range:</b>");
-    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
-    gtk_table_attach(table, label, 0, 7, row, row+1, GTK_FILL, 0, 0, 0);
-    row++;
-    controls->lower = threshold_entry_attach(controls, table,
-                             row, controls->args->lower, _("_Lower:"));
-    g_signal_connect_swapped(controls->lower, "activate",
-                             G_CALLBACK(threshold_lower_changed), controls);
-    row++;
-    controls->upper = threshold_entry_attach(controls, table, row,
-                            controls->args->upper, _("_Upper:"));
-    g_signal_connect_swapped(controls->upper, "activate",
-                            G_CALLBACK(threshold_upper_changed), controls);
-    row++;
-    button = gtk_button_new_with_mnemonic(_("Set to _Full Range"));
-    gtk_table_attach(table, button, 0, 4, row, row+1, GTK_FILL, 0, 0, 0);
-    g_signal_connect_swapped(button, "clicked",
-                             G_CALLBACK(threshold_set_to_full_range),
-                             controls);
-    row++;
-    gtk_table_set_row_spacing(GTK_TABLE(table), row-1, 20);
-    label = gtk_label_new("Peak Positions:");
-    gtk_label_set_markup(GTK_LABEL(label), "<b>Peak positions:</b>");
-    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
-    gtk_table_attach(table, label, 0, 4, row, row+1, GTK_FILL, 0, 0, 0);
-    row++;
-    GtkTreeViewColumn *column;
-    GtkCellRenderer *renderer;
-    GwyNullStore *store;
-    store = gwy_null_store_new(4);
-    controls->tool->model = GTK_TREE_MODEL(store);
-    controls->tool->treeview =
-        GTK_TREE_VIEW(gtk_tree_view_new_with_model(controls->tool->model));
-    gchar *XUnits, *YUnits, *ZUnits;
-    XUnits = g_strdup_printf("<b>x</b> [%s]", controls->XY_Format->units);
-    YUnits = g_strdup_printf("<b>y</b> [%s]", controls->XY_Format->units);
-    ZUnits = g_strdup_printf("<b>value</b> [%s]", controls->Z_Format->units);
-    guint i;
-    for (i = 0; i < NCOLUMNS; i++) {
-        column = gtk_tree_view_column_new();
-        g_object_set_data(G_OBJECT(column), "id", GUINT_TO_POINTER(i));
-        renderer = gtk_cell_renderer_text_new();
-        g_object_set(renderer, "xalign", 1.0, NULL);
-        gtk_cell_layout_pack_start(GTK_CELL_LAYOUT(column), renderer, TRUE);
-        gtk_cell_layout_set_cell_data_func(GTK_CELL_LAYOUT(column), renderer,
-                                            gwy_tool_level3_render_cell,
-                                            controls, NULL);
-        label = gtk_label_new(NULL);
-        switch (i)
-        {
-            case 0:
-                gtk_label_set_markup(GTK_LABEL(label), "<b>n</b>");
-                break;
-            case 1:
-                gtk_label_set_markup(GTK_LABEL(label), XUnits);
-                break;
-            case 2:
-                gtk_label_set_markup(GTK_LABEL(label), YUnits);
-                break;
-            case 3:
-                gtk_label_set_markup(GTK_LABEL(label), ZUnits);
-                break;
-        }
-        gtk_tree_view_column_set_widget(column, label);
-        gtk_widget_show(label);
-        gtk_tree_view_append_column(controls->tool->treeview, column);
-    }
-    gtk_table_attach(table, GTK_WIDGET(controls->tool->treeview),
-            0, 4, row, row+1, GTK_FILL, 0, 0, 0);
-    row++;
-    g_free(XUnits);
-    g_free(YUnits);
-    g_free(ZUnits);
-    button = gtk_button_new_with_mnemonic(_("Clear Points"));
-    gtk_table_attach(table, button, 0, 4, row, row+1, GTK_FILL, 0, 0, 0);
-    g_signal_connect_swapped(button, "clicked",
-                             G_CALLBACK(clear_points), controls);
-    row++;
-    controls->tool->radius = gtk_adjustment_new(controls->tool->rpx,
-                                                            0, 10, 1, 5, 0);
-    gwy_table_attach_spinbutton(GTK_WIDGET(table), row, 
-                _("Peak search radius:"),
-                "px", controls->tool->radius);
-    g_signal_connect_swapped(controls->tool->radius, "value-changed",
-                 G_CALLBACK(gwy_tool_level3_radius_changed), controls->tool);
-    row++;
-    gtk_table_set_row_spacing(GTK_TABLE(table), row-1, 10);
-    label = gtk_label_new("Display Mode:");
-    gtk_label_set_markup(GTK_LABEL(label), "<b>Display Mode:</b>");
-    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
-    gtk_table_attach(table, label, 0, 5, row, row+1, GTK_FILL, 0, 0, 0);
-    row++;
-    controls->image_mode_radios
-        = gwy_radio_buttons_createl(G_CALLBACK(image_mode_changed), controls,
-                                    controls->args->image_mode,
-                                    _("Image"), IMAGE_DATA,
-                                    _("Image FFT"), IMAGE_FFT,
-                                    _("Skewed Image"), IMAGE_CORRECTED,
-                                    _("Skewed FFT"), IMAGE_FFT_CORRECTED,
-                                    NULL);
-    radio_buttons_attach_to_table(controls->image_mode_radios, table, row);
-    row += 2;
-    gtk_table_set_row_spacing(GTK_TABLE(table), row-1, 10);
-    label = gtk_label_new("Horizontal Skew:");
-    gtk_label_set_markup(GTK_LABEL(label), "<b>Horizontal Skew:</b>");
-    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
-    gtk_table_attach(table, label, 0, 3, row, row+1, GTK_FILL, 0, 0, 0);
-    button = gtk_button_new_with_mnemonic(_("Reset X Skew"));
-    gtk_table_attach(table, button, 3, 5, row, row+1, GTK_FILL, 0, 0, 0);
-    g_signal_connect_swapped(button, "clicked",
-                             G_CALLBACK(reset_Xskew), controls);
-    row++;
-    controls->skew_Xadjust = gtk_adjustment_new(0, -30, 30, 1, 1, 0);
-    controls->skew_Xslider = gtk_hscale_new(
-                                (GtkAdjustment*)controls->skew_Xadjust);
-    gtk_table_attach(table, controls->skew_Xslider, 0, 3,
-                            row, row+1, GTK_FILL, 0, 0, 0);
-    g_signal_connect_swapped(controls->skew_Xadjust, "value-changed",
-                         G_CALLBACK(skew_Xadjusted), controls);
-    controls->hskewtxt = gtk_entry_new();
-    gwy_widget_set_activate_on_unfocus(controls->hskewtxt, TRUE);
-    gtk_entry_set_width_chars(GTK_ENTRY(controls->hskewtxt), 5);
-    gtk_entry_set_text(GTK_ENTRY(controls->hskewtxt), "0.0");
-    gtk_table_attach(table, controls->hskewtxt, 3, 4,
-                            row, row+1, GTK_FILL, 0, 0, 0);
-    g_signal_connect_swapped(controls->hskewtxt, "activate",
-                            G_CALLBACK(hskew_changed), controls);
-    label = gtk_label_new("deg");
-    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.0);
-    gtk_table_attach(table, label, 4, 5, row, row+1, GTK_FILL, 0, 0, 0);
-    row++;
-    label = gtk_label_new("Vertical Skew:");
-    gtk_label_set_markup(GTK_LABEL(label), "<b>Vertical Skew:</b>");
-    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
-    gtk_table_attach(table, label, 0, 3, row, row+1, GTK_FILL, 0, 0, 0);
-    button = gtk_button_new_with_mnemonic(_("Reset Y Skew"));
-    gtk_table_attach(table, button, 3, 5, row, row+1, GTK_FILL, 0, 0, 0);
-    g_signal_connect_swapped(button, "clicked",
-                             G_CALLBACK(reset_Yskew), controls);
-    row++;
-    controls->skew_Yadjust = gtk_adjustment_new(0, -30, 30, 1, 1, 0);
-    controls->skew_Yslider = gtk_hscale_new(
-                                (GtkAdjustment*)controls->skew_Yadjust);
-    gtk_table_attach(table, controls->skew_Yslider, 0, 3,
-                            row, row+1, GTK_FILL, 0, 0, 0);
-    g_signal_connect_swapped(controls->skew_Yadjust, "value-changed",
-                         G_CALLBACK(skew_Yadjusted), controls);
-    controls->vskewtxt = gtk_entry_new();
-    gwy_widget_set_activate_on_unfocus(controls->vskewtxt, TRUE);
-    gtk_entry_set_width_chars(GTK_ENTRY(controls->vskewtxt), 5);
-    gtk_entry_set_text(GTK_ENTRY(controls->vskewtxt), "0.0");
-    gtk_table_attach(table, controls->vskewtxt, 3, 4,
-                            row, row+1, GTK_FILL, 0, 0, 0);
-    g_signal_connect_swapped(controls->vskewtxt, "activate",
-                             G_CALLBACK(vskew_changed), controls);
-    label = gtk_label_new("deg");
-    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.0);
-    gtk_table_attach(table, label, 4, 5, row, row+1, GTK_FILL, 0, 0, 0);
-    row++;
-    threshold_load_args(controls);
-    skew_process(controls);
-    preview(controls);
-    gtk_widget_show_all(dialog);
-    do
-    {
-        response = gtk_dialog_run(GTK_DIALOG(dialog));
-        switch (response)
-        {
-            case GTK_RESPONSE_CANCEL:
-            case GTK_RESPONSE_DELETE_EVENT:
-                gtk_widget_destroy(dialog);
-            case GTK_RESPONSE_NONE:
-                g_object_unref(controls->mydata);
-                gwy_si_unit_value_format_free(controls->XY_Format);
-                gwy_si_unit_value_format_free(controls->Z_Format);
-                threshold_save_args(controls);
-                return;
-                break;
-            case GTK_RESPONSE_OK:
-                break;
-            default:
-                g_assert_not_reached();
-                break;
-        }
-    } while (response != GTK_RESPONSE_OK);
-    threshold_save_args(controls);
-    skew_do(controls);
-    gtk_widget_destroy(dialog);
-    g_object_unref(controls->mydata);
-    gwy_si_unit_value_format_free(controls->original_XY_Format);
-    gwy_si_unit_value_format_free(controls->XY_Format);
-    gwy_si_unit_value_format_free(controls->Z_Format);
-}
-
-static void
-radio_buttons_attach_to_table(GSList *group, 
-                GtkTable *table, gint row)
-{
-    g_return_val_if_fail(GTK_IS_TABLE(table), row);
-    while (group)
-    {
-        gtk_table_attach(table, GTK_WIDGET(group->data),
-                         0, 2, row, row + 1,
-                         GTK_EXPAND | GTK_FILL, 0, 0, 0);
-        group = g_slist_next(group);
-        gtk_table_attach(table, GTK_WIDGET(group->data),
-                         3, 5, row, row + 1,
-                         GTK_EXPAND | GTK_FILL, 0, 0, 0);
-        row++;
-        group = g_slist_next(group);
-    }
-}
-
-static void
-threshold_set_to_range(ThresholdControls *controls,
-                       gdouble lower, gdouble upper)
-{
-    threshold_format_value(controls, GTK_ENTRY(controls->lower), lower);
-    gtk_widget_activate(controls->lower);
-    threshold_format_value(controls, GTK_ENTRY(controls->upper), upper);
-    gtk_widget_activate(controls->upper);
-    preview(controls);
-}
-
-static void
-threshold_set_to_full_range(ThresholdControls *controls)
-{
-    threshold_set_to_range(controls,
-           controls->ranges->min, controls->ranges->max);
-}
-
-static void
-threshold_lower_changed(ThresholdControls *controls)
-{
-    const gchar *value = gtk_entry_get_text(GTK_ENTRY(controls->lower));
-    gdouble num =
-        g_strtod(value, NULL) * controls->original_XY_Format->magnitude;
-    if (num >= controls->ranges->min && num <= controls->ranges->max)
-        controls->args->lower = num;
-    else
-    {
-        if (num < controls->ranges->min)
-            controls->args->lower = controls->ranges->min;
-        else if (num > controls->ranges->max)
-            controls->args->lower = controls->ranges->max; 
-    }
-    threshold_format_value(controls,
-        GTK_ENTRY(controls->lower), controls->args->lower);
-    threshold_save_args(controls);
-    preview(controls);
-}
-
-static void
-threshold_upper_changed(ThresholdControls *controls)
-{
-    const gchar *value = gtk_entry_get_text(GTK_ENTRY(controls->upper));
-    gdouble num =
-        g_strtod(value, NULL) * controls->original_XY_Format->magnitude;
-    if (num >= controls->ranges->min && num <= controls->ranges->max)
-        controls->args->upper = num;
-    else
-    {
-        if (num < controls->ranges->min)
-            controls->args->upper = controls->ranges->min;
-        else if (num > controls->ranges->max)
-            controls->args->upper = controls->ranges->max;
-    }
-    threshold_format_value(controls, GTK_ENTRY(controls->upper),
-            controls->args->upper);
-    threshold_save_args(controls);
-    preview(controls);
-}
-
-static void
-preview(ThresholdControls *controls)
-{
-    gint Xres, Yres;
-    gdouble Xreal, Yreal;
-    gdouble Xoff, Yoff;
-    GwySIUnit *XY_Units;
-    GwySIUnit *Z_Units;
-    Xres = gwy_data_field_get_xres(controls->disp_data);
-    Yres = gwy_data_field_get_yres(controls->disp_data);
-    Xreal = gwy_data_field_get_xreal(controls->disp_data);
-    Yreal = gwy_data_field_get_yreal(controls->disp_data);
-    Xoff = gwy_data_field_get_xoffset(controls->disp_data);
-    Yoff = gwy_data_field_get_yoffset(controls->disp_data);
-    XY_Units = gwy_data_field_get_si_unit_xy(controls->disp_data);
-    Z_Units = gwy_data_field_get_si_unit_z(controls->disp_data);
-    switch (controls->args->image_mode)
-    {
-        case IMAGE_DATA:
-            gwy_data_field_resample(controls->image,
-                        Xres, Yres, GWY_INTERPOLATION_BILINEAR);
-            gwy_data_field_copy(controls->image,
-                                    controls->disp_data, TRUE);
-            Xreal = gwy_data_field_get_xreal(controls->image);
-            Yreal = gwy_data_field_get_yreal(controls->image);
-            XY_Units = gwy_data_field_get_si_unit_xy(controls->image);
-            Z_Units = gwy_data_field_get_si_unit_z(controls->image);
-            Xoff = gwy_data_field_get_xoffset(controls->image);
-            Yoff = gwy_data_field_get_yoffset(controls->image);
-            break;
-        case IMAGE_FFT:
-            gwy_data_field_resample(controls->dfield,
-                        Xres, Yres, GWY_INTERPOLATION_BILINEAR);
-            gwy_data_field_copy(controls->dfield,
-                                    controls->disp_data, TRUE);
-            Xreal = gwy_data_field_get_xreal(controls->dfield);
-            Yreal = gwy_data_field_get_yreal(controls->dfield);
-            XY_Units = gwy_data_field_get_si_unit_xy(controls->dfield);
-            Z_Units = gwy_data_field_get_si_unit_z(controls->dfield);
-            Xoff = gwy_data_field_get_xoffset(controls->dfield);
-            Yoff = gwy_data_field_get_yoffset(controls->dfield);
-            break;
-        case IMAGE_CORRECTED:
-            gwy_data_field_resample(controls->corr_image,
-                        Xres, Yres, GWY_INTERPOLATION_BILINEAR);
-            gwy_data_field_copy(controls->corr_image,
-                                    controls->disp_data, TRUE);
-            Xreal = gwy_data_field_get_xreal(controls->corr_image);
-            Yreal = gwy_data_field_get_yreal(controls->corr_image);
-            XY_Units = gwy_data_field_get_si_unit_xy(controls->corr_image);
-            Z_Units = gwy_data_field_get_si_unit_z(controls->corr_image);
-            Xoff = gwy_data_field_get_xoffset(controls->corr_image);
-            Yoff = gwy_data_field_get_yoffset(controls->corr_image);
-            break;
-        case IMAGE_FFT_CORRECTED:
-            gwy_data_field_resample(controls->corr_fft,
-                        Xres, Yres, GWY_INTERPOLATION_BILINEAR);
-            gwy_data_field_copy(controls->corr_fft,
-                                    controls->disp_data, TRUE);
-            Xreal = gwy_data_field_get_xreal(controls->corr_fft);
-            Yreal = gwy_data_field_get_yreal(controls->corr_fft);
-            XY_Units = gwy_data_field_get_si_unit_xy(controls->corr_fft);
-            Z_Units = gwy_data_field_get_si_unit_z(controls->corr_fft);
-            Xoff = gwy_data_field_get_xoffset(controls->corr_fft);
-            Yoff = gwy_data_field_get_yoffset(controls->corr_fft);
-            break;
-    }
-    ZoomMode zoom = controls->args->zoom_mode;
-    if (zoom != ZOOM_1)
-    {
-        guint width = (Xres/controls->args->zoom_mode) | 1;
-        guint height = (Yres/controls->args->zoom_mode) | 1;
-        GwyDataField *temp = gwy_data_field_area_extract(controls->disp_data,
-                                          (Xres - width)/2, (Yres - height)/2,
-                                          width, height);
-        gwy_data_field_resample(temp, Xres, Yres, GWY_INTERPOLATION_BILINEAR);
-        g_object_unref(controls->disp_data);
-        controls->disp_data = gwy_data_field_duplicate(temp);
-        g_object_unref(temp);
-    }
-    gwy_data_field_set_xreal(controls->disp_data, Xreal/zoom);
-    gwy_data_field_set_yreal(controls->disp_data, Yreal/zoom);
-    gwy_data_field_set_xoffset(controls->disp_data, Xoff/zoom);
-    gwy_data_field_set_yoffset(controls->disp_data, Yoff/zoom);
-    gwy_data_field_set_si_unit_xy(controls->disp_data, XY_Units);
-    gwy_data_field_set_si_unit_z(controls->disp_data, Z_Units);
-    gwy_container_set_object_by_name(controls->mydata,
-                                    "/0/data", controls->disp_data);
-    gwy_data_field_get_min_max(controls->disp_data, &controls->ranges->min,
-                                    &controls->ranges->max);
-    threshold_do(controls->args, controls->disp_data);
-    gwy_set_data_preview_size(GWY_DATA_VIEW(controls->view), PREVIEW_SIZE);
-}
-
-static void
-peak_find(ThresholdControls *controls, gdouble *point, guint idx)
-{
-    GwyDataField *dfield = controls->disp_data;
-    gint i, j, low_i, high_i, low_j, high_j;
-    gdouble temp_i, temp_j, temp_z;
-    gint col = gwy_data_field_rtoj(dfield, point[0]);
-    gint row = gwy_data_field_rtoi(dfield, point[1]);
-    temp_i = col;
-    temp_j = row;    
-    temp_z = gwy_data_field_get_val(dfield, col, row);
-    gint32 r = controls->tool->rpx;
-    gint Xres, Yres;
-    Xres = gwy_data_field_get_xres(dfield);
-    Yres = gwy_data_field_get_yres(dfield);
-    low_i = col - r;
-    high_i = col + r;
-    if (low_i < 0)
-        low_i = 0;
-    if (high_i > Xres)
-        high_i = Xres;
-    low_j = row - r;
-    high_j = row + r;
-    if (low_j < 0)
-        low_j = 0;
-    if (high_j > Yres)
-        high_j = Yres;
-    for (i = low_i; i < high_i; i++)
-    {
-        for (j = low_j; j < high_j; j++)
-        {
-            if (gwy_data_field_get_val(dfield, i, j) > temp_z)
-            {
-                temp_i = i;
-                temp_j = j;
-                temp_z = gwy_data_field_get_val(dfield, i, j);
-            }
-        }
-    }
-    controls->p[idx][0] = gwy_data_field_jtor(dfield, temp_i)
-                + gwy_data_field_get_xoffset(dfield);
-    controls->p[idx][1] = gwy_data_field_itor(dfield, temp_j)
-                + gwy_data_field_get_yoffset(dfield);
-    controls->p[idx][2] = temp_z;
-    if ((row - temp_j) != 0 || (col - temp_i) != 0)
-    {
-        point[0] = gwy_data_field_jtor(dfield, temp_i);
-        point[1] = gwy_data_field_itor(dfield, temp_j);
-        gwy_selection_set_object(controls->selection, idx, point);
-    }
-}
-
-static void
-reFind_Peaks(ThresholdControls *controls)
-{
-    int i, num = 0;
-    for (i = 0; i < 4; i++)
-    {
-        double point[2];
-        if (gwy_selection_get_object(controls->selection, i, point))
-        {
-            gdouble xoff, yoff;
-            peak_find(controls, point, i);
-            xoff = gwy_data_field_get_xoffset(controls->disp_data);
-            yoff = gwy_data_field_get_yoffset(controls->disp_data);
-            point[0] = controls->p[num][0] - xoff;
-            point[1] = controls->p[num][1] - yoff;
-            gwy_selection_set_object(controls->selection, i, point);
-            num++;
-        }
-    }
-    preview(controls);
-}
-
-static void
-zoom_adjust_peaks(ThresholdControls *controls)
-{
-    int i, num = 0;
-    for (i = 0; i < 4; i++)
-    {
-        double point[2];
-        if (gwy_selection_get_object(controls->selection, i, point))
-        {
-            gdouble xoff, yoff, multiplier;
-            multiplier = 1.0/controls->args->zoom_mode;
-            xoff = gwy_data_field_get_xoffset(controls->corr_fft) * multiplier;
-            yoff = gwy_data_field_get_yoffset(controls->corr_fft) * multiplier;
-            point[0] = controls->p[num][0] - xoff;
-            point[1] = controls->p[num][1] - yoff;
-            gwy_selection_set_object(controls->selection, i, point);
-            num++;
-        }
-    }
-    reFind_Peaks(controls);
-}
-
-static void
-skew_process(ThresholdControls *controls)
-{
-    GwyDataField *temp;
-    gint i;
-    gdouble Trans[6], iTrans[6];
-    gdouble p[3], Tp[3], cornX[4], cornY[4], TcornX[4], TcornY[4];
-    gdouble lowX, highX, lowY, highY;
-    gdouble oxres, oyres, xres, yres;
-    gdouble xreal, yreal, xscale, yscale;
-    gdouble min, max, hAngle, vAngle;
-    g_object_unref(controls->corr_image);
-    g_object_unref(controls->corr_fft);
-    oxres = gwy_data_field_get_xres(controls->image);
-    oyres = gwy_data_field_get_yres(controls->image);
-    gwy_data_field_get_min_max(controls->image, &min, &max);
-    controls->args->background_fill = min - 0.05 * (max - min);
-    hAngle = deg2rad(controls->args->Xskew);
-    vAngle = deg2rad(controls->args->Yskew);
-    cornX[0] = 0;
-    cornX[1] = oxres;
-    cornX[2] = oxres;
-    cornX[3] = 0;
-    cornY[0] = 0;
-    cornY[1] = 0;
-    cornY[2] = oyres;
-    cornY[3] = oyres;
-    Trans[0] = 1;
-    Trans[1] = tan(vAngle);
-    Trans[2] = tan(hAngle);
-    Trans[3] = 1;
-    Trans[4] = 0;
-    Trans[5] = 0;
-    for (i = 0; i < 4; i++)
-    {
-        p[0] = cornX[i];
-        p[1] = cornY[i];
-        p[2] = 1;
-        mult_3matrix(Tp, Trans, p);
-        TcornX[i] = Tp[0];
-        TcornY[i] = Tp[1];
-    }
-    lowX = TcornX[0];
-    highX = TcornX[0];
-    lowY = TcornY[0];
-    highY = TcornY[0];
-    for (i = 1; i < 4; i++)
-    {
-        if (TcornX[i] < lowX)
-            lowX = TcornX[i];
-        if (TcornX[i] > highX)
-            highX = TcornX[i];
-        if (TcornY[i] < lowY)
-            lowY = TcornY[i];
-        if (TcornY[i] > highY)
-            highY = TcornY[i];
-    }
-    xres = GWY_ROUND(highX - lowX);
-    yres = GWY_ROUND(highY - lowY);
-    controls->args->newxres = xres;
-    controls->args->newyres = yres;
-    xscale = xres/oxres;
-    yscale = yres/oyres;
-    xreal = gwy_data_field_get_xreal(controls->image) * xscale;
-    yreal = gwy_data_field_get_yreal(controls->image) * yscale;
-    controls->corr_image = gwy_data_field_new(xres, yres, xreal, yreal, FALSE);
-    gwy_data_field_fill(controls->corr_image, controls->args->background_fill);
-    temp = gwy_data_field_duplicate(controls->image);
-    Trans[0] = 1;
-    Trans[1] = tan(vAngle);
-    Trans[2] = tan(hAngle);
-    Trans[3] = 1;
-    Trans[4] = -lowX;
-    Trans[5] = -lowY;
-    invert_matrix(iTrans, Trans);
-    affine(temp, controls->corr_image, iTrans, GWY_INTERPOLATION_BILINEAR,
-            controls->args->background_fill);
-    g_object_unref(temp);
-    gwy_data_field_set_si_unit_xy(controls->corr_image,
-            controls->Image_XY_Units);
-    gwy_data_field_set_si_unit_z(controls->corr_image,
-            controls->Image_Z_Units);
-    controls->corr_fft = gwy_data_field_duplicate(controls->corr_image);
-    perform_fft(controls->corr_fft, controls->mydata);
-}
-
-static void
-skew_create_output(GwyContainer *data,
-    GwyDataField *dfield, ThresholdControls *controls)
-{
-    const guchar *title;
-    GwyContainer *meta;
-    gint id, newid;
-    gdouble oxres, oyres, xres, yres;
-    gdouble xreal, yreal, xscale, yscale;
-    oxres = gwy_data_field_get_xres(controls->image);
-    oyres = gwy_data_field_get_yres(controls->image);
-    xres = controls->args->newxres;
-    yres = controls->args->newyres;
-    xscale = xres/oxres;
-    yscale = yres/oyres;
-    xreal = gwy_data_field_get_xreal(controls->image) * xscale;
-    yreal = gwy_data_field_get_yreal(controls->image) * yscale;
-    gwy_data_field_set_xreal(dfield, xreal);
-    gwy_data_field_set_yreal(dfield, yreal);
-    gwy_data_field_set_si_unit_xy(dfield,
-        controls->Image_XY_Units);
-    gwy_data_field_set_si_unit_z(dfield,
-        controls->Image_Z_Units);
-    gwy_app_data_browser_get_current(GWY_APP_DATA_FIELD_ID, &id, 0);
-    GQuark Qmeta = g_quark_from_string(g_strdup_printf("/%i/meta", id));
-    if (gwy_container_contains(data, Qmeta))
-        meta = gwy_container_duplicate(gwy_container_get_object(data, Qmeta));
-    else
-        meta = gwy_container_new();
-    title = gwy_container_get_string(data,
-            g_quark_try_string(g_strdup_printf("/%i/data/title", id)));
-    gwy_container_set_string_by_name(meta, "Source Title", title);
-    gwy_container_set_string_by_name(meta, "X Skew (°)",
-            (const guchar *)g_strdup_printf("%.5f", controls->args->Xskew));
-    gwy_container_set_string_by_name(meta, "Y Skew (°)",
-            (const guchar *)g_strdup_printf("%.5f", controls->args->Yskew));
-    newid = gwy_app_data_browser_add_data_field(dfield, data, TRUE);
-    gwy_container_set_object_by_name(data,
-            g_strdup_printf("/%i/meta", newid), meta);
-    gwy_app_set_data_field_title(data, newid, _("Skewed"));
-    gwy_app_channel_log_add(data, controls->id,
-        newid, "proc::skew_lattice", NULL);
-}
-
-static void
-gwy_tool_level3_render_cell(GtkCellLayout *layout,
-            GtkCellRenderer *renderer, GtkTreeModel *model,
-            GtkTreeIter *iter, gpointer user_data)
-{
-    ThresholdControls *controls = (ThresholdControls*)user_data;
-    const GwySIValueFormat *vf;
-    gchar buf[32];
-    gdouble point[2];
-    gdouble val;
-    guint idx, id;
-    id = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(layout), "id"));
-    gtk_tree_model_get(model, iter, 0, &idx, -1);
-    if (id == COLUMN_I)
-    {
-        g_snprintf(buf, sizeof(buf), "%d", idx + 1);
-        g_object_set(renderer, "text", buf, NULL);
-        return;
-    }
-    if (!controls->selection ||
-            !gwy_selection_get_object(controls->selection, idx, point))
-    {
-        g_object_set(renderer, "text", "", NULL);
-        return;
-    }
-    switch (id)
-    {
-        case COLUMN_X:
-            if (controls->args->image_mode == IMAGE_FFT_CORRECTED)
-                peak_find(controls, point, idx);
-            vf = controls->XY_Format;
-            val = controls->p[idx][0];
-            break;
-        case COLUMN_Y:
-            vf = controls->XY_Format;
-            val = controls->p[idx][1];
-            break;
-        case COLUMN_Z:
-            vf = controls->Z_Format;
-            val = controls->p[idx][2];
-            break;
-        default:
-            g_return_if_reached();
-            break;
-    }
-    if (vf)
-        g_snprintf(buf, sizeof(buf), "%.*f",
-            vf->precision, val/vf->magnitude);
-    else
-        g_snprintf(buf, sizeof(buf), "%.3g", val);
-    g_object_set(renderer, "text", buf, NULL);
-    skew_update_angles(controls);
-}
-
-static void
-skew_Xadjusted(ThresholdControls *controls)
-{
-    GtkAdjustment *adj = (GtkAdjustment*)controls->skew_Xadjust;
-    controls->args->Xskew = adj->value;
-    skew_process(controls);
-    reFind_Peaks(controls);
-    gchar *s = g_strdup_printf("%0.1f", adj->value);
-    gtk_entry_set_text(GTK_ENTRY(controls->hskewtxt), s);
-    g_free(s);
-}
-
-static void
-skew_Yadjusted(ThresholdControls *controls)
-{
-    GtkAdjustment *adj = (GtkAdjustment*)controls->skew_Yadjust;
-    controls->args->Yskew = adj->value;
-    skew_process(controls);
-    reFind_Peaks(controls);
-    gchar *s = g_strdup_printf("%0.1f", adj->value);
-    gtk_entry_set_text(GTK_ENTRY(controls->vskewtxt), s);
-    g_free(s);
-}
-
-static void
-skew_update_angles(ThresholdControls *controls)
-{
-    if (gwy_selection_is_full(controls->selection))
-    {
-        get_angles(controls);
-        gtk_label_set_markup(GTK_LABEL(controls->Angle1),
-            g_strdup_printf("<b>Angle 123: </b>%0.1f°",
-                                        controls->args->angle1));
-        gtk_label_set_markup(GTK_LABEL(controls->Angle2),
-            g_strdup_printf("<b>Angle 234: </b>%0.1f°",
-                                        controls->args->angle2));
-    }
-    else
-    {
-        gtk_label_set_markup(GTK_LABEL(controls->Angle1), "<b>Angle 123:</b>");
-        gtk_label_set_markup(GTK_LABEL(controls->Angle2), "<b>Angle 234:</b>");
-    }
-}
-
-static void
-get_angles(ThresholdControls *controls)
-{
-    gdouble x1, x2, x3, x4, y1, y2, y3, y4;
-    gdouble ax, ay, bx, by, a, b, ab;
-    x1 = controls->p[0][0];
-    y1 = controls->p[0][1];
-    x2 = controls->p[1][0];
-    y2 = controls->p[1][1];
-    x3 = controls->p[2][0];
-    y3 = controls->p[2][1];
-    x4 = controls->p[3][0];
-    y4 = controls->p[3][1];
-    ax = x1 - x2;
-    ay = y1 - y2;
-    bx = x3 - x2;
-    by = y3 - y2;
-    a = sqrt(ax*ax + ay*ay);
-    b = sqrt(bx*bx + by*by);
-    ab = ax*bx + ay*by;
-    controls->args->angle1 = acos(ab / (a*b)) * 180/PI;
-    ax = x4 - x3;
-    ay = y4 - y3;
-    bx = x2 - x3;
-    by = y2 - y3;
-    a = sqrt(ax*ax + ay*ay);
-    ab = ax*bx + ay*by;
-    controls->args->angle2 = acos(ab / (a*b)) * 180/PI;
-}
-
-static void
-reset_Xskew(ThresholdControls *controls)
-{
-    gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Xadjust, 0.0);
-}
-
-static void
-reset_Yskew(ThresholdControls *controls)
-{
-    gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Yadjust, 0.0);
-}
-
-static void
-gwy_tool_level3_radius_changed(GwyToolLevel3 *tool)
-{
-    tool->rpx = gwy_adjustment_get_int(tool->radius);
-    guint i;
-    GwyNullStore *store = GWY_NULL_STORE(tool->model);
-    for (i = 0; i < 4; i++)
-        gwy_null_store_row_changed(store, i);
-}
-
-static void
-perform_fft(GwyDataField *dfield, GwyContainer *data)
-{    
-    GwyDataField *raout, *ipout;
-    raout = gwy_data_field_new_alike(dfield, FALSE);
-    ipout = gwy_data_field_new_alike(dfield, FALSE);
-    gwy_data_field_2dfft(dfield, NULL, raout, ipout,
-                         GWY_WINDOWING_HANN,
-                         GWY_TRANSFORM_DIRECTION_FORWARD,
-                         GWY_INTERPOLATION_LINEAR, FALSE, 1);
-    set_dfield_modulus(raout, ipout, dfield);
-    fft_postprocess(dfield);
-    gchar *key;
-    key = g_strdup_printf("/%i/base/palette", 0);
-    gwy_container_set_string_by_name(data, key, g_strdup("Gray"));
-    g_free(key);
-    key = g_strdup_printf("/%i/base/range-type", 0);
-    gwy_container_set_enum_by_name(data, key, GWY_LAYER_BASIC_RANGE_ADAPT);
-    g_free(key);
-    g_object_unref(raout);
-    g_object_unref(ipout);
-}
-
-static void
-set_dfield_modulus(GwyDataField *re, GwyDataField *im, GwyDataField *target)
-{
-    const gdouble *datare, *dataim;
-    gdouble *data;
-    gint xres, yres, i;
-    xres = gwy_data_field_get_xres(re);
-    yres = gwy_data_field_get_yres(re);
-    datare = gwy_data_field_get_data_const(re);
-    dataim = gwy_data_field_get_data_const(im);
-    data = gwy_data_field_get_data(target);
-    for (i = xres*yres; i; i--, datare++, dataim++, data++)
-        *data = hypot(*datare, *dataim);
-}
-
-static void
-fft_postprocess(GwyDataField *dfield)
-{
-    gint res;
-    gdouble r;
-    gwy_data_field_2dfft_humanize(dfield);
-    GwySIUnit *xyunit;
-    xyunit = gwy_data_field_get_si_unit_xy(dfield);
-    gwy_si_unit_power(xyunit, -1, xyunit);
-    gwy_data_field_set_xreal(dfield, 1.0/gwy_data_field_get_xmeasure(dfield));
-    gwy_data_field_set_yreal(dfield, 1.0/gwy_data_field_get_ymeasure(dfield));
-    res = gwy_data_field_get_xres(dfield);
-    r = res / 2.0;
-    gwy_data_field_set_xoffset(dfield, -gwy_data_field_jtor(dfield, r));
-    res = gwy_data_field_get_yres(dfield);
-    r = res / 2.0;
-    gwy_data_field_set_yoffset(dfield, -gwy_data_field_itor(dfield, r));
-    gdouble dmin, dmax;
-    gwy_data_field_get_min_max(dfield, &dmin, &dmax);
-    gwy_data_field_add(dfield, -dmin);
-}
-
-static void
-selection_changed(ThresholdControls *controls)
-{
-    guint i;
-    GwyNullStore *store = GWY_NULL_STORE(controls->tool->model);
-    for (i = 0; i < 4; i++)
-        gwy_null_store_row_changed(store, i);
-}
-
-static void
-skew_do(ThresholdControls *controls)
-{
-    skew_process(controls);
-    skew_create_output(controls->container, controls->corr_image, controls);
-    g_object_unref(controls->image);
-    g_object_unref(controls->dfield);
-    g_object_unref(controls->corr_image);
-    g_object_unref(controls->corr_fft);
-}
-
-static void
-image_mode_changed(GtkToggleButton *button, ThresholdControls *controls)
-{
-    threshold_load_args(controls);
-    controls->args->image_mode =
-        gwy_radio_buttons_get_current(controls->image_mode_radios);
-    if (controls->args->image_mode != IMAGE_FFT_CORRECTED)
-        gwy_vector_layer_set_editable(controls->vlayer, FALSE);
-    else
-        gwy_vector_layer_set_editable(controls->vlayer, TRUE);
-    preview(controls);
-}
-
-static void
-zoom_mode_changed(GtkToggleButton *button, ThresholdControls *controls)
-{
-    controls->args->zoom_mode =
-        gwy_radio_buttons_get_current(controls->zoom_mode_radios);
-    preview(controls);
-    zoom_adjust_peaks(controls);
-}
-
-static void
-threshold_do(ThresholdArgs *args, GwyDataField *dfield)
-{
-    gdouble lower = MIN(args->lower, args->upper);
-    gdouble upper = MAX(args->lower, args->upper);
-    gwy_data_field_clamp(dfield, lower, upper);
-    gwy_data_field_data_changed(dfield);
-}
-
-static void
-clear_points(ThresholdControls *controls)
-{
-    gwy_selection_clear(controls->selection);
-    skew_update_angles(controls);
-    preview(controls);
-}
-
-static const gchar lower0_key[] = "/module/skew_lattice/lower0";
-static const gchar lower1_key[] = "/module/skew_lattice/lower1";
-static const gchar lower2_key[] = "/module/skew_lattice/lower2";
-static const gchar lower3_key[] = "/module/skew_lattice/lower3";
-static const gchar upper0_key[] = "/module/skew_lattice/upper0";
-static const gchar upper1_key[] = "/module/skew_lattice/upper1";
-static const gchar upper2_key[] = "/module/skew_lattice/upper2";
-static const gchar upper3_key[] = "/module/skew_lattice/upper3";
-static const gchar radius_key[] = "/module/skew_lattice/radius";
-
-static void
-threshold_load_args(ThresholdControls *controls)
-{
-    GwyContainer *settings = gwy_app_settings_get();
-    gdouble *lower = &controls->args->lower;
-    gdouble *upper = &controls->args->upper;
-    switch (controls->args->image_mode)
-    {
-        case IMAGE_DATA:
-            gwy_container_gis_double_by_name(settings, lower0_key, lower);
-            gwy_container_gis_double_by_name(settings, upper0_key, upper);
-            break;
-        case IMAGE_FFT:
-            gwy_container_gis_double_by_name(settings, lower1_key, lower);
-            gwy_container_gis_double_by_name(settings, upper1_key, upper);
-            break;
-        case IMAGE_CORRECTED:
-            gwy_container_gis_double_by_name(settings, lower2_key, lower);
-            gwy_container_gis_double_by_name(settings, upper2_key, upper);
-            break;
-        case IMAGE_FFT_CORRECTED:
-            gwy_container_gis_double_by_name(settings, lower3_key, lower);
-            gwy_container_gis_double_by_name(settings, upper3_key, upper);
-            break;
-    }
-    threshold_format_value(controls,
-                        GTK_ENTRY(controls->upper), controls->args->upper);
-    threshold_format_value(controls,
-                        GTK_ENTRY(controls->lower), controls->args->lower);
-    gwy_container_gis_int32_by_name(settings,
-                        radius_key, (&controls->tool->rpx));
-}
-
-static void
-threshold_save_args(ThresholdControls *controls)
-{
-    GwyContainer *settings = gwy_app_settings_get();
-    switch (controls->args->image_mode)
-    {
-        case IMAGE_DATA:
-            gwy_container_set_double_by_name(settings,
-                                lower0_key, controls->args->lower);
-            gwy_container_set_double_by_name(settings,
-                                upper0_key, controls->args->upper);
-            break;
-        case IMAGE_FFT:
-            gwy_container_set_double_by_name(settings,
-                                lower1_key, controls->args->lower);
-            gwy_container_set_double_by_name(settings,
-                                upper1_key, controls->args->upper);
-            break;
-        case IMAGE_CORRECTED:
-            gwy_container_set_double_by_name(settings,
-                                lower2_key, controls->args->lower);
-            gwy_container_set_double_by_name(settings,
-                                upper2_key, controls->args->upper);
-            break;
-        case IMAGE_FFT_CORRECTED:
-            gwy_container_set_double_by_name(settings,
-                                lower3_key, controls->args->lower);
-            gwy_container_set_double_by_name(settings,
-                                upper3_key, controls->args->upper);
-            break;
-    }
-    gwy_container_set_int32_by_name(settings, radius_key, controls->tool->rpx);
-}
-
-static void
-hskew_changed(ThresholdControls *controls)
-{
-    const gchar *value = gtk_entry_get_text(GTK_ENTRY(controls->hskewtxt));
-    gdouble num = g_strtod(value, NULL);
-    if (num != controls->args->Xskew)
-    {
-        controls->args->Xskew = num;
-        gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Xadjust, num);
-    }
-    else
-    {
-        gchar *s = g_strdup_printf("%0.1f", controls->args->Xskew);
-        gtk_entry_set_text(GTK_ENTRY(controls->hskewtxt), s);
-        g_free(s);
-    }
-}
-
-static void
-vskew_changed(ThresholdControls *controls)
-{
-    const gchar *value = gtk_entry_get_text(GTK_ENTRY(controls->vskewtxt));
-    gdouble num = g_strtod(value, NULL);
-    if (num != controls->args->Yskew)
-    {
-        controls->args->Yskew = num;
-        gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Yadjust, num);
-    }
-    else
-    {
-        gchar *s = g_strdup_printf("%0.1f", controls->args->Yskew);
-        gtk_entry_set_text(GTK_ENTRY(controls->vskewtxt), s);
-        g_free(s);
-    }
-}
-
-static gdouble
-matrix_det(const gdouble *m)
-{
-    return m[0]*m[3] - m[1]*m[2];
-}
-
-static void
-invert_matrix(gdouble *dest, const gdouble *src)
-{
-    gdouble D = matrix_det(src);
-    dest[0] = src[3]/D;
-    dest[1] = -src[1]/D;
-    dest[2] = -src[2]/D;
-    dest[3] = src[0]/D;
-    dest[4] = (src[2]*src[5] - src[3]*src[4])/D;
-    dest[5] = (src[1]*src[4] - src[0]*src[5])/D;
-}
-
-static void
-mult_3matrix(gdouble *dest, const gdouble *mat1, const gdouble *mat2)
-{
-    dest[0] = mat1[0]*mat2[0] + mat1[2]*mat2[1] + mat1[4]*mat2[2];
-    dest[1] = mat1[1]*mat2[0] + mat1[3]*mat2[1] + mat1[5]*mat2[2];
-    dest[2] = mat2[2];
-}
-
-static gdouble
-deg2rad(const gdouble deg)
-{
-    return deg * PI / 180.0;
-}
-
-static void
-affine(GwyDataField *source, GwyDataField *dest, const gdouble *invtrans,
-            GwyInterpolationType interp, gdouble fill_value)
-{
-    GwyDataField *coeffield;
-    gdouble *data, *coeff;
-    const gdouble *cdata;
-    gint xres, yres, newxres, newyres;
-    gint newi, newj, oldi, oldj, i, j, ii, jj, suplen, sf, st;
-    gdouble x, y, v;
-    gdouble axx, axy, ayx, ayy, bx, by;
-    gboolean vset;
-    g_return_if_fail(GWY_IS_DATA_FIELD(source));
-    g_return_if_fail(GWY_IS_DATA_FIELD(dest));
-    g_return_if_fail(invtrans);
-    axx = invtrans[0];
-    axy = invtrans[1];
-    ayx = invtrans[2];
-    ayy = invtrans[3];
-    bx = invtrans[4];
-    by = invtrans[5];
-    suplen = gwy_interpolation_get_support_size(interp);
-    g_return_if_fail(suplen > 0);
-    coeff = g_newa(gdouble, suplen*suplen);
-    sf = -((suplen - 1)/2);
-    st = suplen/2;
-    xres = gwy_data_field_get_xres(source);
-    yres = gwy_data_field_get_yres(source);
-    newxres = gwy_data_field_get_xres(dest);
-    newyres = gwy_data_field_get_yres(dest);
-    if (gwy_interpolation_has_interpolating_basis(interp))
-        coeffield = g_object_ref(source);
-    else
-    {
-        coeffield = gwy_data_field_duplicate(source);
-        gwy_interpolation_resolve_coeffs_2d(xres, yres, xres,
-                            gwy_data_field_get_data(coeffield),
-                            interp);
-    }
-    data = gwy_data_field_get_data(dest);
-    cdata = gwy_data_field_get_data_const(coeffield);
-    bx += 0.5*(axx + axy - 1.0);
-    by += 0.5*(ayx + ayy - 1.0);
-    for (newi = 0; newi < newxres; newi++)
-    {
-        for (newj = 0; newj < newyres; newj++)
-        {
-            x = axx*newi + ayx*newj + bx;
-            y = axy*newi + ayy*newj + by;
-            vset = FALSE;
-            if (y > yres || x > xres || y < 0.0 || x < 0.0) {
-                v = fill_value;
-                vset = TRUE;
-            }
-            if (!vset) {
-                oldi = (gint)floor(y);
-                y -= oldi;
-                oldj = (gint)floor(x);
-                x -= oldj;
-                for (i = sf; i <= st; i++) {
-                    ii = (oldi + i + 2*st*yres) % (2*yres);
-                    if (G_UNLIKELY(ii >= yres))
-                        ii = 2*yres-1 - ii;
-                    for (j = sf; j <= st; j++) {
-                        jj = (oldj + j + 2*st*xres) % (2*xres);
-                        if (G_UNLIKELY(jj >= xres))
-                            jj = 2*xres-1 - jj;
-                        coeff[(i - sf)*suplen + j - sf] = cdata[ii*xres + jj];
-                    }
-                }
-                v = gwy_interpolation_interpolate_2d(x, y, suplen, coeff,
-                                                     interp);
-            }
-            data[newi + newxres*newj] = v;
-        }
-    }
-    g_object_unref(coeffield);
-}
+/*
+ *  @(#) $Id: skew_lattice.c 2014-05-08 $
+ *  Copyright (C) 2014 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ *  This program skews SPM images in an attempt to compensate for
+ *  lateral drift during imaging. Skewing the images by sequential
+ *  lateral translations of subsequent rows/cols in the image is 
+ *  used to regularize the lattice to its known parameters. Angles
+ *  between lattice features may be measured in the program to aid
+ *  the user to determining the optimal skew amount.
+ */
+
+#include "config.h"
+#include <string.h>
+#include <gtk/gtk.h>
+#include <app/gwyapp.h>
+#include <app/gwymoduleutils.h>
+#include <libprocess/stats.h>
+#include <libprocess/filters.h>
+#include <libprocess/inttrans.h>
+#include <libprocess/datafield.h>
+#include <libprocess/gwyprocess.h>
+#include <libgwyddion/gwymath.h>
+#include <libgwydgets/gwydataview.h>
+#include <libgwydgets/gwydgetutils.h>
+#include <libgwydgets/gwynullstore.h>
+#include <libgwydgets/gwylayer-basic.h>
+#include <libgwydgets/gwypixmaplayer.h>
+#include <libdraw/gwygradient.h>
+#include <libgwydgets/gwyradiobuttons.h>
+#include <libgwymodule/gwymodule-process.h>
+#ifdef HAVE_FFTW_MAKE_PLANNER_THREAD_SAFE
+#include <fftw3.h>
+#endif
+#include "skew_core.h"
+#include "skew_lattice.h"
+#include "skew_probes.h"
+
+#define skew_lattice_RUN_MODES (GWY_RUN_IMMEDIATE | GWY_RUN_INTERACTIVE)
+#define PI 3.14159265358979323846
+
+typedef struct _GwyToolLevel3      GwyToolLevel3;
+
+typedef struct _GwyToolLevel3Class GwyToolLevel3Class;
+
+#define SKEW_TYPE_DISPLAY_LAYER (skew_display_layer_get_type())
+#define SKEW_DISPLAY_LAYER(obj) \
+    (G_TYPE_CHECK_INSTANCE_CAST((obj), SKEW_TYPE_DISPLAY_LAYER, \
+                                SkewDisplayLayer))
+
+typedef struct _SkewDisplayLayer      SkewDisplayLayer;
+
+typedef struct _SkewDisplayLayerClass SkewDisplayLayerClass;
+
+enum
+{
+    VIRTUAL_TILE = 128
+};
+
+/* A skewed image evaluated lazily: each tile of the sheared frame is
+ * resampled from the source the first time a region covering it is asked
+ * for, and kept.  Shared between the dialog and the display layer, hence
+ * reference counted. */
+typedef struct {
+    gint refcount;
+    GwyDataField *source;
+    gdouble trans[6];
+    gdouble itrans[6];
+    gdouble fill;
+    gdouble max;
+    gint xres;
+    gint yres;
+    gint xtiles;
+    gint ytiles;
+    GwyDataField **tiles;
+} SkewVirtual;
+
+/* Renders the current source field straight into the 8-bit view pixbuf.
+ * The data field under the layer's data key only carries the geometry of
+ * the displayed area; its values are never used.  A lazily skewed source
+ * only has the tiles under the visible area resampled.  Overlay marks,
+ * given as source pixel indices, are drawn over the image inverted. */
+struct _SkewDisplayLayer
+{
+    GwyPixmapLayer parent_instance;
+    GwyDataField *source;
+    SkewVirtual *virtual;
+    GwyGradient *gradient;
+    gint zoom;
+    gdouble lower;
+    gdouble upper;
+    gint scale;
+    gdouble gamma;
+    gint lut_nsamples;
+    guint16 *lut;
+    gdouble *marks;
+    guint nmarks;
+};
+
+struct _SkewDisplayLayerClass
+{
+    GwyPixmapLayerClass parent_class;
+};
+
+struct _GwyToolLevel3
+{
+    GwyPlainTool parent_instance;
+    GtkTreeView *treeview;
+    GtkTreeModel *model;
+    GtkObject *radius;
+    gint32 rpx;
+    GtkWidget *instant_apply;
+    GtkWidget *set_zero;
+    GtkWidget *apply;
+    GType layer_type_point;
+};
+
+enum
+{
+    COLUMN_I,
+    COLUMN_X,
+    COLUMN_Y,
+    COLUMN_Z,
+    NCOLUMNS
+};
+
+enum
+{
+    PREVIEW_SIZE = 512
+};
+
+enum
+{
+    OVERLAY_ORDERS = 3,
+    OVERLAY_MARK_SIZE = 4,
+    OVERLAY_MAX_MARKS = 16384,
+    RECOMPUTE_DELAY = 150
+};
+
+enum
+{
+    DISPLAY_LUT_SIZE = 4096,
+    HISTOGRAM_BINS = 1024,
+    HISTOGRAM_DECADES = 8
+};
+
+typedef enum {
+    IMAGE_DATA,
+    IMAGE_FFT,
+    IMAGE_CORRECTED,
+    IMAGE_FFT_CORRECTED,
+} ImageMode;
+
+typedef enum {
+    ZOOM_1 = 1,
+    ZOOM_2 = 2,
+} ZoomMode;
+
+typedef enum {
+    HORIZONTAL,
+    VERTICAL,
+} ShiftMode;
+
+typedef enum {
+    SCALE_LINEAR,
+    SCALE_LOG,
+    SCALE_GAMMA,
+    SCALE_NTYPES
+} DisplayScale;
+
+/* Histogram of a spectrum over logarithmic bins, filled in the same pass
+ * that shifts the modulus to zero. */
+typedef struct {
+    gdouble logmin;
+    gdouble binscale;
+    guint n;
+    guint bins[HISTOGRAM_BINS];
+} SpectrumHistogram;
+
+typedef enum {
+    SPECTRUM_FULL,
+    SPECTRUM_WELCH,
+    SPECTRUM_NTYPES
+} SpectrumMode;
+
+typedef enum {
+    WINDOW_HANN,
+    WINDOW_BLACKMAN_HARRIS,
+    WINDOW_KAISER,
+    WINDOW_FLAT_TOP,
+    WINDOW_NTYPES
+} WindowType;
+
+enum
+{
+    WINDOW_CACHE_SIZE = 4
+};
+
+enum
+{
+    FIT_MAX_PEAKS = 64,
+    FIT_CANDIDATES = 16,
+    FIT_MAX_ORDER = 3,
+    FIT_DC_EXCLUDE = 4
+};
+
+enum
+{
+    BOOTSTRAP_REPLICATES = 200
+};
+
+enum
+{
+    MOSAIC_CROP_MIN = 32,
+    MOSAIC_CROP_MAX = 256,
+    MOSAIC_NOTCH = 2,
+    MOSAIC_ITERATIONS = 3
+};
+
+enum
+{
+    DOMAIN_MAX = 3,
+    DOMAIN_TILE_MIN = 32,
+    DOMAIN_TILE_MAX = 128,
+    DOMAIN_MIN_TILES = 4,
+    DOMAIN_ITERATIONS = 20
+};
+
+enum
+{
+    ROI_MIN_SIZE = 16
+};
+
+enum
+{
+    REFINE_CROP_MIN = 32,
+    REFINE_CROP_MAX = 256,
+    REFINE_HALF_GRID = 8,
+    REFINE_LEVELS = 3
+};
+
+enum
+{
+    DRIFT_STRIP_MIN = 16,
+    DRIFT_STRIP_MAX = 64,
+    DRIFT_MIN_STRIPS = 3,
+    DRIFT_ITERATIONS = 3,
+    DRIFT_SESSION_MAX = 8
+};
+
+/* Outcome of a drift estimate; the failures differ in what the user can do
+ * about them. */
+typedef enum {
+    DRIFT_OK,
+    DRIFT_TOO_SMALL,
+    DRIFT_NO_CORRELATION,
+} DriftStatus;
+
+typedef enum {
+    LATTICE_HEXAGONAL,
+    LATTICE_SQUARE,
+    LATTICE_NTYPES
+} LatticeType;
+
+/* A spectrum peak in physical coordinates; h, k are its Miller indices once
+ * the lattice has been fitted. */
+typedef struct {
+    gdouble x;
+    gdouble y;
+    gdouble z;
+    gdouble w;
+    gint h;
+    gint k;
+} SpectrumPeak;
+
+/* Two basis vectors, either reciprocal (a*, b*) or real-space (A, B). */
+typedef struct {
+    gdouble a[2];
+    gdouble b[2];
+} LatticeBasis;
+
+typedef struct {
+    LatticeBasis basis;
+    GArray *peaks;
+    gdouble hskew;
+    gdouble vskew;
+    gdouble rms;
+    gboolean valid;
+    gdouble hsolved;
+    gdouble vsolved;
+    gdouble hci[2];
+    gdouble vci[2];
+    guint nconverged;
+    gboolean ci_valid;
+    gdouble origin[2];
+    gboolean origin_valid;
+} LatticeFit;
+
+/* Two overlapping mosaic tiles: the displacement of their common content
+ * measured in the raw frames and the nominal displacement of the tile
+ * origins, both physical. */
+typedef struct {
+    gdouble d[2];
+    gdouble o[2];
+} MosaicLink;
+
+/* The tiles mosaic_create_output() corrects, one batch item each. */
+typedef struct {
+    GwyDataField **sources;
+    GwyDataField **results;
+    gdouble *trans;
+    gdouble *fill;
+    gdouble hskew;
+    gdouble vskew;
+    gboolean fixed_point;
+} MosaicBatch;
+
+/* Drift velocity of one corrected scan of the session in xy units per
+ * second, stamped with the session time of the middle of the scan.  The
+ * container is only compared, never dereferenced. */
+typedef struct {
+    gconstpointer data;
+    gint id;
+    gdouble t;
+    gdouble frame;
+    gdouble v[2];
+} DriftRecord;
+
+/* Fixed inputs of the real-space refinement: the fitted real basis in the
+ * raw image frame and the n x n raw crop with its transform and the norm
+ * of the image under the template at each shift. */
+typedef struct {
+    LatticeBasis raw;
+    gdouble r;
+    gdouble gamma;
+    gboolean hexagonal;
+    gint n;
+    GwyDataField *crop;
+    GwyDataField *re;
+    GwyDataField *im;
+    gdouble *norm;
+} RefineSearch;
+
+/* Per-thread work fields for scoring refinement candidates. */
+typedef struct {
+    GwyDataField *tmpl;
+    GwyDataField *tre;
+    GwyDataField *tim;
+    GwyDataField *ore;
+    GwyDataField *oim;
+    gdouble *ncc;
+} RefineBuffers;
+
+typedef struct {
+    WindowType type;
+    gdouble beta;
+    gint xres;
+    gint yres;
+    gdouble *xwin;
+    gdouble *ywin;
+} WindowCacheEntry;
+
+typedef struct {
+    WindowCacheEntry entry[WINDOW_CACHE_SIZE];
+    guint next;
+} WindowCache;
+
+typedef struct {
+    gdouble lower;
+    gdouble upper;
+    gfloat Xskew;
+    gfloat Yskew;
+    gdouble angle1;
+    gdouble angle2;
+    ImageMode image_mode;
+    ZoomMode zoom_mode;
+    gint copy_row_start;
+    gint copy_col_start;
+    gdouble background_fill;
+    gboolean background;
+    gint newxres;
+    gint newyres;
+    WindowType window_type;
+    gdouble kaiser_beta;
+    DisplayScale display_scale;
+    gdouble gamma;
+    gboolean auto_range;
+    LatticeType lattice_type;
+    SpectrumMode spectrum_mode;
+    gint tile_size;
+    gint domains;
+    gboolean fixed_point;
+} ThresholdArgs;
+
+typedef struct {
+    gdouble min, max;
+} ThresholdRanges;
+
+typedef struct {
+    ThresholdArgs *args;
+    ThresholdRanges *ranges;
+    GtkWidget *dialog;
+    GtkWidget *view;
+    GtkWidget *lower;
+    GtkWidget *upper;
+    GtkWidget *hskewtxt;
+    GtkWidget *vskewtxt;
+    GwyContainer *mydata;
+    GwyContainer *container;
+    GwyDataField *dfield;
+    GwyDataField *image;
+    GwyDataField *corr_image;
+    SkewVirtual *corr_virtual;
+    GwyDataField *corr_fft;
+    GwyDataField *disp_data;
+    gint id;
+    GwySelection *selection;
+    GwySIValueFormat *original_XY_Format;
+    GwySIValueFormat *XY_Format;
+    GwySIValueFormat *Z_Format;
+    GwySIUnit *Image_XY_Units;
+    GwySIUnit *Image_Z_Units;
+    GwyToolLevel3 *tool;
+    GSList *image_mode_radios;
+    GSList *zoom_mode_radios;
+    GtkObject *skew_Xadjust;
+    GtkWidget *skew_Xslider;
+    GtkObject *skew_Yadjust;
+    GtkWidget *skew_Yslider;
+    GtkWidget *Angle1;
+    GtkWidget *Angle2;
+    gdouble p[4][3];
+    GwyVectorLayer *vlayer;
+    GwyPixmapLayer *display_layer;
+    GtkWidget *window_type;
+    GtkObject *kaiser_beta;
+    GtkWidget *kaiser_beta_spin;
+    WindowCache window_cache;
+    GtkWidget *display_scale;
+    GtkObject *gamma;
+    GtkWidget *gamma_spin;
+    GtkWidget *auto_range;
+    GtkWidget *lattice_type;
+    GtkWidget *domains;
+    GtkWidget *fixed_point;
+    GtkWidget *fit_label;
+    GtkWidget *spectrum_mode;
+    GtkWidget *tile_size;
+    LatticeFit fit;
+    GwyVectorLayer *roi_layer;
+    GwySelection *roi_selection;
+    gdouble roi[4];
+    gdouble corr_trans[6];
+    gdouble fft_skew[2];
+    guint recompute_id;
+    gint drift_id;
+    gboolean drift_retrace;
+    GArray *mosaic;
+} ThresholdControls;
+
+static gboolean module_register             (void);
+
+static void     skew_lattice                 (GwyContainer *data, GwyRunType run);
+static void     perform_fft                 (ThresholdControls *controls,
+                                                GwyDataField *dfield);
+static void     spectrum_update_source      (ThresholdControls *controls);
+static void     spectrum_update_corrected   (ThresholdControls *controls);
+static GwyDataField* roi_extract            (GwyDataField *field,
+                                                const gdouble *box);
+static void     roi_map_box                 (const gdouble *T,
+                                                const gdouble *box,
+                                                gdouble *out);
+static gboolean roi_corrected_box           (ThresholdControls *controls,
+                                                gdouble *box);
+static void     roi_changed                 (ThresholdControls *controls);
+static void     roi_show                    (ThresholdControls *controls);
+static void     roi_update_layer            (ThresholdControls *controls);
+static void     roi_reset                   (ThresholdControls *controls);
+static void     spectrum_welch              (ThresholdControls *controls,
+                                                GwyDataField *dfield,
+                                                gint tile);
+static void     spectrum_tile_power         (const gdouble *src,
+                                                gint xres,
+                                                gint col0, gint row0,
+                                                const WindowCacheEntry *win,
+                                                GwyDataField *rin,
+                                                GwyDataField *rout,
+                                                GwyDataField *iout,
+                                                gdouble *acc);
+static void     skew_fft_raw                (GwyDataField *rin,
+                                                GwyDataField *iin,
+                                                GwyDataField *rout,
+                                                GwyDataField *iout,
+                                                GwyTransformDirection dir);
+static void     spectrum_mode_changed       (GtkComboBox *combo,
+                                                ThresholdControls *controls);
+static void     tile_size_changed           (GtkComboBox *combo,
+                                                ThresholdControls *controls);
+static void     window_cache_init           (WindowCache *cache);
+static void     window_cache_free           (WindowCache *cache);
+static const WindowCacheEntry* window_cache_lookup(WindowCache *cache,
+                                                WindowType type,
+                                                gdouble beta,
+                                                gint xres, gint yres);
+static void     window_fill                 (gdouble *w, gint n,
+                                                WindowType type,
+                                                gdouble beta);
+static void     window_apply                (const WindowCacheEntry *win,
+                                                GwyDataField *source,
+                                                GwyDataField *dest);
+static gint     window_peak_radius          (WindowType type);
+static void     window_type_changed         (GtkComboBox *combo,
+                                                ThresholdControls *controls);
+static void     kaiser_beta_changed         (ThresholdControls *controls);
+static void     display_load_args           (ThresholdControls *controls);
+static void     selection_changed           (ThresholdControls *controls);
+static void     clear_points                (ThresholdControls *controls);
+static void     peak_find                   (ThresholdControls *controls,
+                                                gdouble *point, guint idx);
+static void     skew_do                     (ThresholdControls *controls);
+static void     skew_create_output          (GwyContainer *data, 
+                                                GwyDataField *dfield,
+                                                ThresholdControls *controls);
+static GwyContainer* skew_output_meta       (GwyContainer *data,
+                                                gint id,
+                                                GwyDataField *result,
+                                                ThresholdControls *controls);
+static gchar*   skew_format_transform       (const gdouble *m);
+static void     skew_lattice_dialog             (ThresholdControls *controls,
+                                            ThresholdRanges *ranges,
+                                            GwyContainer *data,
+                                            GwyDataField *dfield,
+                                            gint id);
+static void     threshold_set_to_full_range(ThresholdControls *controls);
+static void     threshold_lower_changed    (ThresholdControls *controls);
+static void     threshold_upper_changed    (ThresholdControls *controls);
+static void     preview                    (ThresholdControls *controls);
+static GwyDataField* preview_source        (ThresholdControls *controls);
+static GType    skew_display_layer_get_type(void) G_GNUC_CONST;
+static GwyPixmapLayer* skew_display_layer_new(void);
+static void     skew_display_layer_set_source(SkewDisplayLayer *display,
+                                            GwyDataField *source,
+                                            SkewVirtual *virtual,
+                                            GwyGradient *gradient,
+                                            gint zoom,
+                                            gdouble lower, gdouble upper);
+static void     skew_display_render        (SkewDisplayLayer *display,
+                                            GdkPixbuf *pixbuf);
+static SkewVirtual* skew_virtual_new       (GwyDataField *source,
+                                            gdouble hskew,
+                                            gdouble vskew);
+static SkewVirtual* skew_virtual_ref       (SkewVirtual *virtual);
+static void     skew_virtual_unref         (SkewVirtual *virtual);
+static void     skew_virtual_ensure        (SkewVirtual *virtual,
+                                            gint col, gint row,
+                                            gint width, gint height);
+static GwyDataField* skew_virtual_region   (SkewVirtual *virtual,
+                                            gint col, gint row,
+                                            gint width, gint height);
+static GwyDataField* skew_corrected_image  (ThresholdControls *controls);
+static GwyDataField* skew_corrected_source (ThresholdControls *controls);
+static void     skew_display_layer_set_scale(SkewDisplayLayer *display,
+                                            DisplayScale scale,
+                                            gdouble gamma);
+static void     skew_display_layer_set_marks(SkewDisplayLayer *display,
+                                            const gdouble *marks,
+                                            guint nmarks);
+static void     skew_display_draw_marks    (SkewDisplayLayer *display,
+                                            GdkPixbuf *pixbuf,
+                                            gdouble x0, gdouble y0,
+                                            gdouble cw, gdouble ch);
+static void     overlay_map_reciprocal     (gdouble *k,
+                                            gdouble h0, gdouble v0,
+                                            gdouble h, gdouble v,
+                                            gdouble r);
+static void     skew_pixel_transform       (gint xres, gint yres,
+                                            gdouble hskew, gdouble vskew,
+                                            gdouble *trans,
+                                            gint *newxres, gint *newyres);
+static void     lattice_phase_origin       (GwyDataField *image,
+                                            const LatticeBasis *real,
+                                            gdouble *origin);
+static void     overlay_reciprocal_marks   (ThresholdControls *controls,
+                                            GArray *marks);
+static void     overlay_grid_marks         (ThresholdControls *controls,
+                                            GArray *marks);
+static void     overlay_update             (ThresholdControls *controls);
+static void     recompute_schedule         (ThresholdControls *controls);
+static gboolean recompute_timeout          (gpointer user_data);
+static void     recompute_flush            (ThresholdControls *controls);
+static void     skew_display_build_lut     (SkewDisplayLayer *display,
+                                            gint nsamples);
+static void     spectrum_shift_and_histogram(GwyDataField *dfield,
+                                            gdouble dmin, gdouble dmax);
+static gdouble  spectrum_histogram_quantile(const SpectrumHistogram *hist,
+                                            gdouble q);
+static void     preview_auto_range         (ThresholdControls *controls,
+                                            GwyDataField *source);
+static void     spectrum_find_peaks        (GwyDataField *dfield,
+                                            gdouble threshold,
+                                            GArray *peaks);
+static gboolean lattice_fit_peaks          (GArray *peaks,
+                                            LatticeBasis *basis,
+                                            gdouble *rms);
+static void     lattice_reduce_basis       (LatticeBasis *basis);
+static void     lattice_real_basis         (const LatticeBasis *recip,
+                                            LatticeBasis *real);
+static void     skew_physical_matrix       (gdouble *T,
+                                            gdouble hskew, gdouble vskew,
+                                            gdouble r);
+static void     lattice_unskew_basis       (LatticeBasis *basis,
+                                            gdouble hskew, gdouble vskew,
+                                            gdouble r);
+static gboolean lattice_solve_skew         (const LatticeBasis *bases,
+                                            guint nbases,
+                                            const MosaicLink *links,
+                                            guint nlinks,
+                                            gdouble gamma, gdouble r,
+                                            gdouble *hskew, gdouble *vskew);
+static gdouble  lattice_target_angle       (LatticeType type);
+static void     lattice_fit_and_solve      (ThresholdControls *controls);
+static void     lattice_fit_clear          (LatticeFit *fit);
+static gboolean lattice_bootstrap          (LatticeFit *fit,
+                                            gdouble gamma,
+                                            gdouble r);
+static gdouble  domain_orientation         (const gdouble *power,
+                                            gint tile,
+                                            gdouble dx,
+                                            gdouble dy,
+                                            gint order,
+                                            gdouble *z);
+static void     domain_kmeans              (const gdouble *z,
+                                            const gdouble *weight,
+                                            gint ntiles,
+                                            gint k,
+                                            gint *label,
+                                            gdouble *centre);
+static void     lattice_fit_domains        (ThresholdControls *controls);
+static void     domains_changed            (GtkComboBox *combo,
+                                            ThresholdControls *controls);
+static void     fixed_point_changed        (GtkToggleButton *toggle,
+                                            ThresholdControls *controls);
+static void     lattice_idealize           (const LatticeBasis *basis,
+                                            gdouble gamma,
+                                            LatticeBasis *ideal);
+static gdouble  refine_template_fill       (const LatticeBasis *basis,
+                                            gboolean hexagonal,
+                                            gint m,
+                                            GwyDataField *t);
+static void     refine_search_init         (RefineSearch *search,
+                                            GwyDataField *image,
+                                            const gdouble *centre,
+                                            gint n);
+static void     refine_search_free         (RefineSearch *search);
+static void     refine_buffers_init        (RefineBuffers *buf,
+                                            GwyDataField *crop);
+static void     refine_buffers_free        (RefineBuffers *buf);
+static gdouble  refine_ncc                 (const RefineSearch *search,
+                                            gdouble hskew,
+                                            gdouble vskew,
+                                            RefineBuffers *buf);
+static gdouble  refine_parabola_excess     (gdouble sm,
+                                            gdouble s0,
+                                            gdouble sp);
+static void     refine_scores              (const RefineSearch *search,
+                                            const gdouble *hskew,
+                                            const gdouble *vskew,
+                                            gint n,
+                                            gdouble *scores);
+static void     lattice_refine_realspace   (ThresholdControls *controls);
+static gchar*   drift_partner_title        (const gchar *title,
+                                            gboolean *is_retrace);
+static gint     drift_find_partner         (GwyContainer *data,
+                                            gint id,
+                                            gboolean *is_retrace);
+static void     drift_phase_slope          (const gdouble *re,
+                                            const gdouble *im,
+                                            gint xres,
+                                            gint yres,
+                                            gint dx,
+                                            gint dy,
+                                            gdouble *sx,
+                                            gdouble *sy);
+static void     drift_window               (GwyDataField *source,
+                                            GwyDataField *dest,
+                                            gdouble sx,
+                                            gdouble sy);
+static DriftStatus drift_estimate          (GwyDataField *trace,
+                                            GwyDataField *retrace,
+                                            gdouble *hskew,
+                                            gdouble *vskew);
+static DriftStatus drift_estimate_pair     (GwyContainer *data,
+                                            gint id,
+                                            gint partner_id,
+                                            gboolean is_retrace,
+                                            gdouble *hskew,
+                                            gdouble *vskew);
+static const gchar* drift_status_message   (DriftStatus status);
+static void     drift_from_partner         (ThresholdControls *controls);
+static gboolean drift_meta_number          (GwyContainer *meta,
+                                            const gchar *const *keys,
+                                            guint nkeys,
+                                            gdouble *value);
+static gboolean drift_scan_timing          (GwyContainer *data,
+                                            gint id,
+                                            gdouble *t_line,
+                                            gdouble *sign);
+static void     drift_skew_to_velocity     (GwyDataField *dfield,
+                                            gdouble t_line,
+                                            const gdouble *sign,
+                                            gdouble hskew,
+                                            gdouble vskew,
+                                            gdouble *v);
+static gchar*   drift_format_velocity      (GwySIUnit *xyunit,
+                                            gdouble v);
+static void     drift_session_record       (GwyContainer *data,
+                                            gint id,
+                                            gdouble hskew,
+                                            gdouble vskew);
+static gboolean drift_session_predict      (GwyContainer *data,
+                                            gint id,
+                                            gdouble *hskew,
+                                            gdouble *vskew);
+static GArray*  mosaic_collect_tiles       (GwyContainer *data,
+                                            gint id);
+static gboolean mosaic_tile_basis          (GwyDataField *tile,
+                                            const WindowCacheEntry *win,
+                                            LatticeBasis *real);
+static gdouble  mosaic_correlate           (GwyDataField *ca,
+                                            GwyDataField *cb,
+                                            const LatticeBasis *real,
+                                            gdouble *e);
+static gdouble  mosaic_overlap_shift       (GwyDataField *a,
+                                            GwyDataField *b,
+                                            gint ox,
+                                            gint oy,
+                                            const LatticeBasis *real,
+                                            gdouble *d);
+static void     mosaic_solve               (ThresholdControls *controls);
+static void     mosaic_forget              (ThresholdControls *controls);
+static void     mosaic_create_output       (GwyContainer *data,
+                                            ThresholdControls *controls);
+static void     mosaic_correct_tile        (gint i,
+                                            gpointer user_data);
+static void     lattice_type_changed       (GtkComboBox *combo,
+                                            ThresholdControls *controls);
+static void     display_scale_changed      (GtkComboBox *combo,
+                                            ThresholdControls *controls);
+static void     gamma_changed              (ThresholdControls *controls);
+static void     auto_range_changed         (GtkToggleButton *toggle,
+                                            ThresholdControls *controls);
+static void     threshold_load_args        (ThresholdControls *controls);
+static void     threshold_save_args        (ThresholdControls *controls);
+static void     zoom_mode_changed          (GtkToggleButton *button,
+                                            ThresholdControls *controls);
+static void     image_mode_changed         (GtkToggleButton *button,
+                                            ThresholdControls *controls);
+static void     gwy_tool_level3_render_cell    (GtkCellLayout *layout,
+                            GtkCellRenderer *renderer, GtkTreeModel *model,
+                            GtkTreeIter *iter, gpointer user_data);
+static void     gwy_tool_level3_radius_changed(GwyToolLevel3 *tool);
+static void     fft_postprocess            (GwyDataField *dfield);
+static void     field_min_max              (GwyDataField *dfield,
+                                            gdouble *min,
+                                            gdouble *max);
+static void     set_dfield_modulus         (GwyDataField *re, GwyDataField *im,
+                                                GwyDataField *target);
+static void radio_buttons_attach_to_table  (GSList *group,
+                                                GtkTable *table, gint row);
+static void     skew_update_angles      (ThresholdControls *controls);
+static void     get_angles              (ThresholdControls *controls);
+static void     reFind_Peaks            (ThresholdControls *controls);
+static void     zoom_adjust_peaks       (ThresholdControls *controls);
+static void     skew_Xadjusted          (ThresholdControls *controls);
+static void     skew_Yadjusted          (ThresholdControls *controls);
+static void     skew_process            (ThresholdControls *controls);
+static void     skew_correct_image      (ThresholdControls *controls);
+static GwyDataField* skew_correct_field (GwyDataField *source,
+                                         gdouble hskew,
+                                         gdouble vskew,
+                                         gboolean fixed_point,
+                                         gdouble *trans,
+                                         gdouble *fill);
+static void     skew_lattice_immediate  (ThresholdControls *controls,
+                                         GwyContainer *data,
+                                         GwyDataField *dfield,
+                                         gint id);
+static void     reset_Xskew             (ThresholdControls *controls);
+static void     reset_Yskew             (ThresholdControls *controls);
+static void     hskew_changed           (ThresholdControls *controls);
+static void     vskew_changed           (ThresholdControls *controls);
+static gdouble  matrix_det              (const gdouble *m);
+static void     invert_matrix           (gdouble *dest, const gdouble *src);
+static gdouble  deg2rad                 (const gdouble deg);
+static void     mult_3matrix            (gdouble *dest, const gdouble *mat1,
+                                        const gdouble *mat2);
+
+static const ThresholdArgs threshold_defaults = {
+    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 3, 1, 0, 0, 0.0, FALSE, 0, 0,
+    WINDOW_HANN, 8.0, SCALE_LOG, 0.5, TRUE, LATTICE_HEXAGONAL,
+    SPECTRUM_FULL, 512, 1, FALSE
+};
+
+static const GwyEnum spectrum_modes[] = {
+    { N_("Full image"),        SPECTRUM_FULL,  },
+    { N_("Welch (tiled)"),     SPECTRUM_WELCH, },
+};
+
+static const GwyEnum tile_sizes[] = {
+    { "128", 128, },
+    { "256", 256, },
+    { "512", 512, },
+};
+
+/* Quantile of the spectrum histogram above which local maxima are taken as
+ * lattice peaks, and the inlier tolerance relative to the shorter basis
+ * vector. */
+static const gdouble fit_peak_quantile = 0.998;
+static const gdouble fit_tolerance = 0.1;
+
+/* Two-sided coverage of the bootstrap confidence intervals and the fraction
+ * of replicates that must converge for them to be reported. */
+static const gdouble bootstrap_confidence = 0.95;
+static const gdouble bootstrap_min_converged = 0.9;
+
+/* Tiles whose spectrum has a weaker orientational order than this are left
+ * out of the domain segmentation. */
+static const gdouble domain_min_coherence = 0.2;
+
+/* Overlaps whose phase correlation peak is lower than this, relative to
+ * that of identical crops, are not used as mosaic links. */
+static const gdouble mosaic_min_peak = 0.05;
+
+static const GwyEnum domain_counts[] = {
+    { N_("Single domain"), 1, },
+    { N_("2 domains"),     2, },
+    { N_("3 domains"),     3, },
+};
+
+static const GwyEnum lattice_types[] = {
+    { N_("Hexagonal"), LATTICE_HEXAGONAL, },
+    { N_("Square"),    LATTICE_SQUARE,    },
+};
+
+static const gchar histogram_key[] = "skew-lattice-histogram";
+
+/* Channel title words naming the fast-scan direction, trace first.  The
+ * retrace words are looked for first as they may contain the trace ones. */
+static const gchar *const scan_direction_words[][2] = {
+    { "forward", "backward", },
+    { "trace",   "retrace",  },
+    { "fwd",     "bwd",      },
+};
+
+/* Metadata keys of the common file importers giving the time between
+ * successive scan lines, the line rate and the slow-scan direction. */
+static const gchar *const line_time_keys[] = {
+    "Line time", "Time per line", "Time/Line", "SCAN_TIME",
+};
+
+static const gchar *const line_rate_keys[] = {
+    "Scan rate", "Scan Rate", "Line rate", "Lines per second",
+};
+
+static const gchar *const frame_direction_keys[] = {
+    "Frame direction", "SCAN_DIR", "Scan direction", "Slow scan direction",
+};
+
+/* Whether transforms may run concurrently, i.e. FFTW planning has been made
+ * thread-safe.  Otherwise the parallel regions doing mostly FFTs run on one
+ * thread. */
+static gboolean fft_parallel = FALSE;
+
+/* Drift records of the scans corrected so far in this session, oldest
+ * first. */
+static GArray *drift_session = NULL;
+
+/* Initial grid step of the real-space refinement in degrees and the factor
+ * by which each level shrinks it. */
+static const gdouble refine_step = 0.25;
+static const gdouble refine_shrink = 0.2;
+
+/* Quantiles of the spectrum histogram used for automatic display limits. */
+static const gdouble auto_lower_quantile = 0.5;
+static const gdouble auto_upper_quantile = 0.9995;
+
+static const GwyEnum display_scales[] = {
+    { N_("Linear"),      SCALE_LINEAR, },
+    { N_("Logarithmic"), SCALE_LOG,    },
+    { N_("Gamma"),       SCALE_GAMMA,  },
+};
+
+static const GwyEnum window_types[] = {
+    { N_("Hann"),            WINDOW_HANN,            },
+    { N_("Blackman-Harris"), WINDOW_BLACKMAN_HARRIS, },
+    { N_("Kaiser"),          WINDOW_KAISER,          },
+    { N_("Flat-top"),        WINDOW_FLAT_TOP,        },
+};
+
+
+static GwyModuleInfo module_info = {
+    GWY_MODULE_ABI_VERSION, &module_register,
+    N_("Tool to correct for lateral drift during scanning probe imaging; "
+    "skews image to obtain regular lattice shape."),
+    "Jeffrey J. Schwartz <schwartz@physics.ucla.edu>",
+    "1.0",
+    "Jeffrey J. Schwartz",
+    "May 2014",
+};
+
+GWY_MODULE_QUERY(module_info)
+
+G_DEFINE_TYPE(SkewDisplayLayer, skew_display_layer, GWY_TYPE_PIXMAP_LAYER)
+
+static gboolean
+module_register(void)
+{
+    gwy_process_func_register("skew_lattice",
+                (GwyProcessFunc)&skew_lattice,
+                N_("/_Correct Data/_Skew Lattice"),
+                NULL, skew_lattice_RUN_MODES, GWY_MENU_FLAG_DATA,
+                N_("Skews image to form regular lattice"));
+#ifdef HAVE_FFTW_MAKE_PLANNER_THREAD_SAFE
+    fftw_make_planner_thread_safe();
+    fft_parallel = TRUE;
+#endif
+    return TRUE;
+}
+
+static void
+skew_lattice(GwyContainer *data, GwyRunType run)
+{
+    ThresholdControls controls;
+    ThresholdArgs args;
+    ThresholdRanges ranges;
+    GwyDataField *dfield;
+    GQuark quark;
+    gint id;
+    GwyToolLevel3 tool;
+    tool.rpx = 3;
+    args = threshold_defaults;
+    controls.args = &args;
+    controls.tool = &tool;
+    g_return_if_fail(run & skew_lattice_RUN_MODES);
+    gwy_app_data_browser_get_current(GWY_APP_DATA_FIELD, &dfield,
+                                     GWY_APP_DATA_FIELD_ID, &id,
+                                     GWY_APP_DATA_FIELD_KEY, &quark, 0);
+    g_return_if_fail(dfield);
+    if (run == GWY_RUN_INTERACTIVE)
+    {
+        skew_lattice_dialog(&controls, &ranges, data,
+            gwy_data_field_duplicate(dfield), id);
+        gwy_data_field_data_changed(dfield);
+    }
+    else
+        skew_lattice_immediate(&controls, data, dfield, id);
+}
+
+/* Non-interactive correction of the drift measured against the paired
+ * trace/retrace channel, for batch use. */
+static void
+skew_lattice_immediate(ThresholdControls *controls, GwyContainer *data,
+                       GwyDataField *dfield, gint id)
+{
+    gdouble hskew, vskew;
+    gboolean is_retrace;
+    gint partner_id;
+    DriftStatus status;
+    gchar *title;
+    partner_id = drift_find_partner(data, id, &is_retrace);
+    if (partner_id < 0)
+    {
+        title = gwy_app_get_data_field_title(data, id);
+        g_warning("No trace/retrace partner of %s to measure the drift "
+                  "against.", title);
+        g_free(title);
+        return;
+    }
+    status = drift_estimate_pair(data, id, partner_id, is_retrace,
+                                 &hskew, &vskew);
+    if (status != DRIFT_OK)
+    {
+        title = gwy_app_get_data_field_title(data, id);
+        g_warning("Drift estimate of %s: %s", title,
+                  drift_status_message(status));
+        g_free(title);
+        return;
+    }
+    display_load_args(controls);
+    controls->args->Xskew = hskew;
+    controls->args->Yskew = vskew;
+    controls->id = id;
+    controls->mosaic = NULL;
+    memset(&controls->fit, 0, sizeof(LatticeFit));
+    controls->image = gwy_data_field_duplicate(dfield);
+    controls->corr_image = gwy_data_field_duplicate(dfield);
+    controls->Image_XY_Units = gwy_data_field_get_si_unit_xy(controls->image);
+    controls->Image_Z_Units = gwy_data_field_get_si_unit_z(controls->image);
+    skew_correct_image(controls);
+    skew_create_output(data, controls->corr_image, controls);
+    g_object_unref(controls->image);
+    g_object_unref(controls->corr_image);
+    skew_buffer_trim();
+}
+
+static void
+threshold_format_value(ThresholdControls *controls,
+                       GtkEntry *entry, gdouble value)
+{
+    gchar *s;
+    s = g_strdup_printf("%.*f",
+                        controls->original_XY_Format->precision+1,
+                        value/controls->original_XY_Format->magnitude);
+    gtk_entry_set_text(GTK_ENTRY(entry), s);
+    g_free(s);
+}
+
+static GtkWidget*
+threshold_entry_attach(ThresholdControls *controls,
+                       GtkTable *table, gint row,
+                       gdouble value, const gchar *name)
+{
+    GtkWidget *label, *entry;
+    label = gtk_label_new_with_mnemonic(name);
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 0, 1, row, row+1, GTK_FILL, 0, 0, 0);
+    entry = gtk_entry_new();
+    gwy_widget_set_activate_on_unfocus(entry, TRUE);
+    gtk_entry_set_width_chars(GTK_ENTRY(entry), 8);
+    threshold_format_value(controls, GTK_ENTRY(entry), value);
+    gtk_table_attach(table, entry, 1, 3, row, row+1, GTK_FILL, 0, 0, 0);
+    label = gtk_label_new(controls->original_XY_Format->units);
+    gtk_label_set_markup(GTK_LABEL(label),
+                                    controls->original_XY_Format->units);
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 3, 4, row, row+1, GTK_FILL, 0, 0, 0);
+    return entry;
+}
+
+static void
+skew_lattice_dialog(ThresholdControls *controls, ThresholdRanges *ranges,
+                 GwyContainer *data, GwyDataField *dfield, gint id)
+{
+    GtkWidget *dialog, *hbox, *button, *label;
+    GtkTable *table;
+    GwyVectorLayer *vlayer;
+    gint response, row;
+    GwyPixmapLayer *layer;
+    gdouble hskew, vskew;
+    gboolean seeded;
+    gchar *s;
+    controls->image = gwy_data_field_duplicate(dfield);
+    controls->corr_image = NULL;
+    controls->corr_virtual = NULL;
+    controls->container = data;
+    controls->id = id;    
+    controls->ranges = ranges;
+    controls->dfield = dfield;
+    {
+        gint xres = gwy_data_field_get_xres(dfield);
+        gint yres = gwy_data_field_get_yres(dfield);
+        gdouble scale = (gdouble)PREVIEW_SIZE/MAX(xres, yres);
+        controls->disp_data = gwy_data_field_new(
+                                MAX(GWY_ROUND(xres*scale), 1),
+                                MAX(GWY_ROUND(yres*scale), 1),
+                                gwy_data_field_get_xreal(dfield),
+                                gwy_data_field_get_yreal(dfield), TRUE);
+    }
+    controls->original_XY_Format = gwy_data_field_get_value_format_xy
+                            (dfield, GWY_SI_UNIT_FORMAT_MARKUP, NULL);
+    controls->Image_XY_Units = gwy_data_field_get_si_unit_xy(controls->image);
+    controls->Image_Z_Units = gwy_data_field_get_si_unit_z(controls->image);
+    controls->mydata = gwy_container_new();
+    window_cache_init(&controls->window_cache);
+    memset(&controls->fit, 0, sizeof(LatticeFit));
+    controls->mosaic = NULL;
+    controls->recompute_id = 0;
+    memset(controls->roi, 0, sizeof(controls->roi));
+    display_load_args(controls);
+    seeded = drift_session_predict(data, id, &hskew, &vskew);
+    if (seeded)
+    {
+        controls->args->Xskew = CLAMP(hskew, -30.0, 30.0);
+        controls->args->Yskew = CLAMP(vskew, -30.0, 30.0);
+    }
+    perform_fft(controls, controls->dfield);
+    controls->corr_fft = gwy_data_field_duplicate(controls->dfield);
+    gwy_data_field_get_min_max(dfield, &ranges->min, &ranges->max);
+    controls->XY_Format = gwy_data_field_get_value_format_xy
+                            (dfield, GWY_SI_UNIT_FORMAT_MARKUP, NULL);
+    controls->Z_Format = gwy_data_field_get_value_format_z
+                            (dfield, GWY_SI_UNIT_FORMAT_MARKUP, NULL);
+    dialog = gtk_dialog_new_with_buttons(_("Skew Lattice"), NULL, 0,
+                            GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+                            GTK_STOCK_OK, GTK_RESPONSE_OK, NULL);
+    gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_OK);
+    controls->dialog = dialog;
+    hbox = gtk_hbox_new(FALSE, 2);
+    gtk_box_pack_start(GTK_BOX(GTK_DIALOG(dialog)->vbox), hbox,
+                       FALSE, FALSE, 4);
+    table = GTK_TABLE(gtk_table_new(8, 4, FALSE));
+    gtk_table_set_row_spacings(table, 2);
+    gtk_table_set_col_spacings(table, 6);
+    gtk_container_set_border_width(GTK_CONTAINER(table), 4);
+    gtk_box_pack_start(GTK_BOX(hbox), GTK_WIDGET(table), TRUE, TRUE, 4);
+    label = gtk_label_new("Data Display");
+    gtk_label_set_markup(GTK_LABEL(label),
+        "<b>Data Display</b>\n(FFT: Modulus, windowed, subtract mean)");
+    gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
+    gtk_misc_set_alignment(GTK_MISC(label), 0.5, 0.5);
+    gtk_table_attach(table, label, 0, 4, 0, 1, GTK_FILL, 0, 0, 0);
+    gwy_app_sync_data_items(data, controls->mydata, id, 0, FALSE,
+                GWY_DATA_ITEM_PALETTE, GWY_DATA_ITEM_MASK_COLOR,
+                GWY_DATA_ITEM_RANGE, GWY_DATA_ITEM_REAL_SQUARE, 0);
+    gwy_container_set_object_by_name(controls->mydata, "/0/data",
+                                     controls->disp_data);
+    controls->view = gwy_data_view_new(controls->mydata);
+    layer = skew_display_layer_new();
+    gwy_pixmap_layer_set_data_key(layer, "/0/data");
+    controls->display_layer = layer;
+    gwy_data_view_set_data_prefix(GWY_DATA_VIEW(controls->view), "/0/data");
+    gwy_data_view_set_base_layer(GWY_DATA_VIEW(controls->view), layer);
+    gwy_set_data_preview_size(GWY_DATA_VIEW(controls->view), PREVIEW_SIZE);
+    vlayer = g_object_new(g_type_from_name("GwyLayerPoint"),
+                  "selection-key", "/0/select/point", NULL);
+    controls->vlayer = vlayer;
+    gwy_data_view_set_top_layer(GWY_DATA_VIEW(controls->view), vlayer);
+    controls->selection = gwy_vector_layer_ensure_selection(vlayer);
+    gwy_selection_set_max_objects(controls->selection, 4);
+    g_signal_connect_swapped(controls->selection, "changed",
+                         G_CALLBACK(selection_changed), controls);
+    g_object_ref(vlayer);
+    vlayer = g_object_new(g_type_from_name("GwyLayerRectangle"),
+                  "selection-key", "/0/select/rectangle", NULL);
+    controls->roi_layer = g_object_ref_sink(vlayer);
+    controls->roi_selection = gwy_vector_layer_ensure_selection(vlayer);
+    gwy_selection_set_max_objects(controls->roi_selection, 1);
+    g_signal_connect_swapped(controls->roi_selection, "finished",
+                         G_CALLBACK(roi_changed), controls);
+    gtk_table_attach(table, controls->view, 0, 4, 1, 2, GTK_FILL, 0, 0, 0);
+    label = gtk_label_new("Select four sequential peaks "
+                          "in the first ring around center");
+    gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
+    gtk_misc_set_alignment(GTK_MISC(label), 0.5, 0.5);
+    gtk_table_attach(table, label, 0, 4, 2, 3, GTK_FILL, 0, 0, 0);
+    controls->Angle1 = gtk_label_new("Angle 123:");
+    gtk_label_set_markup(GTK_LABEL(controls->Angle1), "<b>Angle 123:</b>");
+    gtk_label_set_width_chars (GTK_LABEL(controls->Angle1), 15);
+    gtk_misc_set_alignment(GTK_MISC(controls->Angle1), 0.0, 0.0);
+    gtk_table_attach(table, controls->Angle1, 2, 3,
+                                            3, 4, GTK_FILL, 0, 0, 0);
+    controls->Angle2 = gtk_label_new("Angle 234:");
+    gtk_label_set_markup(GTK_LABEL(controls->Angle2), "<b>Angle 234:</b>");
+    gtk_label_set_width_chars (GTK_LABEL(controls->Angle2), 15);
+    gtk_misc_set_alignment(GTK_MISC(controls->Angle2), 0.0, 1.0);
+    gtk_table_attach(table, controls->Angle2, 3, 4,
+                                            3, 4, GTK_FILL, 0, 0, 0);
+    controls->lattice_type
+        = gwy_enum_combo_box_new(lattice_types, G_N_ELEMENTS(lattice_types),
+                                 G_CALLBACK(lattice_type_changed), controls,
+                                 controls->args->lattice_type, TRUE);
+    gtk_table_attach(table, controls->lattice_type, 0, 2,
+                                            4, 5, GTK_FILL, 0, 0, 0);
+    button = gtk_button_new_with_mnemonic(_("_Fit Lattice"));
+    gtk_table_attach(table, button, 2, 3, 4, 5, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(button, "clicked",
+                             G_CALLBACK(lattice_fit_and_solve), controls);
+    button = gtk_button_new_with_mnemonic(_("_Refine"));
+    gtk_table_attach(table, button, 3, 4, 4, 5, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(button, "clicked",
+                             G_CALLBACK(lattice_refine_realspace), controls);
+    controls->fit_label = gtk_label_new(NULL);
+    gtk_misc_set_alignment(GTK_MISC(controls->fit_label), 0.0, 0.5);
+    gtk_table_attach(table, controls->fit_label, 0, 4,
+                                            5, 6, GTK_FILL, 0, 0, 0);
+    if (seeded)
+        gtk_label_set_text(GTK_LABEL(controls->fit_label),
+                           _("Skew predicted from the session drift."));
+    controls->drift_id = drift_find_partner(data, id,
+                                            &controls->drift_retrace);
+    button = gtk_button_new_with_mnemonic(_("Drift from _Trace/Retrace"));
+    gtk_widget_set_sensitive(button, controls->drift_id >= 0);
+    gtk_table_attach(table, button, 0, 2, 6, 7, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(button, "clicked",
+                             G_CALLBACK(drift_from_partner), controls);
+    controls->domains
+        = gwy_enum_combo_box_new(domain_counts, G_N_ELEMENTS(domain_counts),
+                                 G_CALLBACK(domains_changed), controls,
+                                 controls->args->domains, TRUE);
+    gtk_table_attach(table, controls->domains, 2, 4,
+                                            6, 7, GTK_FILL, 0, 0, 0);
+    controls->mosaic = mosaic_collect_tiles(data, id);
+    button = gtk_button_new_with_mnemonic(_("Correct _Mosaic"));
+    gtk_widget_set_sensitive(button, controls->mosaic->len > 1);
+    gtk_table_attach(table, button, 0, 2, 7, 8, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(button, "clicked",
+                             G_CALLBACK(mosaic_solve), controls);
+    controls->fixed_point
+        = gtk_check_button_new_with_mnemonic(_("16-_bit resampling"));
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(controls->fixed_point),
+                                 controls->args->fixed_point);
+    gtk_table_attach(table, controls->fixed_point, 2, 4,
+                                            7, 8, GTK_FILL, 0, 0, 0);
+    g_signal_connect(controls->fixed_point, "toggled",
+                     G_CALLBACK(fixed_point_changed), controls);
+    g_array_free(controls->mosaic, TRUE);
+    controls->mosaic = NULL;
+    table = GTK_TABLE(gtk_table_new(7, 4, FALSE));
+    gtk_table_set_row_spacings(table, 2);
+    gtk_table_set_col_spacings(table, 6);
+    gtk_container_set_border_width(GTK_CONTAINER(table), 4);
+    gtk_box_pack_start(GTK_BOX(hbox), GTK_WIDGET(table), TRUE, TRUE, 4);
+    row = 0;
+    label = gtk_label_new("Display Zoom: ");
+    gtk_label_set_markup(GTK_LABEL(label), "<b>Zoom:</b>");
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.0);
+    gtk_table_attach(table, label, 0, 1, row, row+1, GTK_FILL, 0, 0, 0);
+    row++;    
+    controls->zoom_mode_radios
+        = gwy_radio_buttons_createl(G_CALLBACK(zoom_mode_changed), controls,
+                                    controls->args->zoom_mode,
+                                    _("×1"), ZOOM_1,
+                                    _("×2"), ZOOM_2,
+                                    NULL);
+    radio_buttons_attach_to_table(controls->zoom_mode_radios, table, row);
+    row++;
+    label = gtk_label_new_with_mnemonic(_("_Window:"));
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 0, 1, row, row+1, GTK_FILL, 0, 0, 0);
+    controls->window_type
+        = gwy_enum_combo_box_new(window_types, G_N_ELEMENTS(window_types),
+                                 G_CALLBACK(window_type_changed), controls,
+                                 controls->args->window_type, TRUE);
+    gtk_table_attach(table, controls->window_type, 1, 4, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    row++;
+    controls->kaiser_beta = gtk_adjustment_new(controls->args->kaiser_beta,
+                                                    0, 20, 0.5, 2, 0);
+    controls->kaiser_beta_spin = gwy_table_attach_spinbutton(GTK_WIDGET(table),
+                row, _("Kaiser β:"), "", controls->kaiser_beta);
+    gtk_widget_set_sensitive(controls->kaiser_beta_spin,
+                controls->args->window_type == WINDOW_KAISER);
+    g_signal_connect_swapped(controls->kaiser_beta, "value-changed",
+                 G_CALLBACK(kaiser_beta_changed), controls);
+    row++;
+    label = gtk_label_new_with_mnemonic(_("S_pectrum:"));
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 0, 1, row, row+1, GTK_FILL, 0, 0, 0);
+    controls->spectrum_mode
+        = gwy_enum_combo_box_new(spectrum_modes, G_N_ELEMENTS(spectrum_modes),
+                                 G_CALLBACK(spectrum_mode_changed), controls,
+                                 controls->args->spectrum_mode, TRUE);
+    gtk_table_attach(table, controls->spectrum_mode, 1, 3, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    controls->tile_size
+        = gwy_enum_combo_box_new(tile_sizes, G_N_ELEMENTS(tile_sizes),
+                                 G_CALLBACK(tile_size_changed), controls,
+                                 controls->args->tile_size, FALSE);
+    gtk_widget_set_sensitive(controls->tile_size,
+                controls->args->spectrum_mode == SPECTRUM_WELCH);
+    gtk_table_attach(table, controls->tile_size, 3, 4, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    row++;
+    label = gtk_label_new("Specify intensity range:");
+    gtk_label_set_markup(GTK_LABEL(label), "<b>Specify intensity range:</b>");
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 0, 7, row, row+1, GTK_FILL, 0, 0, 0);
+    row++;
+    controls->lower = threshold_entry_attach(controls, table,
+                             row, controls->args->lower, _("_Lower:"));
+    g_signal_connect_swapped(controls->lower, "activate",
+                             G_CALLBACK(threshold_lower_changed), controls);
+    row++;
+    controls->upper = threshold_entry_attach(controls, table, row,
+                            controls->args->upper, _("_Upper:"));
+    g_signal_connect_swapped(controls->upper, "activate",
+                            G_CALLBACK(threshold_upper_changed), controls);
+    row++;
+    button = gtk_button_new_with_mnemonic(_("Set to _Full Range"));
+    gtk_table_attach(table, button, 0, 4, row, row+1, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(button, "clicked",
+                             G_CALLBACK(threshold_set_to_full_range),
+                             controls);
+    row++;
+    controls->auto_range
+        = gtk_check_button_new_with_mnemonic(_("_Automatic range"));
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(controls->auto_range),
+                                 controls->args->auto_range);
+    gtk_table_attach(table, controls->auto_range, 0, 4, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    g_signal_connect(controls->auto_range, "toggled",
+                     G_CALLBACK(auto_range_changed), controls);
+    row++;
+    label = gtk_label_new_with_mnemonic(_("_Spectrum scale:"));
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 0, 1, row, row+1, GTK_FILL, 0, 0, 0);
+    controls->display_scale
+        = gwy_enum_combo_box_new(display_scales, G_N_ELEMENTS(display_scales),
+                                 G_CALLBACK(display_scale_changed), controls,
+                                 controls->args->display_scale, TRUE);
+    gtk_table_attach(table, controls->display_scale, 1, 4, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    row++;
+    controls->gamma = gtk_adjustment_new(controls->args->gamma,
+                                         0.05, 4.0, 0.05, 0.5, 0);
+    controls->gamma_spin = gwy_table_attach_spinbutton(GTK_WIDGET(table),
+                row, _("Gamma:"), "", controls->gamma);
+    gtk_widget_set_sensitive(controls->gamma_spin,
+                controls->args->display_scale == SCALE_GAMMA);
+    g_signal_connect_swapped(controls->gamma, "value-changed",
+                 G_CALLBACK(gamma_changed), controls);
+    row++;
+    gtk_table_set_row_spacing(GTK_TABLE(table), row-1, 20);
+    label = gtk_label_new("Peak Positions:");
+    gtk_label_set_markup(GTK_LABEL(label), "<b>Peak positions:</b>");
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 0, 4, row, row+1, GTK_FILL, 0, 0, 0);
+    row++;
+    GtkTreeViewColumn *column;
+    GtkCellRenderer *renderer;
+    GwyNullStore *store;
+    store = gwy_null_store_new(4);
+    controls->tool->model = GTK_TREE_MODEL(store);
+    controls->tool->treeview =
+        GTK_TREE_VIEW(gtk_tree_view_new_with_model(controls->tool->model));
+    gchar *XUnits, *YUnits, *ZUnits;
+    XUnits = g_strdup_printf("<b>x</b> [%s]", controls->XY_Format->units);
+    YUnits = g_strdup_printf("<b>y</b> [%s]", controls->XY_Format->units);
+    ZUnits = g_strdup_printf("<b>value</b> [%s]", controls->Z_Format->units);
+    guint i;
+    for (i = 0; i < NCOLUMNS; i++) {
+        column = gtk_tree_view_column_new();
+        g_object_set_data(G_OBJECT(column), "id", GUINT_TO_POINTER(i));
+        renderer = gtk_cell_renderer_text_new();
+        g_object_set(renderer, "xalign", 1.0, NULL);
+        gtk_cell_layout_pack_start(GTK_CELL_LAYOUT(column), renderer, TRUE);
+        gtk_cell_layout_set_cell_data_func(GTK_CELL_LAYOUT(column), renderer,
+                                            gwy_tool_level3_render_cell,
+                                            controls, NULL);
+        label = gtk_label_new(NULL);
+        switch (i)
+        {
+            case 0:
+                gtk_label_set_markup(GTK_LABEL(label), "<b>n</b>");
+                break;
+            case 1:
+                gtk_label_set_markup(GTK_LABEL(label), XUnits);
+                break;
+            case 2:
+                gtk_label_set_markup(GTK_LABEL(label), YUnits);
+                break;
+            case 3:
+                gtk_label_set_markup(GTK_LABEL(label), ZUnits);
+                break;
+        }
+        gtk_tree_view_column_set_widget(column, label);
+        gtk_widget_show(label);
+        gtk_tree_view_append_column(controls->tool->treeview, column);
+    }
+    gtk_table_attach(table, GTK_WIDGET(controls->tool->treeview),
+            0, 4, row, row+1, GTK_FILL, 0, 0, 0);
+    row++;
+    g_free(XUnits);
+    g_free(YUnits);
+    g_free(ZUnits);
+    button = gtk_button_new_with_mnemonic(_("Clear Points"));
+    gtk_table_attach(table, button, 0, 2, row, row+1, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(button, "clicked",
+                             G_CALLBACK(clear_points), controls);
+    button = gtk_button_new_with_mnemonic(_("_Whole Image"));
+    gtk_table_attach(table, button, 2, 4, row, row+1, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(button, "clicked",
+                             G_CALLBACK(roi_reset), controls);
+    row++;
+    controls->tool->radius = gtk_adjustment_new(controls->tool->rpx,
+                                                            0, 10, 1, 5, 0);
+    gwy_table_attach_spinbutton(GTK_WIDGET(table), row, 
+                _("Peak search radius:"),
+                "px", controls->tool->radius);
+    g_signal_connect_swapped(controls->tool->radius, "value-changed",
+                 G_CALLBACK(gwy_tool_level3_radius_changed), controls->tool);
+    row++;
+    gtk_table_set_row_spacing(GTK_TABLE(table), row-1, 10);
+    label = gtk_label_new("Display Mode:");
+    gtk_label_set_markup(GTK_LABEL(label), "<b>Display Mode:</b>");
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 0, 5, row, row+1, GTK_FILL, 0, 0, 0);
+    row++;
+    controls->image_mode_radios
+        = gwy_radio_buttons_createl(G_CALLBACK(image_mode_changed), controls,
+                                    controls->args->image_mode,
+                                    _("Image"), IMAGE_DATA,
+                                    _("Image FFT"), IMAGE_FFT,
+                                    _("Skewed Image"), IMAGE_CORRECTED,
+                                    _("Skewed FFT"), IMAGE_FFT_CORRECTED,
+                                    NULL);
+    radio_buttons_attach_to_table(controls->image_mode_radios, table, row);
+    row += 2;
+    gtk_table_set_row_spacing(GTK_TABLE(table), row-1, 10);
+    label = gtk_label_new("Horizontal Skew:");
+    gtk_label_set_markup(GTK_LABEL(label), "<b>Horizontal Skew:</b>");
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 0, 3, row, row+1, GTK_FILL, 0, 0, 0);
+    button = gtk_button_new_with_mnemonic(_("Reset X Skew"));
+    gtk_table_attach(table, button, 3, 5, row, row+1, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(button, "clicked",
+                             G_CALLBACK(reset_Xskew), controls);
+    row++;
+    controls->skew_Xadjust = gtk_adjustment_new(controls->args->Xskew,
+                                                -30, 30, 1, 1, 0);
+    controls->skew_Xslider = gtk_hscale_new(
+                                (GtkAdjustment*)controls->skew_Xadjust);
+    gtk_table_attach(table, controls->skew_Xslider, 0, 3,
+                            row, row+1, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(controls->skew_Xadjust, "value-changed",
+                         G_CALLBACK(skew_Xadjusted), controls);
+    controls->hskewtxt = gtk_entry_new();
+    gwy_widget_set_activate_on_unfocus(controls->hskewtxt, TRUE);
+    gtk_entry_set_width_chars(GTK_ENTRY(controls->hskewtxt), 5);
+    s = g_strdup_printf("%0.1f", controls->args->Xskew);
+    gtk_entry_set_text(GTK_ENTRY(controls->hskewtxt), s);
+    g_free(s);
+    gtk_table_attach(table, controls->hskewtxt, 3, 4,
+                            row, row+1, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(controls->hskewtxt, "activate",
+                            G_CALLBACK(hskew_changed), controls);
+    label = gtk_label_new("deg");
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.0);
+    gtk_table_attach(table, label, 4, 5, row, row+1, GTK_FILL, 0, 0, 0);
+    row++;
+    label = gtk_label_new("Vertical Skew:");
+    gtk_label_set_markup(GTK_LABEL(label), "<b>Vertical Skew:</b>");
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 0, 3, row, row+1, GTK_FILL, 0, 0, 0);
+    button = gtk_button_new_with_mnemonic(_("Reset Y Skew"));
+    gtk_table_attach(table, button, 3, 5, row, row+1, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(button, "clicked",
+                             G_CALLBACK(reset_Yskew), controls);
+    row++;
+    controls->skew_Yadjust = gtk_adjustment_new(controls->args->Yskew,
+                                                -30, 30, 1, 1, 0);
+    controls->skew_Yslider = gtk_hscale_new(
+                                (GtkAdjustment*)controls->skew_Yadjust);
+    gtk_table_attach(table, controls->skew_Yslider, 0, 3,
+                            row, row+1, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(controls->skew_Yadjust, "value-changed",
+                         G_CALLBACK(skew_Yadjusted), controls);
+    controls->vskewtxt = gtk_entry_new();
+    gwy_widget_set_activate_on_unfocus(controls->vskewtxt, TRUE);
+    gtk_entry_set_width_chars(GTK_ENTRY(controls->vskewtxt), 5);
+    s = g_strdup_printf("%0.1f", controls->args->Yskew);
+    gtk_entry_set_text(GTK_ENTRY(controls->vskewtxt), s);
+    g_free(s);
+    gtk_table_attach(table, controls->vskewtxt, 3, 4,
+                            row, row+1, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(controls->vskewtxt, "activate",
+                             G_CALLBACK(vskew_changed), controls);
+    label = gtk_label_new("deg");
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.0);
+    gtk_table_attach(table, label, 4, 5, row, row+1, GTK_FILL, 0, 0, 0);
+    row++;
+    threshold_load_args(controls);
+    skew_process(controls);
+    preview(controls);
+    roi_update_layer(controls);
+    gtk_widget_show_all(dialog);
+    do
+    {
+        response = gtk_dialog_run(GTK_DIALOG(dialog));
+        switch (response)
+        {
+            case GTK_RESPONSE_CANCEL:
+            case GTK_RESPONSE_DELETE_EVENT:
+                gtk_widget_destroy(dialog);
+            case GTK_RESPONSE_NONE:
+                if (controls->recompute_id)
+                    g_source_remove(controls->recompute_id);
+                if (controls->corr_virtual)
+                    skew_virtual_unref(controls->corr_virtual);
+                g_object_unref(controls->mydata);
+                g_object_unref(controls->vlayer);
+                g_object_unref(controls->roi_layer);
+                window_cache_free(&controls->window_cache);
+                skew_buffer_trim();
+                lattice_fit_clear(&controls->fit);
+                if (controls->mosaic)
+                    g_array_free(controls->mosaic, TRUE);
+                gwy_si_unit_value_format_free(controls->XY_Format);
+                gwy_si_unit_value_format_free(controls->Z_Format);
+                threshold_save_args(controls);
+                return;
+                break;
+            case GTK_RESPONSE_OK:
+                break;
+            default:
+                g_assert_not_reached();
+                break;
+        }
+    } while (response != GTK_RESPONSE_OK);
+    if (controls->recompute_id)
+        g_source_remove(controls->recompute_id);
+    threshold_save_args(controls);
+    skew_do(controls);
+    gtk_widget_destroy(dialog);
+    g_object_unref(controls->mydata);
+    g_object_unref(controls->vlayer);
+    g_object_unref(controls->roi_layer);
+    window_cache_free(&controls->window_cache);
+    skew_buffer_trim();
+    lattice_fit_clear(&controls->fit);
+    if (controls->mosaic)
+        g_array_free(controls->mosaic, TRUE);
+    gwy_si_unit_value_format_free(controls->original_XY_Format);
+    gwy_si_unit_value_format_free(controls->XY_Format);
+    gwy_si_unit_value_format_free(controls->Z_Format);
+}
+
+static void
+radio_buttons_attach_to_table(GSList *group, 
+                GtkTable *table, gint row)
+{
+    g_return_val_if_fail(GTK_IS_TABLE(table), row);
+    while (group)
+    {
+        gtk_table_attach(table, GTK_WIDGET(group->data),
+                         0, 2, row, row + 1,
+                         GTK_EXPAND | GTK_FILL, 0, 0, 0);
+        group = g_slist_next(group);
+        gtk_table_attach(table, GTK_WIDGET(group->data),
+                         3, 5, row, row + 1,
+                         GTK_EXPAND | GTK_FILL, 0, 0, 0);
+        row++;
+        group = g_slist_next(group);
+    }
+}
+
+static void
+threshold_set_to_range(ThresholdControls *controls,
+                       gdouble lower, gdouble upper)
+{
+    threshold_format_value(controls, GTK_ENTRY(controls->lower), lower);
+    gtk_widget_activate(controls->lower);
+    threshold_format_value(controls, GTK_ENTRY(controls->upper), upper);
+    gtk_widget_activate(controls->upper);
+    preview(controls);
+}
+
+static void
+threshold_set_to_full_range(ThresholdControls *controls)
+{
+    threshold_set_to_range(controls,
+           controls->ranges->min, controls->ranges->max);
+}
+
+static void
+threshold_lower_changed(ThresholdControls *controls)
+{
+    const gchar *value = gtk_entry_get_text(GTK_ENTRY(controls->lower));
+    gdouble num =
+        g_strtod(value, NULL) * controls->original_XY_Format->magnitude;
+    if (controls->args->auto_range)
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(controls->auto_range),
+                                     FALSE);
+    if (num >= controls->ranges->min && num <= controls->ranges->max)
+        controls->args->lower = num;
+    else
+    {
+        if (num < controls->ranges->min)
+            controls->args->lower = controls->ranges->min;
+        else if (num > controls->ranges->max)
+            controls->args->lower = controls->ranges->max; 
+    }
+    threshold_format_value(controls,
+        GTK_ENTRY(controls->lower), controls->args->lower);
+    threshold_save_args(controls);
+    preview(controls);
+}
+
+static void
+threshold_upper_changed(ThresholdControls *controls)
+{
+    const gchar *value = gtk_entry_get_text(GTK_ENTRY(controls->upper));
+    gdouble num =
+        g_strtod(value, NULL) * controls->original_XY_Format->magnitude;
+    if (controls->args->auto_range)
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(controls->auto_range),
+                                     FALSE);
+    if (num >= controls->ranges->min && num <= controls->ranges->max)
+        controls->args->upper = num;
+    else
+    {
+        if (num < controls->ranges->min)
+            controls->args->upper = controls->ranges->min;
+        else if (num > controls->ranges->max)
+            controls->args->upper = controls->ranges->max;
+    }
+    threshold_format_value(controls, GTK_ENTRY(controls->upper),
+            controls->args->upper);
+    threshold_save_args(controls);
+    preview(controls);
+}
+
+static GwyDataField*
+preview_source(ThresholdControls *controls)
+{
+    switch (controls->args->image_mode)
+    {
+        case IMAGE_DATA:
+            return controls->image;
+        case IMAGE_FFT:
+            return controls->dfield;
+        case IMAGE_CORRECTED:
+            return skew_corrected_image(controls);
+        case IMAGE_FFT_CORRECTED:
+            return controls->corr_fft;
+    }
+    g_return_val_if_reached(controls->image);
+}
+
+/* A skewed image not yet resampled as a whole is shown straight from its
+ * lazy tiles, with the geometry and range known from the transform. */
+static void
+preview(ThresholdControls *controls)
+{
+    GwyDataField *source;
+    SkewVirtual *virtual = NULL;
+    GwyGradient *gradient;
+    const guchar *palette = NULL;
+    gdouble Xreal, Yreal, Xoff, Yoff;
+    gint zoom = controls->args->zoom_mode;
+    SKEW_PROBE2(preview_entry, (gint)controls->args->image_mode, zoom);
+    if (controls->args->image_mode == IMAGE_CORRECTED
+        && !controls->corr_image)
+        virtual = controls->corr_virtual;
+    if (virtual)
+    {
+        source = virtual->source;
+        Xreal = virtual->xres*gwy_data_field_get_xmeasure(source);
+        Yreal = virtual->yres*gwy_data_field_get_ymeasure(source);
+        Xoff = Yoff = 0.0;
+    }
+    else
+    {
+        source = preview_source(controls);
+        Xreal = gwy_data_field_get_xreal(source);
+        Yreal = gwy_data_field_get_yreal(source);
+        Xoff = gwy_data_field_get_xoffset(source);
+        Yoff = gwy_data_field_get_yoffset(source);
+    }
+    gwy_data_field_set_xreal(controls->disp_data, Xreal/zoom);
+    gwy_data_field_set_yreal(controls->disp_data, Yreal/zoom);
+    gwy_data_field_set_xoffset(controls->disp_data,
+                               Xoff + 0.5*Xreal*(1.0 - 1.0/zoom));
+    gwy_data_field_set_yoffset(controls->disp_data,
+                               Yoff + 0.5*Yreal*(1.0 - 1.0/zoom));
+    gwy_data_field_set_si_unit_xy(controls->disp_data,
+                                  gwy_data_field_get_si_unit_xy(source));
+    gwy_data_field_set_si_unit_z(controls->disp_data,
+                                 gwy_data_field_get_si_unit_z(source));
+    field_min_max(source, &controls->ranges->min, &controls->ranges->max);
+    if (virtual && (virtual->trans[1] || virtual->trans[2]))
+        controls->ranges->min = virtual->fill;
+    if (controls->args->auto_range)
+    {
+        preview_auto_range(controls, source);
+        threshold_format_value(controls, GTK_ENTRY(controls->lower),
+                               controls->args->lower);
+        threshold_format_value(controls, GTK_ENTRY(controls->upper),
+                               controls->args->upper);
+    }
+    /* Only spectra are compressed; heights are always shown linearly. */
+    skew_display_layer_set_scale(SKEW_DISPLAY_LAYER(controls->display_layer),
+                                 (controls->args->image_mode == IMAGE_FFT
+                                  || controls->args->image_mode
+                                     == IMAGE_FFT_CORRECTED)
+                                 ? controls->args->display_scale
+                                 : SCALE_LINEAR,
+                                 controls->args->gamma);
+    gwy_container_gis_string_by_name(controls->mydata, "/0/base/palette",
+                                     &palette);
+    gradient = gwy_gradients_get_gradient((const gchar*)palette);
+    skew_display_layer_set_source(SKEW_DISPLAY_LAYER(controls->display_layer),
+                                  source, virtual, gradient, zoom,
+                                  MIN(controls->args->lower,
+                                      controls->args->upper),
+                                  MAX(controls->args->lower,
+                                      controls->args->upper));
+    overlay_update(controls);
+    gwy_data_field_data_changed(controls->disp_data);
+    gwy_set_data_preview_size(GWY_DATA_VIEW(controls->view), PREVIEW_SIZE);
+    SKEW_PROBE2(preview_return,
+                virtual ? virtual->xres : gwy_data_field_get_xres(source),
+                virtual ? virtual->yres : gwy_data_field_get_yres(source));
+}
+
+/* Spectra carry their histogram, so the limits come without a data pass;
+ * real-space images simply use their full range. */
+static void
+preview_auto_range(ThresholdControls *controls, GwyDataField *source)
+{
+    const SpectrumHistogram *hist;
+    hist = g_object_get_data(G_OBJECT(source), histogram_key);
+    if (hist && hist->n)
+    {
+        controls->args->lower = spectrum_histogram_quantile(hist,
+                                                    auto_lower_quantile);
+        controls->args->upper = spectrum_histogram_quantile(hist,
+                                                    auto_upper_quantile);
+    }
+    else
+    {
+        controls->args->lower = controls->ranges->min;
+        controls->args->upper = controls->ranges->max;
+    }
+}
+
+static void
+display_scale_changed(GtkComboBox *combo, ThresholdControls *controls)
+{
+    controls->args->display_scale = gwy_enum_combo_box_get_active(combo);
+    gtk_widget_set_sensitive(controls->gamma_spin,
+                controls->args->display_scale == SCALE_GAMMA);
+    threshold_save_args(controls);
+    preview(controls);
+}
+
+static void
+gamma_changed(ThresholdControls *controls)
+{
+    controls->args->gamma = gtk_adjustment_get_value(
+                            (GtkAdjustment*)controls->gamma);
+    threshold_save_args(controls);
+    preview(controls);
+}
+
+static void
+auto_range_changed(GtkToggleButton *toggle, ThresholdControls *controls)
+{
+    controls->args->auto_range = gtk_toggle_button_get_active(toggle);
+    threshold_save_args(controls);
+    if (controls->args->auto_range)
+        preview(controls);
+}
+
+static GwyPixmapLayer*
+skew_display_layer_new(void)
+{
+    return (GwyPixmapLayer*)g_object_new(SKEW_TYPE_DISPLAY_LAYER, NULL);
+}
+
+static void
+skew_display_layer_set_source(SkewDisplayLayer *display, GwyDataField *source,
+                              SkewVirtual *virtual, GwyGradient *gradient,
+                              gint zoom, gdouble lower, gdouble upper)
+{
+    g_object_ref(source);
+    if (display->source)
+        g_object_unref(display->source);
+    display->source = source;
+    if (virtual)
+        skew_virtual_ref(virtual);
+    if (display->virtual)
+        skew_virtual_unref(display->virtual);
+    display->virtual = virtual;
+    display->gradient = gradient;
+    display->zoom = MAX(zoom, 1);
+    display->lower = lower;
+    display->upper = upper;
+}
+
+static GdkPixbuf*
+skew_display_layer_paint(GwyPixmapLayer *layer)
+{
+    SkewDisplayLayer *display = SKEW_DISPLAY_LAYER(layer);
+    g_return_val_if_fail(layer->data_field, NULL);
+    gwy_pixmap_layer_make_pixbuf(layer, FALSE);
+    if (display->source && display->gradient)
+        skew_display_render(display, layer->pixbuf);
+    return layer->pixbuf;
+}
+
+static void
+skew_display_layer_set_scale(SkewDisplayLayer *display, DisplayScale scale,
+                             gdouble gamma)
+{
+    if (display->scale == (gint)scale && display->gamma == gamma)
+        return;
+    display->scale = scale;
+    display->gamma = gamma;
+    display->lut_nsamples = 0;
+}
+
+static void
+skew_display_layer_set_marks(SkewDisplayLayer *display, const gdouble *marks,
+                             guint nmarks)
+{
+    g_free(display->marks);
+    display->marks = nmarks ? g_memdup(marks, 2*nmarks*sizeof(gdouble))
+                            : NULL;
+    display->nmarks = nmarks;
+}
+
+/* Maps the normalised value, quantised to DISPLAY_LUT_SIZE steps, to the
+ * palette sample; log and gamma scaling thus cost nothing per pixel. */
+static void
+skew_display_build_lut(SkewDisplayLayer *display, gint nsamples)
+{
+    gdouble t, y, eps, norm;
+    gint i;
+    if (!display->lut)
+        display->lut = g_new(guint16, DISPLAY_LUT_SIZE);
+    eps = pow(10.0, -HISTOGRAM_DECADES/2);
+    norm = log1p(1.0/eps);
+    for (i = 0; i < DISPLAY_LUT_SIZE; i++)
+    {
+        t = i/(DISPLAY_LUT_SIZE - 1.0);
+        switch (display->scale)
+        {
+            case SCALE_LOG:
+                y = log1p(t/eps)/norm;
+                break;
+            case SCALE_GAMMA:
+                y = pow(t, display->gamma);
+                break;
+            default:
+                y = t;
+                break;
+        }
+        display->lut[i] = CLAMP(GWY_ROUND(y*(nsamples - 1)), 0, nsamples - 1);
+    }
+    display->lut_nsamples = nsamples;
+}
+
+static void
+skew_display_layer_finalize(GObject *object)
+{
+    SkewDisplayLayer *display = SKEW_DISPLAY_LAYER(object);
+    g_free(display->lut);
+    g_free(display->marks);
+    if (display->source)
+        g_object_unref(display->source);
+    if (display->virtual)
+        skew_virtual_unref(display->virtual);
+    G_OBJECT_CLASS(skew_display_layer_parent_class)->finalize(object);
+}
+
+static void
+skew_display_layer_class_init(SkewDisplayLayerClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+    GwyPixmapLayerClass *pixmap_class = GWY_PIXMAP_LAYER_CLASS(klass);
+    gobject_class->finalize = skew_display_layer_finalize;
+    pixmap_class->paint = skew_display_layer_paint;
+}
+
+static void
+skew_display_layer_init(SkewDisplayLayer *display)
+{
+    display->zoom = 1;
+}
+
+/* Nearest-neighbour sampling of the zoomed central area of the source, the
+ * range mapping and the scale/palette lookup are done in a single pass over
+ * the output pixels. */
+static void
+skew_display_render(SkewDisplayLayer *display, GdkPixbuf *pixbuf)
+{
+    SkewVirtual *virtual = display->virtual;
+    const gdouble *src, *row;
+    const guchar *samples, *s;
+    guchar *pixels, *pix;
+    gint *cols;
+    gint width, height, rowstride, xres, yres, nsamples, i, j, k, r0, r1;
+    gdouble cw, ch, x0, y0, lower, upper, q, v;
+    width = gdk_pixbuf_get_width(pixbuf);
+    height = gdk_pixbuf_get_height(pixbuf);
+    rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    pixels = gdk_pixbuf_get_pixels(pixbuf);
+    if (virtual)
+    {
+        xres = virtual->xres;
+        yres = virtual->yres;
+        src = NULL;
+    }
+    else
+    {
+        xres = gwy_data_field_get_xres(display->source);
+        yres = gwy_data_field_get_yres(display->source);
+        src = gwy_data_field_get_data_const(display->source);
+    }
+    samples = gwy_gradient_get_samples(display->gradient, &nsamples);
+    if (display->lut_nsamples != nsamples)
+        skew_display_build_lut(display, nsamples);
+    lower = display->lower;
+    upper = display->upper;
+    if (upper <= lower)
+    {
+        if (virtual)
+        {
+            lower = virtual->fill;
+            upper = virtual->max;
+        }
+        else
+            gwy_data_field_get_min_max(display->source, &lower, &upper);
+    }
+    q = (upper > lower) ? (DISPLAY_LUT_SIZE - 1)/(upper - lower) : 0.0;
+    cw = (gdouble)xres/display->zoom;
+    ch = (gdouble)yres/display->zoom;
+    x0 = 0.5*(xres - cw);
+    y0 = 0.5*(yres - ch);
+    cols = g_new(gint, width);
+    for (j = 0; j < width; j++)
+        cols[j] = CLAMP((gint)(x0 + (j + 0.5)*cw/width), 0, xres-1);
+    if (virtual)
+    {
+        r0 = CLAMP((gint)(y0 + 0.5*ch/height), 0, yres-1);
+        r1 = CLAMP((gint)(y0 + (height - 0.5)*ch/height), 0, yres-1);
+        skew_virtual_ensure(virtual, cols[0], r0,
+                            cols[width-1] - cols[0] + 1, r1 - r0 + 1);
+    }
+    for (i = 0; i < height; i++)
+    {
+        k = CLAMP((gint)(y0 + (i + 0.5)*ch/height), 0, yres-1);
+        pix = pixels + i*rowstride;
+        if (virtual)
+        {
+            r0 = k/VIRTUAL_TILE;
+            r1 = k % VIRTUAL_TILE;
+            row = NULL;
+        }
+        else
+            row = src + k*xres;
+        for (j = 0; j < width; j++, pix += 3)
+        {
+            if (virtual)
+                v = gwy_data_field_get_val(
+                        virtual->tiles[r0*virtual->xtiles
+                                       + cols[j]/VIRTUAL_TILE],
+                        cols[j] % VIRTUAL_TILE, r1);
+            else
+                v = row[cols[j]];
+            v = (v - lower)*q;
+            k = (v <= 0.0) ? 0
+                : (v >= DISPLAY_LUT_SIZE - 1) ? DISPLAY_LUT_SIZE - 1 : (gint)v;
+            s = samples + 4*display->lut[k];
+            pix[0] = s[0];
+            pix[1] = s[1];
+            pix[2] = s[2];
+        }
+    }
+    g_free(cols);
+    if (display->nmarks)
+        skew_display_draw_marks(display, pixbuf, x0, y0, cw, ch);
+}
+
+/* Draws each mark as a small cross inverting the pixels under it, which
+ * shows on any palette. */
+static void
+skew_display_draw_marks(SkewDisplayLayer *display, GdkPixbuf *pixbuf,
+                        gdouble x0, gdouble y0, gdouble cw, gdouble ch)
+{
+    guchar *pixels, *pix;
+    gint width, height, rowstride, cx, cy, d, x, y;
+    guint m;
+    width = gdk_pixbuf_get_width(pixbuf);
+    height = gdk_pixbuf_get_height(pixbuf);
+    rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    pixels = gdk_pixbuf_get_pixels(pixbuf);
+    for (m = 0; m < display->nmarks; m++)
+    {
+        cx = (gint)floor((display->marks[2*m] + 0.5 - x0)*width/cw);
+        cy = (gint)floor((display->marks[2*m + 1] + 0.5 - y0)*height/ch);
+        for (d = -OVERLAY_MARK_SIZE; d <= OVERLAY_MARK_SIZE; d++)
+        {
+            x = cx + d;
+            if (x >= 0 && x < width && cy >= 0 && cy < height)
+            {
+                pix = pixels + cy*rowstride + 3*x;
+                pix[0] = 255 - pix[0];
+                pix[1] = 255 - pix[1];
+                pix[2] = 255 - pix[2];
+            }
+            y = cy + d;
+            if (d && y >= 0 && y < height && cx >= 0 && cx < width)
+            {
+                pix = pixels + y*rowstride + 3*cx;
+                pix[0] = 255 - pix[0];
+                pix[1] = 255 - pix[1];
+                pix[2] = 255 - pix[2];
+            }
+        }
+    }
+}
+
+/* Peaks are searched for in the full-resolution source of the current view;
+ * positions are kept in physical coordinates so they survive zooming. */
+static void
+peak_find(ThresholdControls *controls, gdouble *point, guint idx)
+{
+    GwyDataField *dfield = preview_source(controls);
+    gint i, j, low_i, high_i, low_j, high_j;
+    gdouble temp_i, temp_j, temp_z;
+    gdouble dxoff, dyoff, sxoff, syoff;
+    gint Xres, Yres;
+    Xres = gwy_data_field_get_xres(dfield);
+    Yres = gwy_data_field_get_yres(dfield);
+    dxoff = gwy_data_field_get_xoffset(controls->disp_data);
+    dyoff = gwy_data_field_get_yoffset(controls->disp_data);
+    sxoff = gwy_data_field_get_xoffset(dfield);
+    syoff = gwy_data_field_get_yoffset(dfield);
+    gint col = gwy_data_field_rtoj(dfield, point[0] + dxoff - sxoff);
+    gint row = gwy_data_field_rtoi(dfield, point[1] + dyoff - syoff);
+    col = CLAMP(col, 0, Xres-1);
+    row = CLAMP(row, 0, Yres-1);
+    temp_i = col;
+    temp_j = row;    
+    temp_z = gwy_data_field_get_val(dfield, col, row);
+    gint32 r = controls->tool->rpx;
+    low_i = col - r;
+    high_i = col + r;
+    if (low_i < 0)
+        low_i = 0;
+    if (high_i > Xres)
+        high_i = Xres;
+    low_j = row - r;
+    high_j = row + r;
+    if (low_j < 0)
+        low_j = 0;
+    if (high_j > Yres)
+        high_j = Yres;
+    for (i = low_i; i < high_i; i++)
+    {
+        for (j = low_j; j < high_j; j++)
+        {
+            if (gwy_data_field_get_val(dfield, i, j) > temp_z)
+            {
+                temp_i = i;
+                temp_j = j;
+                temp_z = gwy_data_field_get_val(dfield, i, j);
+            }
+        }
+    }
+    controls->p[idx][0] = gwy_data_field_jtor(dfield, temp_i) + sxoff;
+    controls->p[idx][1] = gwy_data_field_itor(dfield, temp_j) + syoff;
+    controls->p[idx][2] = temp_z;
+    if ((row - temp_j) != 0 || (col - temp_i) != 0)
+    {
+        point[0] = controls->p[idx][0] - dxoff;
+        point[1] = controls->p[idx][1] - dyoff;
+        gwy_selection_set_object(controls->selection, idx, point);
+    }
+}
+
+static void
+reFind_Peaks(ThresholdControls *controls)
+{
+    int i, num = 0;
+    SKEW_PROBE1(peaks_entry,
+                (gint)gwy_selection_get_data(controls->selection, NULL));
+    for (i = 0; i < 4; i++)
+    {
+        double point[2];
+        if (gwy_selection_get_object(controls->selection, i, point))
+        {
+            gdouble xoff, yoff;
+            peak_find(controls, point, i);
+            xoff = gwy_data_field_get_xoffset(controls->disp_data);
+            yoff = gwy_data_field_get_yoffset(controls->disp_data);
+            point[0] = controls->p[num][0] - xoff;
+            point[1] = controls->p[num][1] - yoff;
+            gwy_selection_set_object(controls->selection, i, point);
+            num++;
+        }
+    }
+    preview(controls);
+    SKEW_PROBE1(peaks_return, num);
+}
+
+static void
+zoom_adjust_peaks(ThresholdControls *controls)
+{
+    int i, num = 0;
+    for (i = 0; i < 4; i++)
+    {
+        double point[2];
+        if (gwy_selection_get_object(controls->selection, i, point))
+        {
+            gdouble xoff, yoff;
+            xoff = gwy_data_field_get_xoffset(controls->disp_data);
+            yoff = gwy_data_field_get_yoffset(controls->disp_data);
+            point[0] = controls->p[num][0] - xoff;
+            point[1] = controls->p[num][1] - yoff;
+            gwy_selection_set_object(controls->selection, i, point);
+            num++;
+        }
+    }
+    reFind_Peaks(controls);
+}
+
+/* Sets up the skewed image for the current skew without resampling any of
+ * it; the spectrum then pulls in only the part it needs. */
+static void
+skew_process(ThresholdControls *controls)
+{
+    SkewVirtual *virtual;
+    SKEW_PROBE4(process_entry,
+                gwy_data_field_get_xres(controls->image),
+                gwy_data_field_get_yres(controls->image),
+                SKEW_PROBE_MDEG(controls->args->Xskew),
+                SKEW_PROBE_MDEG(controls->args->Yskew));
+    g_object_unref(controls->corr_fft);
+    controls->corr_fft = NULL;
+    if (controls->corr_image)
+        g_object_unref(controls->corr_image);
+    controls->corr_image = NULL;
+    if (controls->corr_virtual)
+        skew_virtual_unref(controls->corr_virtual);
+    virtual = skew_virtual_new(controls->image, controls->args->Xskew,
+                               controls->args->Yskew);
+    controls->corr_virtual = virtual;
+    memcpy(controls->corr_trans, virtual->trans, sizeof(virtual->trans));
+    controls->args->background_fill = virtual->fill;
+    controls->args->newxres = virtual->xres;
+    controls->args->newyres = virtual->yres;
+    spectrum_update_corrected(controls);
+    controls->fft_skew[0] = controls->args->Xskew;
+    controls->fft_skew[1] = controls->args->Yskew;
+    SKEW_PROBE2(process_return, virtual->xres, virtual->yres);
+}
+
+/* The whole skewed image, resampled on first use. */
+static GwyDataField*
+skew_corrected_image(ThresholdControls *controls)
+{
+    SkewVirtual *virtual = controls->corr_virtual;
+    if (!controls->corr_image)
+    {
+        controls->corr_image = skew_virtual_region(virtual, 0, 0,
+                                                   virtual->xres,
+                                                   virtual->yres);
+        gwy_data_field_set_si_unit_xy(controls->corr_image,
+                                      controls->Image_XY_Units);
+        gwy_data_field_set_si_unit_z(controls->corr_image,
+                                     controls->Image_Z_Units);
+    }
+    return controls->corr_image;
+}
+
+/* A copy of the skewed image, or of its part under the spectrum rectangle,
+ * for which only the covered tiles are resampled. */
+static GwyDataField*
+skew_corrected_source(ThresholdControls *controls)
+{
+    SkewVirtual *virtual = controls->corr_virtual;
+    GwyDataField *region;
+    gdouble box[4];
+    gint col, row, width, height;
+    if (!roi_corrected_box(controls, box))
+        return gwy_data_field_duplicate(skew_corrected_image(controls));
+    col = CLAMP(GWY_ROUND(box[0]), 0, virtual->xres);
+    row = CLAMP(GWY_ROUND(box[1]), 0, virtual->yres);
+    width = CLAMP(GWY_ROUND(box[2]), 0, virtual->xres) - col;
+    height = CLAMP(GWY_ROUND(box[3]), 0, virtual->yres) - row;
+    if (width < ROI_MIN_SIZE || height < ROI_MIN_SIZE)
+        return gwy_data_field_duplicate(skew_corrected_image(controls));
+    region = skew_virtual_region(virtual, col, row, width, height);
+    gwy_data_field_set_si_unit_xy(region, controls->Image_XY_Units);
+    gwy_data_field_set_si_unit_z(region, controls->Image_Z_Units);
+    return region;
+}
+
+/* Moves the reciprocal vector k of the spectrum of the image sheared by
+ * (h0, v0) to where it lies in the spectrum of the image sheared by (h, v):
+ * back to the raw frame by the transpose of the first shear, forward by the
+ * inverse transpose of the second. */
+static void
+overlay_map_reciprocal(gdouble *k, gdouble h0, gdouble v0, gdouble h,
+                       gdouble v, gdouble r)
+{
+    gdouble T[6], iT[6], x, y;
+    skew_physical_matrix(T, h0, v0, r);
+    x = T[0]*k[0] + T[1]*k[1];
+    y = T[2]*k[0] + T[3]*k[1];
+    skew_physical_matrix(T, h, v, r);
+    T[4] = T[5] = 0.0;
+    invert_matrix(iT, T);
+    k[0] = iT[0]*x + iT[1]*y;
+    k[1] = iT[2]*x + iT[3]*y;
+}
+
+/* Marks on the skewed spectrum where the fitted lattice, or failing that
+ * the selected peaks and their higher orders, move under the current skew.
+ * Only the known peak positions are transformed, so this can follow every
+ * slider tick while the spectrum itself is recomputed once the user
+ * pauses. */
+static void
+overlay_reciprocal_marks(ThresholdControls *controls, GArray *marks)
+{
+    GwyDataField *spectrum = controls->corr_fft;
+    const LatticeBasis *basis = &controls->fit.basis;
+    gdouble point[2], k[2], r, xoff, yoff, sxoff, syoff, sdx, sdy;
+    gint h, l;
+    guint i, n;
+    r = gwy_data_field_get_xmeasure(controls->image)
+        / gwy_data_field_get_ymeasure(controls->image);
+    sxoff = gwy_data_field_get_xoffset(spectrum);
+    syoff = gwy_data_field_get_yoffset(spectrum);
+    sdx = gwy_data_field_get_xmeasure(spectrum);
+    sdy = gwy_data_field_get_ymeasure(spectrum);
+    if (controls->fit.valid)
+    {
+        for (h = -OVERLAY_ORDERS; h <= OVERLAY_ORDERS; h++)
+        {
+            for (l = -OVERLAY_ORDERS; l <= OVERLAY_ORDERS; l++)
+            {
+                if (!h && !l)
+                    continue;
+                k[0] = h*basis->a[0] + l*basis->b[0];
+                k[1] = h*basis->a[1] + l*basis->b[1];
+                overlay_map_reciprocal(k, controls->fit.hskew,
+                                       controls->fit.vskew,
+                                       controls->args->Xskew,
+                                       controls->args->Yskew, r);
+                k[0] = (k[0] - sxoff)/sdx;
+                k[1] = (k[1] - syoff)/sdy;
+                g_array_append_vals(marks, k, 2);
+            }
+        }
+        return;
+    }
+    xoff = gwy_data_field_get_xoffset(controls->disp_data);
+    yoff = gwy_data_field_get_yoffset(controls->disp_data);
+    n = gwy_selection_get_data(controls->selection, NULL);
+    for (i = 0; i < n; i++)
+    {
+        gwy_selection_get_object(controls->selection, i, point);
+        for (h = -OVERLAY_ORDERS; h <= OVERLAY_ORDERS; h++)
+        {
+            if (!h)
+                continue;
+            k[0] = h*(point[0] + xoff);
+            k[1] = h*(point[1] + yoff);
+            overlay_map_reciprocal(k, controls->fft_skew[0],
+                                   controls->fft_skew[1],
+                                   controls->args->Xskew,
+                                   controls->args->Yskew, r);
+            k[0] = (k[0] - sxoff)/sdx;
+            k[1] = (k[1] - syoff)/sdy;
+            g_array_append_vals(marks, k, 2);
+        }
+    }
+}
+
+/* Marks the nodes of the ideal lattice on the skewed image: the fitted
+ * lattice carried to the current skew by the pixel transform, with its
+ * first vector and the phase of the raw image kept and the second vector
+ * set to the target angle and length.  Where the skew is right the atoms
+ * sit on the marks across the whole image.  Nodes are thinned to stay
+ * apart on the screen. */
+static void
+overlay_grid_marks(ThresholdControls *controls, GArray *marks)
+{
+    LatticeFit *fit = &controls->fit;
+    LatticeBasis raw;
+    gdouble trans[6], a[2], b[2], o[2], c[2], node[2];
+    gdouble dx, dy, r, len, gamma, phi, cross, scale, lo[2], hi[2], det, u;
+    gint xres, yres, newxres, newyres, m, n, step, k;
+    if (!fit->valid)
+        return;
+    dx = gwy_data_field_get_xmeasure(controls->image);
+    dy = gwy_data_field_get_ymeasure(controls->image);
+    r = dx/dy;
+    lattice_real_basis(&fit->basis, &raw);
+    lattice_unskew_basis(&raw, fit->hskew, fit->vskew, r);
+    if (!fit->origin_valid)
+    {
+        lattice_phase_origin(controls->image, &raw, fit->origin);
+        fit->origin_valid = TRUE;
+    }
+    xres = gwy_data_field_get_xres(controls->image);
+    yres = gwy_data_field_get_yres(controls->image);
+    skew_pixel_transform(xres, yres, controls->args->Xskew,
+                         controls->args->Yskew, trans, &newxres, &newyres);
+    a[0] = (trans[0]*raw.a[0]/dx + trans[2]*raw.a[1]/dy)*dx;
+    a[1] = (trans[1]*raw.a[0]/dx + trans[3]*raw.a[1]/dy)*dy;
+    b[0] = (trans[0]*raw.b[0]/dx + trans[2]*raw.b[1]/dy)*dx;
+    b[1] = (trans[1]*raw.b[0]/dx + trans[3]*raw.b[1]/dy)*dy;
+    len = hypot(a[0], a[1]);
+    gamma = deg2rad(lattice_target_angle(controls->args->lattice_type));
+    cross = a[0]*b[1] - a[1]*b[0];
+    if (a[0]*b[0] + a[1]*b[1] < 0.0)
+        gamma = PI - gamma;
+    phi = atan2(a[1], a[0]) + ((cross >= 0.0) ? gamma : -gamma);
+    b[0] = len*cos(phi);
+    b[1] = len*sin(phi);
+    /* Everything below is in pixels of the skewed frame. */
+    a[0] /= dx;
+    a[1] /= dy;
+    b[0] /= dx;
+    b[1] /= dy;
+    o[0] = trans[0]*fit->origin[0]/dx + trans[2]*fit->origin[1]/dy + trans[4];
+    o[1] = trans[1]*fit->origin[0]/dx + trans[3]*fit->origin[1]/dy + trans[5];
+    det = a[0]*b[1] - a[1]*b[0];
+    if (fabs(det) < 1e-9)
+        return;
+    lo[0] = lo[1] = G_MAXDOUBLE;
+    hi[0] = hi[1] = -G_MAXDOUBLE;
+    for (k = 0; k < 4; k++)
+    {
+        c[0] = ((k & 1) ? newxres : 0) - o[0];
+        c[1] = ((k & 2) ? newyres : 0) - o[1];
+        u = (c[0]*b[1] - c[1]*b[0])/det;
+        lo[0] = MIN(lo[0], u);
+        hi[0] = MAX(hi[0], u);
+        u = (a[0]*c[1] - a[1]*c[0])/det;
+        lo[1] = MIN(lo[1], u);
+        hi[1] = MAX(hi[1], u);
+    }
+    scale = PREVIEW_SIZE*controls->args->zoom_mode/(gdouble)MAX(newxres,
+                                                                 newyres);
+    step = (gint)ceil(3.0*OVERLAY_MARK_SIZE
+                      /(scale*MIN(hypot(a[0], a[1]), hypot(b[0], b[1]))));
+    step = MAX(step, 1);
+    while ((hi[0] - lo[0])*(hi[1] - lo[1])/(step*step) > OVERLAY_MAX_MARKS)
+        step++;
+    for (m = (gint)ceil(lo[0]/step)*step; m <= hi[0]; m += step)
+    {
+        for (n = (gint)ceil(lo[1]/step)*step; n <= hi[1]; n += step)
+        {
+            node[0] = o[0] + m*a[0] + n*b[0];
+            node[1] = o[1] + m*a[1] + n*b[1];
+            if (node[0] >= 0.0 && node[0] < newxres
+                && node[1] >= 0.0 && node[1] < newyres)
+                g_array_append_vals(marks, node, 2);
+        }
+    }
+}
+
+/* Overlay of the current view: predicted peaks on the skewed spectrum or
+ * the ideal lattice on the skewed image. */
+static void
+overlay_update(ThresholdControls *controls)
+{
+    SkewDisplayLayer *display = SKEW_DISPLAY_LAYER(controls->display_layer);
+    GArray *marks;
+    marks = g_array_new(FALSE, FALSE, sizeof(gdouble));
+    if (controls->args->image_mode == IMAGE_FFT_CORRECTED
+        && controls->corr_fft)
+        overlay_reciprocal_marks(controls, marks);
+    else if (controls->args->image_mode == IMAGE_CORRECTED)
+        overlay_grid_marks(controls, marks);
+    skew_display_layer_set_marks(display, (const gdouble*)marks->data,
+                                 marks->len/2);
+    g_array_free(marks, TRUE);
+}
+
+/* Defers the resampling and spectrum of a new skew until the slider has
+ * rested for RECOMPUTE_DELAY ms; until then only the overlay follows. */
+static void
+recompute_schedule(ThresholdControls *controls)
+{
+    if (controls->recompute_id)
+        g_source_remove(controls->recompute_id);
+    controls->recompute_id = g_timeout_add(RECOMPUTE_DELAY,
+                                           recompute_timeout, controls);
+    overlay_update(controls);
+    gwy_data_field_data_changed(controls->disp_data);
+}
+
+static gboolean
+recompute_timeout(gpointer user_data)
+{
+    ThresholdControls *controls = (ThresholdControls*)user_data;
+    controls->recompute_id = 0;
+    skew_process(controls);
+    reFind_Peaks(controls);
+    return FALSE;
+}
+
+/* Brings the skewed image and spectrum up to date before anything reads
+ * them. */
+static void
+recompute_flush(ThresholdControls *controls)
+{
+    if (!controls->recompute_id)
+        return;
+    g_source_remove(controls->recompute_id);
+    recompute_timeout(controls);
+}
+
+static void
+skew_correct_image(ThresholdControls *controls)
+{
+    g_object_unref(controls->corr_image);
+    controls->corr_image = skew_correct_field(controls->image,
+                                    controls->args->Xskew,
+                                    controls->args->Yskew,
+                                    controls->args->fixed_point,
+                                    controls->corr_trans,
+                                    &controls->args->background_fill);
+    controls->args->newxres = gwy_data_field_get_xres(controls->corr_image);
+    controls->args->newyres = gwy_data_field_get_yres(controls->corr_image);
+    gwy_data_field_set_si_unit_xy(controls->corr_image,
+            controls->Image_XY_Units);
+    gwy_data_field_set_si_unit_z(controls->corr_image,
+            controls->Image_Z_Units);
+}
+
+/* Shears source by the given skews into a new field just large enough to
+ * hold it, with the pixel size kept.  The pixel transform including the
+ * shift into the new frame goes to trans and the value used for the
+ * uncovered corners to fill.  With fixed_point the resampling runs on
+ * 16-bit samples.  Does not touch anything shared, so several fields may
+ * be corrected in parallel. */
+static GwyDataField*
+skew_correct_field(GwyDataField *source, gdouble hskew, gdouble vskew,
+                   gboolean fixed_point, gdouble *trans, gdouble *fill)
+{
+    GwyDataField *temp, *dest;
+    gdouble iTrans[6];
+    gdouble xreal, yreal, min, max;
+    gint oxres, oyres, xres, yres;
+    oxres = gwy_data_field_get_xres(source);
+    oyres = gwy_data_field_get_yres(source);
+    gwy_data_field_get_min_max(source, &min, &max);
+    *fill = min - 0.05 * (max - min);
+    skew_pixel_transform(oxres, oyres, hskew, vskew, trans, &xres, &yres);
+    xreal = gwy_data_field_get_xreal(source) * xres/oxres;
+    yreal = gwy_data_field_get_yreal(source) * yres/oyres;
+    dest = gwy_data_field_new(xres, yres, xreal, yreal, FALSE);
+    gwy_data_field_fill(dest, *fill);
+    temp = gwy_data_field_duplicate(source);
+    invert_matrix(iTrans, trans);
+    if (fixed_point)
+        skew_affine_fixed(temp, dest, iTrans, *fill);
+    else
+        skew_affine(temp, dest, iTrans, GWY_INTERPOLATION_BILINEAR, *fill);
+    g_object_unref(temp);
+    return dest;
+}
+
+/* The pixel transform of an xres by yres image sheared by the given skews,
+ * shifted so that the sheared image starts at the origin, and the size of
+ * the frame just holding it. */
+static void
+skew_pixel_transform(gint xres, gint yres, gdouble hskew, gdouble vskew,
+                     gdouble *trans, gint *newxres, gint *newyres)
+{
+    gint i;
+    gdouble Trans[6];
+    gdouble p[3], Tp[3], cornX[4], cornY[4], TcornX[4], TcornY[4];
+    gdouble lowX, highX, lowY, highY;
+    gdouble hAngle, vAngle;
+    hAngle = deg2rad(hskew);
+    vAngle = deg2rad(vskew);
+    cornX[0] = 0;
+    cornX[1] = xres;
+    cornX[2] = xres;
+    cornX[3] = 0;
+    cornY[0] = 0;
+    cornY[1] = 0;
+    cornY[2] = yres;
+    cornY[3] = yres;
+    Trans[0] = 1;
+    Trans[1] = tan(vAngle);
+    Trans[2] = tan(hAngle);
+    Trans[3] = 1;
+    Trans[4] = 0;
+    Trans[5] = 0;
+    for (i = 0; i < 4; i++)
+    {
+        p[0] = cornX[i];
+        p[1] = cornY[i];
+        p[2] = 1;
+        mult_3matrix(Tp, Trans, p);
+        TcornX[i] = Tp[0];
+        TcornY[i] = Tp[1];
+    }
+    lowX = TcornX[0];
+    highX = TcornX[0];
+    lowY = TcornY[0];
+    highY = TcornY[0];
+    for (i = 1; i < 4; i++)
+    {
+        if (TcornX[i] < lowX)
+            lowX = TcornX[i];
+        if (TcornX[i] > highX)
+            highX = TcornX[i];
+        if (TcornY[i] < lowY)
+            lowY = TcornY[i];
+        if (TcornY[i] > highY)
+            highY = TcornY[i];
+    }
+    *newxres = GWY_ROUND(highX - lowX);
+    *newyres = GWY_ROUND(highY - lowY);
+    Trans[4] = -lowX;
+    Trans[5] = -lowY;
+    memcpy(trans, Trans, sizeof(Trans));
+}
+
+static SkewVirtual*
+skew_virtual_new(GwyDataField *source, gdouble hskew, gdouble vskew)
+{
+    SkewVirtual *virtual;
+    gdouble min, max;
+    virtual = g_new0(SkewVirtual, 1);
+    virtual->refcount = 1;
+    virtual->source = g_object_ref(source);
+    gwy_data_field_get_min_max(source, &min, &max);
+    virtual->fill = min - 0.05 * (max - min);
+    virtual->max = max;
+    skew_pixel_transform(gwy_data_field_get_xres(source),
+                         gwy_data_field_get_yres(source), hskew, vskew,
+                         virtual->trans, &virtual->xres, &virtual->yres);
+    invert_matrix(virtual->itrans, virtual->trans);
+    virtual->xtiles = (virtual->xres + VIRTUAL_TILE - 1)/VIRTUAL_TILE;
+    virtual->ytiles = (virtual->yres + VIRTUAL_TILE - 1)/VIRTUAL_TILE;
+    virtual->tiles = g_new0(GwyDataField*, virtual->xtiles*virtual->ytiles);
+    return virtual;
+}
+
+static SkewVirtual*
+skew_virtual_ref(SkewVirtual *virtual)
+{
+    virtual->refcount++;
+    return virtual;
+}
+
+static void
+skew_virtual_unref(SkewVirtual *virtual)
+{
+    gint i;
+    if (--virtual->refcount)
+        return;
+    for (i = 0; i < virtual->xtiles*virtual->ytiles; i++)
+    {
+        if (virtual->tiles[i])
+            g_object_unref(virtual->tiles[i]);
+    }
+    g_free(virtual->tiles);
+    g_object_unref(virtual->source);
+    g_free(virtual);
+}
+
+/* Resamples the missing tiles under the pixel box in parallel.  Each tile
+ * is the resampler run on its part of the frame, the inverse transform
+ * shifted by the tile origin. */
+static void
+skew_virtual_ensure(SkewVirtual *virtual, gint col, gint row,
+                    gint width, gint height)
+{
+    gdouble dx, dy;
+    gint *todo;
+    gint tx0, ty0, tx1, ty1, tx, ty, n, k;
+    tx0 = CLAMP(col, 0, virtual->xres - 1)/VIRTUAL_TILE;
+    ty0 = CLAMP(row, 0, virtual->yres - 1)/VIRTUAL_TILE;
+    tx1 = CLAMP(col + width - 1, 0, virtual->xres - 1)/VIRTUAL_TILE;
+    ty1 = CLAMP(row + height - 1, 0, virtual->yres - 1)/VIRTUAL_TILE;
+    todo = g_new(gint, (tx1 - tx0 + 1)*(ty1 - ty0 + 1));
+    n = 0;
+    for (ty = ty0; ty <= ty1; ty++)
+    {
+        for (tx = tx0; tx <= tx1; tx++)
+        {
+            if (!virtual->tiles[ty*virtual->xtiles + tx])
+                todo[n++] = ty*virtual->xtiles + tx;
+        }
+    }
+    dx = gwy_data_field_get_xmeasure(virtual->source);
+    dy = gwy_data_field_get_ymeasure(virtual->source);
+#ifdef _OPENMP
+#pragma omp parallel for private(k) schedule(dynamic) if (n > 1)
+#endif
+    for (k = 0; k < n; k++)
+    {
+        GwyDataField *tile;
+        gdouble itrans[6];
+        gint c0, r0, w, h;
+        c0 = (todo[k] % virtual->xtiles)*VIRTUAL_TILE;
+        r0 = (todo[k]/virtual->xtiles)*VIRTUAL_TILE;
+        w = MIN(VIRTUAL_TILE, virtual->xres - c0);
+        h = MIN(VIRTUAL_TILE, virtual->yres - r0);
+        memcpy(itrans, virtual->itrans, sizeof(itrans));
+        itrans[4] += itrans[0]*c0 + itrans[2]*r0;
+        itrans[5] += itrans[1]*c0 + itrans[3]*r0;
+        tile = gwy_data_field_new(w, h, w*dx, h*dy, FALSE);
+        skew_affine(virtual->source, tile, itrans,
+                    GWY_INTERPOLATION_BILINEAR, virtual->fill);
+        virtual->tiles[todo[k]] = tile;
+    }
+    g_free(todo);
+}
+
+/* The pixel box of the skewed image as a field of its own, resampling only
+ * the tiles it covers. */
+static GwyDataField*
+skew_virtual_region(SkewVirtual *virtual, gint col, gint row,
+                    gint width, gint height)
+{
+    GwyDataField *region, *tile;
+    SkewStats stats;
+    gdouble dx, dy;
+    gint tx, ty, c0, r0, c1, r1;
+    gboolean whole;
+    dx = gwy_data_field_get_xmeasure(virtual->source);
+    dy = gwy_data_field_get_ymeasure(virtual->source);
+    skew_virtual_ensure(virtual, col, row, width, height);
+    region = gwy_data_field_new(width, height, width*dx, height*dy, FALSE);
+    whole = (!col && !row && width == virtual->xres
+             && height == virtual->yres);
+    skew_stats_init(&stats);
+    for (ty = row/VIRTUAL_TILE; ty <= (row + height - 1)/VIRTUAL_TILE; ty++)
+    {
+        for (tx = col/VIRTUAL_TILE; tx <= (col + width - 1)/VIRTUAL_TILE;
+             tx++)
+        {
+            tile = virtual->tiles[ty*virtual->xtiles + tx];
+            c0 = MAX(col, tx*VIRTUAL_TILE);
+            r0 = MAX(row, ty*VIRTUAL_TILE);
+            c1 = MIN(col + width, (tx + 1)*VIRTUAL_TILE);
+            r1 = MIN(row + height, (ty + 1)*VIRTUAL_TILE);
+            gwy_data_field_area_copy(tile, region,
+                                     c0 - tx*VIRTUAL_TILE,
+                                     r0 - ty*VIRTUAL_TILE,
+                                     c1 - c0, r1 - r0, c0 - col, r0 - row);
+            if (whole && skew_stats_get(tile))
+                skew_stats_merge(&stats, skew_stats_get(tile));
+        }
+    }
+    /* The whole frame is exactly the union of the tiles. */
+    if (whole)
+        skew_stats_attach(region, &stats);
+    return region;
+}
+
+static void
+skew_create_output(GwyContainer *data,
+    GwyDataField *dfield, ThresholdControls *controls)
+{
+    GwyContainer *meta;
+    gchar *key;
+    gint id, newid;
+    gdouble oxres, oyres, xres, yres;
+    gdouble xreal, yreal, xscale, yscale;
+    SKEW_PROBE4(output_entry,
+                controls->args->newxres, controls->args->newyres,
+                SKEW_PROBE_MDEG(controls->args->Xskew),
+                SKEW_PROBE_MDEG(controls->args->Yskew));
+    oxres = gwy_data_field_get_xres(controls->image);
+    oyres = gwy_data_field_get_yres(controls->image);
+    xres = controls->args->newxres;
+    yres = controls->args->newyres;
+    xscale = xres/oxres;
+    yscale = yres/oyres;
+    xreal = gwy_data_field_get_xreal(controls->image) * xscale;
+    yreal = gwy_data_field_get_yreal(controls->image) * yscale;
+    gwy_data_field_set_xreal(dfield, xreal);
+    gwy_data_field_set_yreal(dfield, yreal);
+    gwy_data_field_set_si_unit_xy(dfield,
+        controls->Image_XY_Units);
+    gwy_data_field_set_si_unit_z(dfield,
+        controls->Image_Z_Units);
+    gwy_app_data_browser_get_current(GWY_APP_DATA_FIELD_ID, &id, 0);
+    meta = skew_output_meta(data, id, dfield, controls);
+    skew_stats_detach(dfield);
+    newid = gwy_app_data_browser_add_data_field(dfield, data, TRUE);
+    key = g_strdup_printf("/%i/meta", newid);
+    gwy_container_set_object_by_name(data, key, meta);
+    g_object_unref(meta);
+    g_free(key);
+    gwy_app_set_data_field_title(data, newid, _("Skewed"));
+    gwy_app_channel_log_add(data, controls->id,
+        newid, "proc::skew_lattice", NULL);
+    drift_session_record(data, id, controls->args->Xskew,
+                         controls->args->Yskew);
+    SKEW_PROBE1(output_return, newid);
+}
+
+/* Metadata of the source channel with the applied skew added, the
+ * drift velocity it corresponds to when the line time is known, and the
+ * physical transforms between the source and result frames so that
+ * coordinates can be mapped without resampling (see skew_lattice.h). */
+static GwyContainer*
+skew_output_meta(GwyContainer *data, gint id, GwyDataField *result,
+                 ThresholdControls *controls)
+{
+    const guchar *title;
+    GwyContainer *meta, *source_meta;
+    GwyDataField *dfield;
+    gchar *key, *s;
+    gdouble t_line, sign[2], v[2];
+    gdouble trans[6], m[6], im[6];
+    gdouble dx, dy, xoff, yoff;
+    gint newxres, newyres;
+    key = g_strdup_printf("/%i/meta", id);
+    if (gwy_container_gis_object_by_name(data, key, &source_meta))
+        meta = gwy_container_duplicate(source_meta);
+    else
+        meta = gwy_container_new();
+    g_free(key);
+    key = g_strdup_printf("/%i/data/title", id);
+    if (gwy_container_gis_string_by_name(data, key, &title))
+        gwy_container_set_const_string_by_name(meta, "Source Title", title);
+    g_free(key);
+    s = g_strdup_printf("%.5f", controls->args->Xskew);
+    gwy_container_set_const_string_by_name(meta, "X Skew (°)",
+                                           (const guchar *)s);
+    g_free(s);
+    s = g_strdup_printf("%.5f", controls->args->Yskew);
+    gwy_container_set_const_string_by_name(meta, "Y Skew (°)",
+                                           (const guchar *)s);
+    g_free(s);
+    dfield = GWY_DATA_FIELD(gwy_container_get_object(data,
+                                    gwy_app_get_data_key_for_id(id)));
+    skew_pixel_transform(gwy_data_field_get_xres(dfield),
+                         gwy_data_field_get_yres(dfield),
+                         controls->args->Xskew, controls->args->Yskew,
+                         trans, &newxres, &newyres);
+    dx = gwy_data_field_get_xmeasure(dfield);
+    dy = gwy_data_field_get_ymeasure(dfield);
+    xoff = gwy_data_field_get_xoffset(dfield);
+    yoff = gwy_data_field_get_yoffset(dfield);
+    m[0] = trans[0];
+    m[1] = trans[1]*dy/dx;
+    m[2] = trans[2]*dx/dy;
+    m[3] = trans[3];
+    m[4] = gwy_data_field_get_xoffset(result) + trans[4]*dx
+           - m[0]*xoff - m[2]*yoff;
+    m[5] = gwy_data_field_get_yoffset(result) + trans[5]*dy
+           - m[1]*xoff - m[3]*yoff;
+    invert_matrix(im, m);
+    s = skew_format_transform(m);
+    gwy_container_set_const_string_by_name(meta, SKEW_LATTICE_META_FORWARD,
+                                           (const guchar *)s);
+    g_free(s);
+    s = skew_format_transform(im);
+    gwy_container_set_const_string_by_name(meta, SKEW_LATTICE_META_INVERSE,
+                                           (const guchar *)s);
+    g_free(s);
+    if (controls->fit.ci_valid
+        && fabs(controls->args->Xskew - controls->fit.hsolved) < 1e-4
+        && fabs(controls->args->Yskew - controls->fit.vsolved) < 1e-4)
+    {
+        key = g_strdup_printf("X Skew %g%% CI (°)",
+                              100.0*bootstrap_confidence);
+        s = g_strdup_printf("%.5f to %.5f",
+                            controls->fit.hci[0], controls->fit.hci[1]);
+        gwy_container_set_const_string_by_name(meta, key,
+                                               (const guchar *)s);
+        g_free(s);
+        g_free(key);
+        key = g_strdup_printf("Y Skew %g%% CI (°)",
+                              100.0*bootstrap_confidence);
+        s = g_strdup_printf("%.5f to %.5f",
+                            controls->fit.vci[0], controls->fit.vci[1]);
+        gwy_container_set_const_string_by_name(meta, key,
+                                               (const guchar *)s);
+        g_free(s);
+        g_free(key);
+    }
+    if (drift_scan_timing(data, id, &t_line, sign))
+    {
+        drift_skew_to_velocity(dfield, t_line, sign, controls->args->Xskew,
+                               controls->args->Yskew, v);
+        s = drift_format_velocity(gwy_data_field_get_si_unit_xy(dfield),
+                                  v[0]);
+        gwy_container_set_const_string_by_name(meta, "X Drift Velocity",
+                                               (const guchar *)s);
+        g_free(s);
+        s = drift_format_velocity(gwy_data_field_get_si_unit_xy(dfield),
+                                  v[1]);
+        gwy_container_set_const_string_by_name(meta, "Y Drift Velocity",
+                                               (const guchar *)s);
+        g_free(s);
+    }
+    return meta;
+}
+
+/* The six numbers of an affine transform, locale independent so that
+ * skew_lattice_parse_transform() reads them back anywhere. */
+static gchar*
+skew_format_transform(const gdouble *m)
+{
+    gchar buf[6][G_ASCII_DTOSTR_BUF_SIZE];
+    gint i;
+    for (i = 0; i < 6; i++)
+        g_ascii_formatd(buf[i], G_ASCII_DTOSTR_BUF_SIZE, "%.12g", m[i]);
+    return g_strjoin(" ", buf[0], buf[1], buf[2], buf[3], buf[4], buf[5],
+                     NULL);
+}
+
+static void
+gwy_tool_level3_render_cell(GtkCellLayout *layout,
+            GtkCellRenderer *renderer, GtkTreeModel *model,
+            GtkTreeIter *iter, gpointer user_data)
+{
+    ThresholdControls *controls = (ThresholdControls*)user_data;
+    const GwySIValueFormat *vf;
+    gchar buf[32];
+    gdouble point[2];
+    gdouble val;
+    guint idx, id;
+    id = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(layout), "id"));
+    gtk_tree_model_get(model, iter, 0, &idx, -1);
+    if (id == COLUMN_I)
+    {
+        g_snprintf(buf, sizeof(buf), "%d", idx + 1);
+        g_object_set(renderer, "text", buf, NULL);
+        return;
+    }
+    if (!controls->selection ||
+            !gwy_selection_get_object(controls->selection, idx, point))
+    {
+        g_object_set(renderer, "text", "", NULL);
+        return;
+    }
+    switch (id)
+    {
+        case COLUMN_X:
+            if (controls->args->image_mode == IMAGE_FFT_CORRECTED)
+                peak_find(controls, point, idx);
+            vf = controls->XY_Format;
+            val = controls->p[idx][0];
+            break;
+        case COLUMN_Y:
+            vf = controls->XY_Format;
+            val = controls->p[idx][1];
+            break;
+        case COLUMN_Z:
+            vf = controls->Z_Format;
+            val = controls->p[idx][2];
+            break;
+        default:
+            g_return_if_reached();
+            break;
+    }
+    if (vf)
+        g_snprintf(buf, sizeof(buf), "%.*f",
+            vf->precision, val/vf->magnitude);
+    else
+        g_snprintf(buf, sizeof(buf), "%.3g", val);
+    g_object_set(renderer, "text", buf, NULL);
+    skew_update_angles(controls);
+}
+
+static void
+skew_Xadjusted(ThresholdControls *controls)
+{
+    GtkAdjustment *adj = (GtkAdjustment*)controls->skew_Xadjust;
+    controls->args->Xskew = adj->value;
+    mosaic_forget(controls);
+    recompute_schedule(controls);
+    gchar *s = g_strdup_printf("%0.1f", adj->value);
+    gtk_entry_set_text(GTK_ENTRY(controls->hskewtxt), s);
+    g_free(s);
+}
+
+static void
+skew_Yadjusted(ThresholdControls *controls)
+{
+    GtkAdjustment *adj = (GtkAdjustment*)controls->skew_Yadjust;
+    controls->args->Yskew = adj->value;
+    mosaic_forget(controls);
+    recompute_schedule(controls);
+    gchar *s = g_strdup_printf("%0.1f", adj->value);
+    gtk_entry_set_text(GTK_ENTRY(controls->vskewtxt), s);
+    g_free(s);
+}
+
+static void
+skew_update_angles(ThresholdControls *controls)
+{
+    if (gwy_selection_is_full(controls->selection))
+    {
+        get_angles(controls);
+        gtk_label_set_markup(GTK_LABEL(controls->Angle1),
+            g_strdup_printf("<b>Angle 123: </b>%0.1f°",
+                                        controls->args->angle1));
+        gtk_label_set_markup(GTK_LABEL(controls->Angle2),
+            g_strdup_printf("<b>Angle 234: </b>%0.1f°",
+                                        controls->args->angle2));
+    }
+    else
+    {
+        gtk_label_set_markup(GTK_LABEL(controls->Angle1), "<b>Angle 123:</b>");
+        gtk_label_set_markup(GTK_LABEL(controls->Angle2), "<b>Angle 234:</b>");
+    }
+}
+
+static void
+get_angles(ThresholdControls *controls)
+{
+    gdouble x1, x2, x3, x4, y1, y2, y3, y4;
+    gdouble ax, ay, bx, by, a, b, ab;
+    x1 = controls->p[0][0];
+    y1 = controls->p[0][1];
+    x2 = controls->p[1][0];
+    y2 = controls->p[1][1];
+    x3 = controls->p[2][0];
+    y3 = controls->p[2][1];
+    x4 = controls->p[3][0];
+    y4 = controls->p[3][1];
+    ax = x1 - x2;
+    ay = y1 - y2;
+    bx = x3 - x2;
+    by = y3 - y2;
+    a = sqrt(ax*ax + ay*ay);
+    b = sqrt(bx*bx + by*by);
+    ab = ax*bx + ay*by;
+    controls->args->angle1 = acos(ab / (a*b)) * 180/PI;
+    ax = x4 - x3;
+    ay = y4 - y3;
+    bx = x2 - x3;
+    by = y2 - y3;
+    a = sqrt(ax*ax + ay*ay);
+    ab = ax*bx + ay*by;
+    controls->args->angle2 = acos(ab / (a*b)) * 180/PI;
+}
+
+static gint
+spectrum_peak_compare(gconstpointer a, gconstpointer b)
+{
+    const SpectrumPeak *pa = (const SpectrumPeak*)a;
+    const SpectrumPeak *pb = (const SpectrumPeak*)b;
+    if (pa->z > pb->z)
+        return -1;
+    if (pa->z < pb->z)
+        return 1;
+    return 0;
+}
+
+/* Strict local maxima above threshold, refined to subpixel precision by
+ * parabolas through the logarithm of the neighbours, which also gives the
+ * peak width.  Only the strongest FIT_MAX_PEAKS are kept. */
+static void
+spectrum_find_peaks(GwyDataField *dfield, gdouble threshold, GArray *peaks)
+{
+    const gdouble *d;
+    SpectrumPeak peak;
+    gint xres, yres, i, j, ii, jj;
+    gdouble z, dx, dy, xoff, yoff, lm, l0, lp, c1, c2, sx, sy;
+    gboolean ismax;
+    xres = gwy_data_field_get_xres(dfield);
+    yres = gwy_data_field_get_yres(dfield);
+    dx = gwy_data_field_get_xmeasure(dfield);
+    dy = gwy_data_field_get_ymeasure(dfield);
+    xoff = gwy_data_field_get_xoffset(dfield);
+    yoff = gwy_data_field_get_yoffset(dfield);
+    d = gwy_data_field_get_data_const(dfield);
+    g_array_set_size(peaks, 0);
+    for (i = 1; i < yres-1; i++)
+    {
+        for (j = 1; j < xres-1; j++)
+        {
+            z = d[i*xres + j];
+            if (z <= threshold
+                || (ABS(i - yres/2) <= FIT_DC_EXCLUDE
+                    && ABS(j - xres/2) <= FIT_DC_EXCLUDE))
+                continue;
+            ismax = TRUE;
+            for (ii = -1; ii <= 1 && ismax; ii++)
+                for (jj = -1; jj <= 1; jj++)
+                    if ((ii || jj) && d[(i + ii)*xres + j + jj] >= z)
+                    {
+                        ismax = FALSE;
+                        break;
+                    }
+            if (!ismax)
+                continue;
+            l0 = log(z);
+            lm = log(MAX(d[i*xres + j-1], G_MINDOUBLE));
+            lp = log(MAX(d[i*xres + j+1], G_MINDOUBLE));
+            c1 = 0.5*(lp - lm);
+            c2 = 0.5*(lp + lm) - l0;
+            peak.x = j + ((c2 < 0.0) ? CLAMP(-0.5*c1/c2, -0.5, 0.5) : 0.0);
+            sx = (c2 < 0.0) ? sqrt(-0.5/c2) : 1.0;
+            lm = log(MAX(d[(i-1)*xres + j], G_MINDOUBLE));
+            lp = log(MAX(d[(i+1)*xres + j], G_MINDOUBLE));
+            c1 = 0.5*(lp - lm);
+            c2 = 0.5*(lp + lm) - l0;
+            peak.y = i + ((c2 < 0.0) ? CLAMP(-0.5*c1/c2, -0.5, 0.5) : 0.0);
+            sy = (c2 < 0.0) ? sqrt(-0.5/c2) : 1.0;
+            peak.x = peak.x*dx + xoff;
+            peak.y = peak.y*dy + yoff;
+            peak.z = z;
+            peak.w = sqrt(0.5*(sx*sx*dx*dx + sy*sy*dy*dy));
+            peak.h = peak.k = 0;
+            g_array_append_val(peaks, peak);
+        }
+    }
+    g_array_sort(peaks, spectrum_peak_compare);
+    if (peaks->len > FIT_MAX_PEAKS)
+        g_array_set_size(peaks, FIT_MAX_PEAKS);
+}
+
+/* Indexes the peaks in the given basis.  Returns the summed weight of the
+ * inliers, their weighted squared residual in *ssq, and optionally marks
+ * them with their h, k (outliers get h = k = 0). */
+static gdouble
+lattice_score(GArray *peaks, const LatticeBasis *basis, gboolean mark,
+              gdouble *ssq)
+{
+    SpectrumPeak *peak;
+    gdouble det, u, v, rx, ry, r2, tol2, score = 0.0, sum = 0.0;
+    gint h, k;
+    guint i;
+    det = basis->a[0]*basis->b[1] - basis->a[1]*basis->b[0];
+    tol2 = fit_tolerance*fit_tolerance
+           * MIN(basis->a[0]*basis->a[0] + basis->a[1]*basis->a[1],
+                 basis->b[0]*basis->b[0] + basis->b[1]*basis->b[1]);
+    for (i = 0; i < peaks->len; i++)
+    {
+        peak = &g_array_index(peaks, SpectrumPeak, i);
+        u = (peak->x*basis->b[1] - peak->y*basis->b[0])/det;
+        v = (basis->a[0]*peak->y - basis->a[1]*peak->x)/det;
+        h = GWY_ROUND(u);
+        k = GWY_ROUND(v);
+        rx = peak->x - h*basis->a[0] - k*basis->b[0];
+        ry = peak->y - h*basis->a[1] - k*basis->b[1];
+        r2 = rx*rx + ry*ry;
+        if ((h || k) && ABS(h) <= FIT_MAX_ORDER && ABS(k) <= FIT_MAX_ORDER
+            && r2 < tol2)
+        {
+            score += peak->z;
+            sum += peak->z*r2;
+        }
+        else
+            h = k = 0;
+        if (mark)
+        {
+            peak->h = h;
+            peak->k = k;
+        }
+    }
+    if (ssq)
+        *ssq = sum;
+    return score;
+}
+
+/* Weighted least squares for a*, b* with the Miller indices held fixed. */
+static gboolean
+lattice_refine_basis(GArray *peaks, LatticeBasis *basis)
+{
+    const SpectrumPeak *peak;
+    gdouble shh = 0.0, shk = 0.0, skk = 0.0, det;
+    gdouble hx = 0.0, hy = 0.0, kx = 0.0, ky = 0.0;
+    guint i;
+    for (i = 0; i < peaks->len; i++)
+    {
+        peak = &g_array_index(peaks, SpectrumPeak, i);
+        if (!peak->h && !peak->k)
+            continue;
+        shh += peak->z*peak->h*peak->h;
+        shk += peak->z*peak->h*peak->k;
+        skk += peak->z*peak->k*peak->k;
+        hx += peak->z*peak->h*peak->x;
+        hy += peak->z*peak->h*peak->y;
+        kx += peak->z*peak->k*peak->x;
+        ky += peak->z*peak->k*peak->y;
+    }
+    det = shh*skk - shk*shk;
+    if (det <= 1e-12*(shh*skk))
+        return FALSE;
+    basis->a[0] = (skk*hx - shk*kx)/det;
+    basis->a[1] = (skk*hy - shk*ky)/det;
+    basis->b[0] = (shh*kx - shk*hx)/det;
+    basis->b[1] = (shh*ky - shk*hy)/det;
+    return TRUE;
+}
+
+/* Minimal-sample consensus over every non-collinear pair of the strongest
+ * peaks taken as (a*, b*).  The candidates are independent and scored in
+ * parallel; the best one is refined by least squares over its inliers. */
+static gboolean
+lattice_fit_peaks(GArray *peaks, LatticeBasis *basis, gdouble *rms)
+{
+    LatticeBasis *cand;
+    gdouble *score;
+    gdouble sumw = 0.0, ssq = 0.0, la, lb, cross;
+    guint ncand, npeaks, n, i, j, best, iter;
+    const SpectrumPeak *pi, *pj;
+    npeaks = MIN(peaks->len, FIT_CANDIDATES);
+    if (npeaks < 2)
+        return FALSE;
+    cand = g_new(LatticeBasis, npeaks*npeaks);
+    ncand = 0;
+    for (i = 0; i < npeaks; i++)
+    {
+        pi = &g_array_index(peaks, SpectrumPeak, i);
+        for (j = i+1; j < npeaks; j++)
+        {
+            pj = &g_array_index(peaks, SpectrumPeak, j);
+            la = hypot(pi->x, pi->y);
+            lb = hypot(pj->x, pj->y);
+            cross = pi->x*pj->y - pi->y*pj->x;
+            if (fabs(cross) < 0.2*la*lb)
+                continue;
+            cand[ncand].a[0] = pi->x;
+            cand[ncand].a[1] = pi->y;
+            cand[ncand].b[0] = pj->x;
+            cand[ncand].b[1] = pj->y;
+            ncand++;
+        }
+    }
+    if (!ncand)
+    {
+        g_free(cand);
+        return FALSE;
+    }
+    score = g_new(gdouble, ncand);
+    n = ncand;
+#ifdef _OPENMP
+#pragma omp parallel for private(i) schedule(static)
+#endif
+    for (i = 0; i < n; i++)
+        score[i] = lattice_score(peaks, cand + i, FALSE, NULL);
+    best = 0;
+    for (i = 1; i < ncand; i++)
+        if (score[i] > score[best])
+            best = i;
+    *basis = cand[best];
+    g_free(score);
+    g_free(cand);
+    lattice_score(peaks, basis, TRUE, NULL);
+    for (iter = 0; iter < 2; iter++)
+    {
+        if (!lattice_refine_basis(peaks, basis))
+            return FALSE;
+        lattice_reduce_basis(basis);
+        sumw = lattice_score(peaks, basis, TRUE, &ssq);
+    }
+    *rms = (sumw > 0.0) ? sqrt(ssq/sumw) : 0.0;
+    return TRUE;
+}
+
+/* Lagrange-Gauss reduction to the shortest basis of the same lattice. */
+static void
+lattice_reduce_basis(LatticeBasis *basis)
+{
+    gdouble t, aa, bb, ab;
+    gint m, iter;
+    for (iter = 0; iter < 32; iter++)
+    {
+        aa = basis->a[0]*basis->a[0] + basis->a[1]*basis->a[1];
+        bb = basis->b[0]*basis->b[0] + basis->b[1]*basis->b[1];
+        if (bb < aa)
+        {
+            t = basis->a[0];
+            basis->a[0] = basis->b[0];
+            basis->b[0] = t;
+            t = basis->a[1];
+            basis->a[1] = basis->b[1];
+            basis->b[1] = t;
+            t = aa;
+            aa = bb;
+            bb = t;
+        }
+        ab = basis->a[0]*basis->b[0] + basis->a[1]*basis->b[1];
+        m = GWY_ROUND(ab/aa);
+        if (!m)
+            break;
+        basis->b[0] -= m*basis->a[0];
+        basis->b[1] -= m*basis->a[1];
+    }
+}
+
+/* Real-space basis A, B dual to a*, b*: A.a* = B.b* = 1, A.b* = B.a* = 0. */
+static void
+lattice_real_basis(const LatticeBasis *recip, LatticeBasis *real)
+{
+    gdouble det;
+    det = recip->a[0]*recip->b[1] - recip->a[1]*recip->b[0];
+    real->a[0] = recip->b[1]/det;
+    real->a[1] = -recip->b[0]/det;
+    real->b[0] = -recip->a[1]/det;
+    real->b[1] = recip->a[0]/det;
+}
+
+/* The shear in physical coordinates, where r = dx/dy of the image. */
+static void
+skew_physical_matrix(gdouble *T, gdouble hskew, gdouble vskew, gdouble r)
+{
+    T[0] = 1.0;
+    T[1] = tan(deg2rad(vskew))/r;
+    T[2] = tan(deg2rad(hskew))*r;
+    T[3] = 1.0;
+}
+
+static void
+apply_2matrix(const gdouble *T, gdouble *v)
+{
+    gdouble x = v[0], y = v[1];
+    v[0] = T[0]*x + T[2]*y;
+    v[1] = T[1]*x + T[3]*y;
+}
+
+/* Origin of the lattice with real basis A, B in the raw image, physical
+ * from the first pixel: where the image components at the reciprocal
+ * vectors a* and b* both peak, found from their phases.  The sums are
+ * separable, so each costs one pass over the data. */
+static void
+lattice_phase_origin(GwyDataField *image, const LatticeBasis *real,
+                     gdouble *origin)
+{
+    LatticeBasis recip;
+    const gdouble *data, *row;
+    const gdouble *g;
+    gdouble *cx, *sx, phase[2], re, im, rre, rim, c, s, dx, dy, avg;
+    gint xres, yres, i, j, v;
+    xres = gwy_data_field_get_xres(image);
+    yres = gwy_data_field_get_yres(image);
+    dx = gwy_data_field_get_xmeasure(image);
+    dy = gwy_data_field_get_ymeasure(image);
+    data = gwy_data_field_get_data_const(image);
+    avg = gwy_data_field_get_avg(image);
+    lattice_real_basis(real, &recip);
+    cx = g_new(gdouble, xres);
+    sx = g_new(gdouble, xres);
+    for (v = 0; v < 2; v++)
+    {
+        g = v ? recip.b : recip.a;
+        for (j = 0; j < xres; j++)
+        {
+            cx[j] = cos(2.0*PI*g[0]*j*dx);
+            sx[j] = sin(2.0*PI*g[0]*j*dx);
+        }
+        re = im = 0.0;
+        for (i = 0; i < yres; i++)
+        {
+            row = data + i*xres;
+            rre = rim = 0.0;
+            for (j = 0; j < xres; j++)
+            {
+                rre += (row[j] - avg)*cx[j];
+                rim -= (row[j] - avg)*sx[j];
+            }
+            c = cos(2.0*PI*g[1]*i*dy);
+            s = -sin(2.0*PI*g[1]*i*dy);
+            re += rre*c - rim*s;
+            im += rre*s + rim*c;
+        }
+        phase[v] = atan2(im, re);
+    }
+    g_free(cx);
+    g_free(sx);
+    origin[0] = -(phase[0]*real->a[0] + phase[1]*real->b[0])/(2.0*PI);
+    origin[1] = -(phase[0]*real->a[1] + phase[1]*real->b[1])/(2.0*PI);
+}
+
+/* Maps a real-space basis measured in an image sheared by (hskew, vskew)
+ * back to the raw image frame. */
+static void
+lattice_unskew_basis(LatticeBasis *basis, gdouble hskew, gdouble vskew,
+                     gdouble r)
+{
+    gdouble T[6], iT[6];
+    skew_physical_matrix(T, hskew, vskew, r);
+    T[4] = T[5] = 0.0;
+    invert_matrix(iT, T);
+    apply_2matrix(iT, basis->a);
+    apply_2matrix(iT, basis->b);
+}
+
+/* Lattice shape residuals of every basis followed by the misfit of every
+ * mosaic link, whose measured raw displacement the shear must carry onto
+ * the nominal one, relative to its length. */
+static void
+lattice_residuals(const LatticeBasis *bases, guint nbases,
+                  const MosaicLink *links, guint nlinks, gdouble cosg,
+                  gdouble r, gdouble p, gdouble q, gdouble *res)
+{
+    gdouble T[4], a[2], b[2], aa, bb, ab, len;
+    guint i;
+    T[0] = 1.0;
+    T[1] = q/r;
+    T[2] = p*r;
+    T[3] = 1.0;
+    for (i = 0; i < nbases; i++)
+    {
+        a[0] = bases[i].a[0];
+        a[1] = bases[i].a[1];
+        b[0] = bases[i].b[0];
+        b[1] = bases[i].b[1];
+        apply_2matrix(T, a);
+        apply_2matrix(T, b);
+        aa = a[0]*a[0] + a[1]*a[1];
+        bb = b[0]*b[0] + b[1]*b[1];
+        ab = a[0]*b[0] + a[1]*b[1];
+        res[2*i] = (aa - bb)/(aa + bb);
+        res[2*i + 1] = fabs(ab)/sqrt(aa*bb) - cosg;
+    }
+    res += 2*nbases;
+    for (i = 0; i < nlinks; i++)
+    {
+        a[0] = links[i].d[0];
+        a[1] = links[i].d[1];
+        apply_2matrix(T, a);
+        len = hypot(links[i].o[0], links[i].o[1]);
+        res[2*i] = (a[0] - links[i].o[0])/len;
+        res[2*i + 1] = (a[1] - links[i].o[1])/len;
+    }
+}
+
+static gdouble
+lattice_cost(const LatticeBasis *bases, guint nbases,
+             const MosaicLink *links, guint nlinks, gdouble cosg,
+             gdouble r, gdouble p, gdouble q, gdouble *res)
+{
+    gdouble cost = 0.0;
+    guint i;
+    lattice_residuals(bases, nbases, links, nlinks, cosg, r, p, q, res);
+    for (i = 0; i < 2*(nbases + nlinks); i++)
+        cost += res[i]*res[i];
+    return cost;
+}
+
+/* Levenberg-Marquardt for the shear (tangents p, q) that makes every
+ * raw-frame basis equilateral with the target angle.  A shear with p = -q
+ * is a rotation to first order, so the Jacobian is singular at zero skew
+ * and plain Gauss-Newton would stall there; mosaic links, if any, pin that
+ * direction down.  No image is resampled, so it costs microseconds.
+ * *hskew, *vskew hold the initial guess on input. */
+static gboolean
+lattice_solve_skew(const LatticeBasis *bases, guint nbases,
+                   const MosaicLink *links, guint nlinks, gdouble gamma,
+                   gdouble r, gdouble *hskew, gdouble *vskew)
+{
+    gdouble *res, *resp, *resq;
+    gdouble p, q, cosg, cost, newcost, lambda = 1e-6, h = 1e-7;
+    gdouble jpp, jpq, jqq, gp, gq, det, dp, dq;
+    gboolean ok = FALSE;
+    guint i, iter, n = 2*(nbases + nlinks);
+    g_return_val_if_fail(n > 0, FALSE);
+    res = g_new(gdouble, 3*n);
+    resp = res + n;
+    resq = res + 2*n;
+    cosg = fabs(cos(deg2rad(gamma)));
+    p = tan(deg2rad(*hskew));
+    q = tan(deg2rad(*vskew));
+    cost = lattice_cost(bases, nbases, links, nlinks, cosg, r, p, q,
+                        res);
+    for (iter = 0; iter < 200; iter++)
+    {
+        if (cost < 1e-28)
+        {
+            ok = TRUE;
+            break;
+        }
+        lattice_residuals(bases, nbases, links, nlinks, cosg, r, p + h, q,
+                          resp);
+        lattice_residuals(bases, nbases, links, nlinks, cosg, r, p, q + h,
+                          resq);
+        jpp = jpq = jqq = gp = gq = 0.0;
+        for (i = 0; i < n; i++)
+        {
+            resp[i] = (resp[i] - res[i])/h;
+            resq[i] = (resq[i] - res[i])/h;
+            jpp += resp[i]*resp[i];
+            jpq += resp[i]*resq[i];
+            jqq += resq[i]*resq[i];
+            gp += resp[i]*res[i];
+            gq += resq[i]*res[i];
+        }
+        det = (jpp + lambda)*(jqq + lambda) - jpq*jpq;
+        dp = ((jqq + lambda)*gp - jpq*gq)/det;
+        dq = ((jpp + lambda)*gq - jpq*gp)/det;
+        dp = CLAMP(dp, -0.2, 0.2);
+        dq = CLAMP(dq, -0.2, 0.2);
+        newcost = lattice_cost(bases, nbases, links, nlinks, cosg, r,
+                               p - dp, q - dq, resp);
+        if (newcost < cost)
+        {
+            p -= dp;
+            q -= dq;
+            cost = lattice_cost(bases, nbases, links, nlinks, cosg, r, p, q,
+                                res);
+            lambda = MAX(0.3*lambda, 1e-15);
+            if (fabs(dp) < 1e-12 && fabs(dq) < 1e-12)
+            {
+                ok = TRUE;
+                break;
+            }
+        }
+        else
+        {
+            lambda *= 10.0;
+            if (lambda > 1e6)
+            {
+                ok = TRUE;
+                break;
+            }
+        }
+    }
+    g_free(res);
+    if (!ok || fabs(p) > 1.0 || fabs(q) > 1.0)
+        return FALSE;
+    *hskew = atan(p)*180.0/PI;
+    *vskew = atan(q)*180.0/PI;
+    return TRUE;
+}
+
+static gdouble
+lattice_target_angle(LatticeType type)
+{
+    return (type == LATTICE_SQUARE) ? 90.0 : 60.0;
+}
+
+/* A standard normal deviate by the Box-Muller method. */
+static gdouble
+bootstrap_gauss(GRand *rng)
+{
+    gdouble u;
+    do
+        u = g_rand_double(rng);
+    while (u <= 0.0);
+    return sqrt(-2.0*log(u))*cos(2.0*PI*g_rand_double(rng));
+}
+
+/* Parametric bootstrap of the solved skew.  Each replicate moves every
+ * indexed peak by Gaussian noise as wide as the peak itself, refits a*, b*
+ * with the Miller indices kept and re-solves the skew starting from the
+ * point estimate; both steps are closed-form or nearly so and no spectrum
+ * is recomputed.  Replicates are seeded by their index, so the intervals do
+ * not depend on the number of threads. */
+static gboolean
+lattice_bootstrap(LatticeFit *fit, gdouble gamma, gdouble r)
+{
+    gdouble *hs, *vs;
+    gboolean *ok;
+    gint n, lo;
+    guint i;
+    hs = g_new(gdouble, 2*BOOTSTRAP_REPLICATES);
+    vs = hs + BOOTSTRAP_REPLICATES;
+    ok = g_new(gboolean, BOOTSTRAP_REPLICATES);
+#ifdef _OPENMP
+#pragma omp parallel private(i)
+#endif
+    {
+        GArray *peaks;
+        GRand *rng;
+        LatticeBasis basis, real;
+        SpectrumPeak *peak;
+        gint k;
+        peaks = g_array_sized_new(FALSE, FALSE, sizeof(SpectrumPeak),
+                                  fit->peaks->len);
+        rng = g_rand_new();
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (k = 0; k < BOOTSTRAP_REPLICATES; k++)
+        {
+            g_rand_set_seed(rng, k + 1);
+            g_array_set_size(peaks, 0);
+            g_array_append_vals(peaks, fit->peaks->data, fit->peaks->len);
+            for (i = 0; i < peaks->len; i++)
+            {
+                peak = &g_array_index(peaks, SpectrumPeak, i);
+                peak->x += peak->w*bootstrap_gauss(rng);
+                peak->y += peak->w*bootstrap_gauss(rng);
+            }
+            basis = fit->basis;
+            hs[k] = fit->hsolved;
+            vs[k] = fit->vsolved;
+            ok[k] = lattice_refine_basis(peaks, &basis);
+            if (!ok[k])
+                continue;
+            lattice_real_basis(&basis, &real);
+            lattice_unskew_basis(&real, fit->hskew, fit->vskew, r);
+            ok[k] = lattice_solve_skew(&real, 1, NULL, 0, gamma, r,
+                                       hs + k, vs + k);
+        }
+        g_rand_free(rng);
+        g_array_free(peaks, TRUE);
+    }
+    n = 0;
+    for (i = 0; i < BOOTSTRAP_REPLICATES; i++)
+    {
+        if (!ok[i])
+            continue;
+        hs[n] = hs[i];
+        vs[n] = vs[i];
+        n++;
+    }
+    g_free(ok);
+    fit->nconverged = n;
+    fit->ci_valid = (n >= bootstrap_min_converged*BOOTSTRAP_REPLICATES);
+    if (fit->ci_valid)
+    {
+        gwy_math_sort(n, hs);
+        gwy_math_sort(n, vs);
+        lo = (gint)floor(0.5*(1.0 - bootstrap_confidence)*n);
+        fit->hci[0] = hs[lo];
+        fit->hci[1] = hs[n-1 - lo];
+        fit->vci[0] = vs[lo];
+        fit->vci[1] = vs[n-1 - lo];
+    }
+    g_free(hs);
+    return fit->ci_valid;
+}
+
+static void
+lattice_fit_clear(LatticeFit *fit)
+{
+    if (fit->peaks)
+        g_array_free(fit->peaks, TRUE);
+    memset(fit, 0, sizeof(LatticeFit));
+}
+
+/* Fits the reciprocal lattice to all peaks of the corrected spectrum and
+ * feeds it straight to the skew solver. */
+static void
+lattice_fit_and_solve(ThresholdControls *controls)
+{
+    const SpectrumHistogram *hist;
+    LatticeFit *fit = &controls->fit;
+    LatticeBasis real;
+    GwyDataField *spectrum = controls->corr_fft;
+    gdouble threshold, r, gamma, hskew, vskew;
+    guint i, ninliers = 0;
+    gchar *s, *ci;
+    recompute_flush(controls);
+    if (controls->args->domains > 1)
+    {
+        lattice_fit_domains(controls);
+        return;
+    }
+    if (!fit->peaks)
+        fit->peaks = g_array_new(FALSE, FALSE, sizeof(SpectrumPeak));
+    hist = g_object_get_data(G_OBJECT(spectrum), histogram_key);
+    threshold = hist ? spectrum_histogram_quantile(hist, fit_peak_quantile)
+                     : 0.0;
+    spectrum_find_peaks(spectrum, threshold, fit->peaks);
+    fit->hskew = controls->args->Xskew;
+    fit->vskew = controls->args->Yskew;
+    fit->ci_valid = FALSE;
+    fit->valid = lattice_fit_peaks(fit->peaks, &fit->basis, &fit->rms);
+    fit->origin_valid = FALSE;
+    if (!fit->valid)
+    {
+        gtk_label_set_text(GTK_LABEL(controls->fit_label),
+                           _("Lattice fit failed: too few peaks."));
+        return;
+    }
+    for (i = 0; i < fit->peaks->len; i++)
+    {
+        const SpectrumPeak *peak = &g_array_index(fit->peaks, SpectrumPeak, i);
+        if (peak->h || peak->k)
+            ninliers++;
+    }
+    r = gwy_data_field_get_xmeasure(controls->image)
+        / gwy_data_field_get_ymeasure(controls->image);
+    lattice_real_basis(&fit->basis, &real);
+    lattice_unskew_basis(&real, fit->hskew, fit->vskew, r);
+    hskew = fit->hskew;
+    vskew = fit->vskew;
+    gamma = lattice_target_angle(controls->args->lattice_type);
+    if (!lattice_solve_skew(&real, 1, NULL, 0, gamma, r,
+                            &hskew, &vskew))
+    {
+        gtk_label_set_text(GTK_LABEL(controls->fit_label),
+                           _("Lattice fit: skew solution did not converge."));
+        return;
+    }
+    fit->hsolved = hskew;
+    fit->vsolved = vskew;
+    if (lattice_bootstrap(fit, gamma, r))
+        ci = g_strdup_printf(_("%g %% CI: X %.2f to %.2f°, "
+                               "Y %.2f to %.2f°"),
+                             100.0*bootstrap_confidence,
+                             fit->hci[0], fit->hci[1],
+                             fit->vci[0], fit->vci[1]);
+    else
+        ci = g_strdup_printf(_("%g %% CI: not bounded, %u of %u replicates "
+                               "did not converge"),
+                             100.0*bootstrap_confidence,
+                             BOOTSTRAP_REPLICATES - fit->nconverged,
+                             BOOTSTRAP_REPLICATES);
+    s = g_strdup_printf(_("Fit: %u of %u peaks, rms %.3g %%\n%s"),
+                        ninliers, fit->peaks->len,
+                        100.0*fit->rms/hypot(fit->basis.a[0], fit->basis.a[1]),
+                        ci);
+    gtk_label_set_text(GTK_LABEL(controls->fit_label), s);
+    g_free(ci);
+    g_free(s);
+    mosaic_forget(controls);
+    gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Xadjust, hskew);
+    gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Yadjust, vskew);
+}
+
+/* Local lattice orientation from the unshifted power spectrum of one tile:
+ * the power-squared weighted mean of exp(i order theta) over all non-DC
+ * frequencies, which is the same for every peak of a lattice with that
+ * rotational order.  The mean goes to z, its modulus is returned as the
+ * coherence. */
+static gdouble
+domain_orientation(const gdouble *power, gint tile, gdouble dx, gdouble dy,
+                   gint order, gdouble *z)
+{
+    gdouble sw = 0.0, w, theta;
+    gint i, j, ki, kj;
+    z[0] = z[1] = 0.0;
+    for (i = 0; i < tile; i++)
+    {
+        ki = (i < tile/2) ? i : i - tile;
+        for (j = 0; j < tile; j++)
+        {
+            kj = (j < tile/2) ? j : j - tile;
+            if (ABS(ki) <= FIT_DC_EXCLUDE && ABS(kj) <= FIT_DC_EXCLUDE)
+                continue;
+            w = power[i*tile + j]*power[i*tile + j];
+            theta = order*atan2(ki/dy, kj/dx);
+            z[0] += w*cos(theta);
+            z[1] += w*sin(theta);
+            sw += w;
+        }
+    }
+    if (sw <= 0.0)
+        return 0.0;
+    z[0] /= sw;
+    z[1] /= sw;
+    return hypot(z[0], z[1]);
+}
+
+/* Weighted k-means of the tile orientation vectors, seeded with the most
+ * coherent tile and then each time the tile farthest from every centre.
+ * Tiles below domain_min_coherence get label -1. */
+static void
+domain_kmeans(const gdouble *z, const gdouble *weight, gint ntiles, gint k,
+              gint *label, gdouble *centre)
+{
+    gdouble sum[3*DOMAIN_MAX];
+    gdouble d, dmin, best;
+    gint t, c, iter, ibest;
+    ibest = 0;
+    for (t = 1; t < ntiles; t++)
+        if (weight[t] > weight[ibest])
+            ibest = t;
+    centre[0] = z[2*ibest];
+    centre[1] = z[2*ibest + 1];
+    for (c = 1; c < k; c++)
+    {
+        best = -1.0;
+        for (t = 0; t < ntiles; t++)
+        {
+            if (weight[t] < domain_min_coherence)
+                continue;
+            dmin = G_MAXDOUBLE;
+            for (iter = 0; iter < c; iter++)
+            {
+                d = (z[2*t] - centre[2*iter])*(z[2*t] - centre[2*iter])
+                    + (z[2*t+1] - centre[2*iter+1])*(z[2*t+1]
+                                                     - centre[2*iter+1]);
+                dmin = MIN(dmin, d);
+            }
+            if (dmin*weight[t] > best)
+            {
+                best = dmin*weight[t];
+                ibest = t;
+            }
+        }
+        centre[2*c] = z[2*ibest];
+        centre[2*c + 1] = z[2*ibest + 1];
+    }
+    for (iter = 0; iter < DOMAIN_ITERATIONS; iter++)
+    {
+        memset(sum, 0, sizeof(sum));
+        for (t = 0; t < ntiles; t++)
+        {
+            label[t] = -1;
+            if (weight[t] < domain_min_coherence)
+                continue;
+            dmin = G_MAXDOUBLE;
+            for (c = 0; c < k; c++)
+            {
+                d = (z[2*t] - centre[2*c])*(z[2*t] - centre[2*c])
+                    + (z[2*t+1] - centre[2*c+1])*(z[2*t+1] - centre[2*c+1]);
+                if (d < dmin)
+                {
+                    dmin = d;
+                    label[t] = c;
+                }
+            }
+            c = label[t];
+            sum[3*c] += weight[t]*z[2*t];
+            sum[3*c + 1] += weight[t]*z[2*t + 1];
+            sum[3*c + 2] += weight[t];
+        }
+        for (c = 0; c < k; c++)
+        {
+            if (sum[3*c + 2] <= 0.0)
+                continue;
+            centre[2*c] = sum[3*c]/sum[3*c + 2];
+            centre[2*c + 1] = sum[3*c + 1]/sum[3*c + 2];
+        }
+    }
+}
+
+/* Segments the corrected image into rotational domains by the orientation
+ * of the lattice in half-overlapping tiles, fits the lattice in the averaged
+ * spectrum of each domain and solves one skew for all of them, since they
+ * were all scanned with the same drift.  The domain fits are computed in
+ * parallel, and so are the tile spectra when FFTW planning is thread-safe. */
+static void
+lattice_fit_domains(ThresholdControls *controls)
+{
+    const WindowCacheEntry *win;
+    LatticeFit *fit = &controls->fit;
+    LatticeBasis recip[DOMAIN_MAX], real[DOMAIN_MAX];
+    GArray *peaks[DOMAIN_MAX];
+    GwyDataField *source, *spectra[DOMAIN_MAX];
+    GString *str;
+    const gdouble *src;
+    gdouble *z, *weight, *power;
+    gdouble centre[2*DOMAIN_MAX], rms[DOMAIN_MAX];
+    gdouble dx, dy, r, gamma, hskew, vskew;
+    gboolean valid[DOMAIN_MAX];
+    gint count[DOMAIN_MAX];
+    gint *label;
+    gint k, order, xres, yres, tile, step, nx, ny, ntiles, n, c, t, nbases;
+    gint largest;
+    k = controls->args->domains;
+    order = (controls->args->lattice_type == LATTICE_SQUARE) ? 4 : 6;
+    source = skew_corrected_source(controls);
+    xres = gwy_data_field_get_xres(source);
+    yres = gwy_data_field_get_yres(source);
+    dx = gwy_data_field_get_xmeasure(source);
+    dy = gwy_data_field_get_ymeasure(source);
+    tile = DOMAIN_TILE_MAX;
+    while (tile > DOMAIN_TILE_MIN && MIN(xres, yres) < 4*tile)
+        tile /= 2;
+    step = tile/2;
+    nx = (xres >= tile) ? (xres - tile)/step + 1 : 0;
+    ny = (yres >= tile) ? (yres - tile)/step + 1 : 0;
+    ntiles = nx*ny;
+    if (ntiles < DOMAIN_MIN_TILES*k)
+    {
+        g_object_unref(source);
+        gtk_label_set_text(GTK_LABEL(controls->fit_label),
+                           _("Domain fit failed: image too small."));
+        return;
+    }
+    n = tile*tile;
+    win = window_cache_lookup(&controls->window_cache,
+                              controls->args->window_type,
+                              controls->args->kaiser_beta, tile, tile);
+    src = gwy_data_field_get_data_const(source);
+    z = g_new(gdouble, 3*ntiles);
+    weight = z + 2*ntiles;
+    label = g_new(gint, ntiles);
+    power = g_new0(gdouble, k*n);
+#ifdef _OPENMP
+#pragma omp parallel if(fft_parallel) private(t, c)
+#endif
+    {
+        GwyDataField *rin, *rout, *iout;
+        gdouble *acc, *p;
+        gint i;
+        rin = gwy_data_field_new(tile, tile, tile*dx, tile*dy, FALSE);
+        rout = gwy_data_field_new_alike(rin, FALSE);
+        iout = gwy_data_field_new_alike(rin, FALSE);
+        p = g_new(gdouble, n);
+        acc = g_new0(gdouble, k*n);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (t = 0; t < ntiles; t++)
+        {
+            memset(p, 0, n*sizeof(gdouble));
+            spectrum_tile_power(src, xres, (t % nx)*step, (t / nx)*step, win,
+                                rin, rout, iout, p);
+            weight[t] = domain_orientation(p, tile, dx, dy, order, z + 2*t);
+        }
+#ifdef _OPENMP
+#pragma omp single
+#endif
+        domain_kmeans(z, weight, ntiles, k, label, centre);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (t = 0; t < ntiles; t++)
+        {
+            if (label[t] < 0)
+                continue;
+            spectrum_tile_power(src, xres, (t % nx)*step, (t / nx)*step, win,
+                                rin, rout, iout, acc + label[t]*n);
+        }
+#ifdef _OPENMP
+#pragma omp critical(skew_domains)
+#endif
+        for (i = 0; i < k*n; i++)
+            power[i] += acc[i];
+        g_free(acc);
+        g_free(p);
+        g_object_unref(rin);
+        g_object_unref(rout);
+        g_object_unref(iout);
+    }
+    memset(count, 0, sizeof(count));
+    for (t = 0; t < ntiles; t++)
+        if (label[t] >= 0)
+            count[label[t]]++;
+#ifdef _OPENMP
+#pragma omp parallel for private(c) schedule(dynamic)
+#endif
+    for (c = 0; c < k; c++)
+    {
+        const SpectrumHistogram *hist;
+        SkewStats stats;
+        gdouble *d, threshold;
+        gint i;
+        spectra[c] = gwy_data_field_new(tile, tile, tile*dx, tile*dy, FALSE);
+        peaks[c] = g_array_new(FALSE, FALSE, sizeof(SpectrumPeak));
+        valid[c] = FALSE;
+        if (!count[c])
+            continue;
+        d = gwy_data_field_get_data(spectra[c]);
+        skew_stats_init(&stats);
+        for (i = 0; i < n; i++)
+        {
+            d[i] = sqrt(power[c*n + i]/count[c]);
+            skew_stats_add(&stats, d[i]);
+        }
+        gwy_data_field_invalidate(spectra[c]);
+        skew_stats_attach(spectra[c], &stats);
+        fft_postprocess(spectra[c]);
+        hist = g_object_get_data(G_OBJECT(spectra[c]), histogram_key);
+        threshold = spectrum_histogram_quantile(hist, fit_peak_quantile);
+        spectrum_find_peaks(spectra[c], threshold, peaks[c]);
+        valid[c] = lattice_fit_peaks(peaks[c], recip + c, rms + c);
+    }
+    g_object_unref(source);
+    g_free(power);
+    g_free(label);
+    g_free(z);
+    r = dx/dy;
+    gamma = lattice_target_angle(controls->args->lattice_type);
+    fit->hskew = controls->args->Xskew;
+    fit->vskew = controls->args->Yskew;
+    fit->valid = fit->ci_valid = FALSE;
+    nbases = 0;
+    largest = -1;
+    str = g_string_new(_("Domains:"));
+    for (c = 0; c < k; c++)
+    {
+        if (!valid[c])
+            g_string_append_printf(str, _(" %d tiles unfitted;"), count[c]);
+        else
+        {
+            g_string_append_printf(str, _(" %d tiles at %.1f°;"), count[c],
+                                   atan2(centre[2*c + 1], centre[2*c])
+                                   *180.0/(PI*order));
+            lattice_real_basis(recip + c, real + nbases);
+            lattice_unskew_basis(real + nbases, fit->hskew, fit->vskew, r);
+            nbases++;
+            if (largest < 0 || count[c] > count[largest])
+                largest = c;
+        }
+    }
+    hskew = fit->hskew;
+    vskew = fit->vskew;
+    if (!nbases || !lattice_solve_skew(real, nbases, NULL, 0, gamma, r,
+                                       &hskew, &vskew))
+        g_string_append(str, _("\nno joint skew solution."));
+    else
+    {
+        /* The largest domain stands for the lattice in refinement. */
+        if (fit->peaks)
+            g_array_free(fit->peaks, TRUE);
+        fit->peaks = peaks[largest];
+        peaks[largest] = NULL;
+        fit->basis = recip[largest];
+        fit->rms = rms[largest];
+        fit->valid = TRUE;
+        fit->origin_valid = FALSE;
+        fit->hsolved = hskew;
+        fit->vsolved = vskew;
+        g_string_append_printf(str, _("\njoint skew from %d domains."),
+                               nbases);
+    }
+    for (c = 0; c < k; c++)
+    {
+        if (peaks[c])
+            g_array_free(peaks[c], TRUE);
+        g_object_unref(spectra[c]);
+    }
+    gtk_label_set_text(GTK_LABEL(controls->fit_label), str->str);
+    g_string_free(str, TRUE);
+    if (!fit->valid)
+        return;
+    mosaic_forget(controls);
+    gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Xadjust, hskew);
+    gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Yadjust, vskew);
+}
+
+/* Gives the basis equal lengths and the target angle, turning both vectors
+ * by the same amount and keeping the handedness of the pair. */
+static void
+lattice_idealize(const LatticeBasis *basis, gdouble gamma, LatticeBasis *ideal)
+{
+    gdouble len, phia, phib, phi;
+    len = 0.5*(hypot(basis->a[0], basis->a[1])
+               + hypot(basis->b[0], basis->b[1]));
+    if (basis->a[0]*basis->b[1] - basis->a[1]*basis->b[0] < 0.0)
+        gamma = -gamma;
+    phia = atan2(basis->a[1], basis->a[0]);
+    phib = atan2(basis->b[1], basis->b[0]) - gamma;
+    phi = atan2(sin(phia) + sin(phib), cos(phia) + cos(phib));
+    ideal->a[0] = len*cos(phi);
+    ideal->a[1] = len*sin(phi);
+    ideal->b[0] = len*cos(phi + gamma);
+    ideal->b[1] = len*sin(phi + gamma);
+}
+
+/* Fills the top left m x m corner of the n x n field t with a zero-mean sum
+ * of cosines over the reciprocal basis vectors and, for hexagonal lattices,
+ * the shorter of their sum and difference, and returns its norm. */
+static gdouble
+refine_template_fill(const LatticeBasis *basis, gboolean hexagonal, gint m,
+                     GwyDataField *t)
+{
+    LatticeBasis recip;
+    gdouble g[3][2], *d;
+    gdouble dx, dy, v, sum, sum2;
+    gint n, i, j, k, ng;
+    n = gwy_data_field_get_xres(t);
+    dx = gwy_data_field_get_xmeasure(t);
+    dy = gwy_data_field_get_ymeasure(t);
+    lattice_real_basis(basis, &recip);
+    g[0][0] = recip.a[0];
+    g[0][1] = recip.a[1];
+    g[1][0] = recip.b[0];
+    g[1][1] = recip.b[1];
+    if (hypot(recip.a[0] + recip.b[0], recip.a[1] + recip.b[1])
+        < hypot(recip.a[0] - recip.b[0], recip.a[1] - recip.b[1]))
+    {
+        g[2][0] = recip.a[0] + recip.b[0];
+        g[2][1] = recip.a[1] + recip.b[1];
+    }
+    else
+    {
+        g[2][0] = recip.a[0] - recip.b[0];
+        g[2][1] = recip.a[1] - recip.b[1];
+    }
+    ng = hexagonal ? 3 : 2;
+    d = gwy_data_field_get_data(t);
+    memset(d, 0, n*n*sizeof(gdouble));
+    sum = 0.0;
+    for (i = 0; i < m; i++)
+    {
+        for (j = 0; j < m; j++)
+        {
+            v = 0.0;
+            for (k = 0; k < ng; k++)
+                v += cos(2.0*PI*(g[k][0]*(j + 0.5)*dx + g[k][1]*(i + 0.5)*dy));
+            d[i*n + j] = v;
+            sum += v;
+        }
+    }
+    sum /= m*m;
+    sum2 = 0.0;
+    for (i = 0; i < m; i++)
+    {
+        for (j = 0; j < m; j++)
+        {
+            d[i*n + j] -= sum;
+            sum2 += d[i*n + j]*d[i*n + j];
+        }
+    }
+    gwy_data_field_invalidate(t);
+    return sqrt(sum2);
+}
+
+/* Takes the n x n crop of the raw image around the centre, its transform
+ * and the norm of the zero-mean image under the m x m template at every
+ * shift, all of which are the same for every candidate. */
+static void
+refine_search_init(RefineSearch *search, GwyDataField *image,
+                   const gdouble *centre, gint n)
+{
+    const gdouble *f;
+    gdouble *S, *S2, *norm;
+    gdouble v, box, box2, var;
+    gint xres, yres, col, row, m, n1, i, j;
+    xres = gwy_data_field_get_xres(image);
+    yres = gwy_data_field_get_yres(image);
+    col = CLAMP(GWY_ROUND(centre[0]) - n/2, 0, xres - n);
+    row = CLAMP(GWY_ROUND(centre[1]) - n/2, 0, yres - n);
+    m = n/2;
+    n1 = n + 1;
+    search->n = n;
+    search->crop = gwy_data_field_area_extract(image, col, row, n, n);
+    search->re = gwy_data_field_new_alike(search->crop, FALSE);
+    search->im = gwy_data_field_new_alike(search->crop, FALSE);
+    gwy_data_field_2dfft_raw(search->crop, NULL, search->re, search->im,
+                             GWY_TRANSFORM_DIRECTION_FORWARD);
+    f = gwy_data_field_get_data_const(search->crop);
+    S = g_new0(gdouble, n1*n1);
+    S2 = g_new0(gdouble, n1*n1);
+    for (i = 0; i < n; i++)
+    {
+        for (j = 0; j < n; j++)
+        {
+            v = f[i*n + j];
+            S[(i + 1)*n1 + j + 1] = v + S[i*n1 + j + 1]
+                                    + S[(i + 1)*n1 + j] - S[i*n1 + j];
+            S2[(i + 1)*n1 + j + 1] = v*v + S2[i*n1 + j + 1]
+                                     + S2[(i + 1)*n1 + j] - S2[i*n1 + j];
+        }
+    }
+    norm = search->norm = g_new(gdouble, (n - m + 1)*(n - m + 1));
+    for (i = 0; i <= n - m; i++)
+    {
+        for (j = 0; j <= n - m; j++)
+        {
+            box = S[(i + m)*n1 + j + m] - S[i*n1 + j + m]
+                  - S[(i + m)*n1 + j] + S[i*n1 + j];
+            box2 = S2[(i + m)*n1 + j + m] - S2[i*n1 + j + m]
+                   - S2[(i + m)*n1 + j] + S2[i*n1 + j];
+            var = box2 - box*box/(m*m);
+            norm[i*(n - m + 1) + j] = (var > 0.0) ? sqrt(var) : 0.0;
+        }
+    }
+    g_free(S);
+    g_free(S2);
+}
+
+static void
+refine_search_free(RefineSearch *search)
+{
+    g_object_unref(search->crop);
+    g_object_unref(search->re);
+    g_object_unref(search->im);
+    g_free(search->norm);
+}
+
+static void
+refine_buffers_init(RefineBuffers *buf, GwyDataField *crop)
+{
+    gint n = gwy_data_field_get_xres(crop);
+    buf->tmpl = gwy_data_field_new_alike(crop, FALSE);
+    buf->tre = gwy_data_field_new_alike(crop, FALSE);
+    buf->tim = gwy_data_field_new_alike(crop, FALSE);
+    buf->ore = gwy_data_field_new_alike(crop, FALSE);
+    buf->oim = gwy_data_field_new_alike(crop, FALSE);
+    buf->ncc = g_new(gdouble, (n/2 + 1)*(n/2 + 1));
+}
+
+static void
+refine_buffers_free(RefineBuffers *buf)
+{
+    g_object_unref(buf->tmpl);
+    g_object_unref(buf->tre);
+    g_object_unref(buf->tim);
+    g_object_unref(buf->ore);
+    g_object_unref(buf->oim);
+    g_free(buf->ncc);
+}
+
+/* Best normalized cross-correlation of the image corrected by
+ * (hskew, vskew) with the ideal lattice the fitted one becomes under that
+ * correction.  The template is analytic, so instead of resampling the image
+ * for every candidate, which would favour shears whose interpolation
+ * smooths the noise most, the ideal lattice is mapped back to the raw frame
+ * and correlated with the fixed crop. */
+static gdouble
+refine_ncc(const RefineSearch *search, gdouble hskew, gdouble vskew,
+           RefineBuffers *buf)
+{
+    LatticeBasis basis, ideal;
+    const gdouble *fr, *fi, *c, *norm;
+    gdouble *tr, *ti, *ncc;
+    gdouble T[4], iT[4];
+    gdouble tnorm, scale, best, re;
+    gint n = search->n, m = search->n/2, ns = search->n/2 + 1;
+    gint i, j, k, bi, bj;
+    basis = search->raw;
+    skew_physical_matrix(T, hskew, vskew, search->r);
+    apply_2matrix(T, basis.a);
+    apply_2matrix(T, basis.b);
+    lattice_idealize(&basis, search->gamma, &ideal);
+    re = T[0]*T[3] - T[1]*T[2];
+    iT[0] = T[3]/re;
+    iT[1] = -T[1]/re;
+    iT[2] = -T[2]/re;
+    iT[3] = T[0]/re;
+    apply_2matrix(iT, ideal.a);
+    apply_2matrix(iT, ideal.b);
+    tnorm = refine_template_fill(&ideal, search->hexagonal, m, buf->tmpl);
+    skew_fft_raw(buf->tmpl, NULL, buf->tre, buf->tim,
+                 GWY_TRANSFORM_DIRECTION_FORWARD);
+    fr = gwy_data_field_get_data_const(search->re);
+    fi = gwy_data_field_get_data_const(search->im);
+    tr = gwy_data_field_get_data(buf->tre);
+    ti = gwy_data_field_get_data(buf->tim);
+    for (k = 0; k < n*n; k++)
+    {
+        re = fr[k]*tr[k] + fi[k]*ti[k];
+        ti[k] = fi[k]*tr[k] - fr[k]*ti[k];
+        tr[k] = re;
+    }
+    gwy_data_field_invalidate(buf->tre);
+    gwy_data_field_invalidate(buf->tim);
+    skew_fft_raw(buf->tre, buf->tim, buf->ore, buf->oim,
+                 GWY_TRANSFORM_DIRECTION_BACKWARD);
+    /* The transforms are unitary with the forward one using the negative
+     * exponent, so this is the circular correlation sum over the template
+     * divided by n. */
+    c = gwy_data_field_get_data_const(buf->ore);
+    norm = search->norm;
+    ncc = buf->ncc;
+    scale = n/tnorm;
+    bi = bj = 0;
+    for (i = 0; i < ns; i++)
+    {
+        for (j = 0; j < ns; j++)
+        {
+            k = i*ns + j;
+            ncc[k] = (norm[k] > 0.0) ? scale*c[i*n + j]/norm[k] : -1.0;
+            if (ncc[k] > ncc[bi*ns + bj])
+            {
+                bi = i;
+                bj = j;
+            }
+        }
+    }
+    /* The integer shift alone makes the score jump as candidates move the
+     * lattice across the pixel grid, so take the parabolic peak value. */
+    best = ncc[bi*ns + bj];
+    if (bi > 0 && bi < ns-1)
+        best += refine_parabola_excess(ncc[(bi - 1)*ns + bj], ncc[bi*ns + bj],
+                                       ncc[(bi + 1)*ns + bj]);
+    if (bj > 0 && bj < ns-1)
+        best += refine_parabola_excess(ncc[bi*ns + bj - 1], ncc[bi*ns + bj],
+                                       ncc[bi*ns + bj + 1]);
+    return best;
+}
+
+/* Height of the vertex of the parabola through (-1, sm), (0, s0), (1, sp)
+ * above s0, or zero when it does not open downwards. */
+static gdouble
+refine_parabola_excess(gdouble sm, gdouble s0, gdouble sp)
+{
+    gdouble den = sm - 2.0*s0 + sp;
+    if (den >= 0.0)
+        return 0.0;
+    return -(sp - sm)*(sp - sm)/(8.0*den);
+}
+
+/* Scores the n candidates, in parallel when FFTW planning is thread-safe as
+ * each score is mostly its two correlation transforms. */
+static void
+refine_scores(const RefineSearch *search, const gdouble *hskew,
+              const gdouble *vskew, gint n, gdouble *scores)
+{
+#ifdef _OPENMP
+#pragma omp parallel if(fft_parallel && n > 1)
+#endif
+    {
+        RefineBuffers buf;
+        gint i;
+        refine_buffers_init(&buf, search->crop);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (i = 0; i < n; i++)
+            scores[i] = refine_ncc(search, hskew[i], vskew[i], &buf);
+        refine_buffers_free(&buf);
+    }
+}
+
+/* Searches shrinking grids around the current skew for the best match of
+ * the corrected image with the ideal lattice, finishing with a parabolic
+ * interpolation.  Changing both skews in opposite directions only rotates
+ * the corrected image to first order, which no lattice-shape criterion can
+ * see, so the search moves along the equal-skew diagonal and leaves the
+ * rotation-like part at the spectrum estimate. */
+static void
+lattice_refine_realspace(ThresholdControls *controls)
+{
+    enum { NG = 2*REFINE_HALF_GRID + 1 };
+    RefineSearch search;
+    LatticeFit *fit = &controls->fit;
+    gdouble hs[NG], vs[NG], scores[NG];
+    gdouble centre[2], t0, step, best, sm, sp, den, dt;
+    gint xres, yres, n, level, a, ba;
+    gchar *s;
+    recompute_flush(controls);
+    if (!fit->valid)
+    {
+        gtk_label_set_text(GTK_LABEL(controls->fit_label),
+                           _("Refinement needs a lattice fit first."));
+        return;
+    }
+    xres = gwy_data_field_get_xres(controls->image);
+    yres = gwy_data_field_get_yres(controls->image);
+    n = REFINE_CROP_MAX;
+    while (n > REFINE_CROP_MIN && n > MIN(xres, yres))
+        n /= 2;
+    if (n > MIN(xres, yres))
+    {
+        gtk_label_set_text(GTK_LABEL(controls->fit_label),
+                           _("Image too small for refinement."));
+        return;
+    }
+    if (controls->roi[2] > controls->roi[0]
+        && controls->roi[3] > controls->roi[1])
+    {
+        centre[0] = 0.5*(controls->roi[0] + controls->roi[2]);
+        centre[1] = 0.5*(controls->roi[1] + controls->roi[3]);
+    }
+    else
+    {
+        centre[0] = 0.5*xres;
+        centre[1] = 0.5*yres;
+    }
+    refine_search_init(&search, controls->image, centre, n);
+    search.r = gwy_data_field_get_xmeasure(controls->image)
+               / gwy_data_field_get_ymeasure(controls->image);
+    search.gamma = deg2rad(lattice_target_angle(controls->args->lattice_type));
+    search.hexagonal = (controls->args->lattice_type == LATTICE_HEXAGONAL);
+    lattice_real_basis(&fit->basis, &search.raw);
+    lattice_unskew_basis(&search.raw, fit->hskew, fit->vskew, search.r);
+    t0 = 0.0;
+    step = refine_step;
+    best = -1.0;
+    ba = REFINE_HALF_GRID;
+    for (level = 0; level < REFINE_LEVELS; level++)
+    {
+        if (level)
+            step *= refine_shrink;
+        for (a = 0; a < NG; a++)
+        {
+            hs[a] = controls->args->Xskew + t0 + (a - REFINE_HALF_GRID)*step;
+            vs[a] = controls->args->Yskew + t0 + (a - REFINE_HALF_GRID)*step;
+        }
+        refine_scores(&search, hs, vs, NG, scores);
+        ba = REFINE_HALF_GRID;
+        for (a = 0; a < NG; a++)
+        {
+            if (scores[a] > scores[ba])
+                ba = a;
+        }
+        best = scores[ba];
+        t0 += (ba - REFINE_HALF_GRID)*step;
+    }
+    dt = 0.0;
+    if (ba > 0 && ba < NG-1)
+    {
+        sm = scores[ba - 1];
+        sp = scores[ba + 1];
+        den = sm - 2.0*best + sp;
+        if (den < 0.0)
+            dt = CLAMP(0.5*(sm - sp)/den, -0.5, 0.5);
+    }
+    refine_search_free(&search);
+    s = g_strdup_printf(_("Refined: NCC %.3f, step %.2g deg"), best, step);
+    gtk_label_set_text(GTK_LABEL(controls->fit_label), s);
+    g_free(s);
+    t0 += dt*step;
+    mosaic_forget(controls);
+    gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Xadjust,
+                             controls->args->Xskew + t0);
+    gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Yadjust,
+                             controls->args->Yskew + t0);
+}
+
+/* Returns the lower-case title of the channel scanned in the opposite
+ * fast-scan direction, or NULL when the title names no direction. */
+static gchar*
+drift_partner_title(const gchar *title, gboolean *is_retrace)
+{
+    const gchar *word;
+    gchar *lower, *pos, *partner = NULL;
+    guint i;
+    gint k;
+    lower = g_utf8_strdown(title, -1);
+    for (i = 0; i < G_N_ELEMENTS(scan_direction_words) && !partner; i++)
+    {
+        for (k = 1; k >= 0 && !partner; k--)
+        {
+            word = scan_direction_words[i][k];
+            if (!(pos = strstr(lower, word)))
+                continue;
+            *pos = '\0';
+            partner = g_strconcat(lower, scan_direction_words[i][1-k],
+                                  pos + strlen(word), NULL);
+            *is_retrace = (k == 1);
+        }
+    }
+    g_free(lower);
+    return partner;
+}
+
+/* Finds the channel of the same resolution forming a trace/retrace pair
+ * with channel id. */
+static gint
+drift_find_partner(GwyContainer *data, gint id, gboolean *is_retrace)
+{
+    GwyDataField *dfield, *other;
+    gchar *title, *partner, *lower;
+    gint *ids;
+    gint i, found = -1;
+    title = gwy_app_get_data_field_title(data, id);
+    partner = drift_partner_title(title, is_retrace);
+    g_free(title);
+    if (!partner)
+        return -1;
+    dfield = GWY_DATA_FIELD(gwy_container_get_object(data,
+                                    gwy_app_get_data_key_for_id(id)));
+    ids = gwy_app_data_browser_get_data_ids(data);
+    for (i = 0; ids[i] != -1 && found < 0; i++)
+    {
+        if (ids[i] == id)
+            continue;
+        other = GWY_DATA_FIELD(gwy_container_get_object(data,
+                                     gwy_app_get_data_key_for_id(ids[i])));
+        if (gwy_data_field_get_xres(other) != gwy_data_field_get_xres(dfield)
+            || gwy_data_field_get_yres(other)
+               != gwy_data_field_get_yres(dfield))
+            continue;
+        title = gwy_app_get_data_field_title(data, ids[i]);
+        lower = g_utf8_strdown(title, -1);
+        if (gwy_strequal(lower, partner))
+            found = ids[i];
+        g_free(lower);
+        g_free(title);
+    }
+    g_free(ids);
+    g_free(partner);
+    return found;
+}
+
+/* Refines the integer shift (dx, dy) found by phase correlation from the
+ * slope of the cross-power phase, which unlike interpolating the peak does
+ * not pull fractions of a pixel towards zero.  Only frequencies below half
+ * Nyquist are used, weighted by the cross-power modulus. */
+static void
+drift_phase_slope(const gdouble *re, const gdouble *im, gint xres, gint yres,
+                  gint dx, gint dy, gdouble *sx, gdouble *sy)
+{
+    gdouble kx, ky, c, s, cr, ci, w, phi;
+    gdouble sxx, sxy, syy, sxp, syp, det;
+    gint i, j, ii, jj;
+    sxx = sxy = syy = sxp = syp = 0.0;
+    for (i = 0; i < yres; i++)
+    {
+        ii = (i > yres/2) ? i - yres : i;
+        ky = 2.0*PI*ii/yres;
+        if (fabs(ky) > 0.5*PI)
+            continue;
+        for (j = 0; j < xres; j++)
+        {
+            jj = (j > xres/2) ? j - xres : j;
+            kx = 2.0*PI*jj/xres;
+            if (fabs(kx) > 0.5*PI || (!ii && !jj))
+                continue;
+            c = cos(kx*dx + ky*dy);
+            s = sin(kx*dx + ky*dy);
+            cr = re[i*xres + j]*c - im[i*xres + j]*s;
+            ci = re[i*xres + j]*s + im[i*xres + j]*c;
+            w = hypot(cr, ci);
+            phi = atan2(ci, cr);
+            sxx += w*kx*kx;
+            sxy += w*kx*ky;
+            syy += w*ky*ky;
+            sxp += w*kx*phi;
+            syp += w*ky*phi;
+        }
+    }
+    *sx = dx;
+    *sy = dy;
+    det = sxx*syy - sxy*sxy;
+    if (!(det > 0.0))
+        return;
+    *sx -= (syy*sxp - sxy*syp)/det;
+    *sy -= (sxx*syp - sxy*sxp)/det;
+}
+
+/* Removes the mean of a strip and multiplies it by a Hann window moved by
+ * (sx, sy) pixels, so that windows moved by opposite halves of the shift
+ * follow the content of the two strips. */
+static void
+drift_window(GwyDataField *source, GwyDataField *dest, gdouble sx, gdouble sy)
+{
+    const gdouble *src;
+    gdouble *dst, *wx;
+    gdouble avg, u, wy;
+    gint xres, yres, i, j;
+    xres = gwy_data_field_get_xres(source);
+    yres = gwy_data_field_get_yres(source);
+    avg = gwy_data_field_get_avg(source);
+    src = gwy_data_field_get_data_const(source);
+    dst = gwy_data_field_get_data(dest);
+    wx = g_newa(gdouble, xres);
+    for (j = 0; j < xres; j++)
+    {
+        u = (j + 0.5 - sx)/xres;
+        wx[j] = (u > 0.0 && u < 1.0) ? 0.5 - 0.5*cos(2.0*PI*u) : 0.0;
+    }
+    for (i = 0; i < yres; i++)
+    {
+        u = (i + 0.5 - sy)/yres;
+        wy = (u > 0.0 && u < 1.0) ? 0.5 - 0.5*cos(2.0*PI*u) : 0.0;
+        for (j = 0; j < xres; j++)
+            dst[i*xres + j] = (src[i*xres + j] - avg)*(wy*wx[j]);
+    }
+    gwy_data_field_invalidate(dest);
+}
+
+/* Estimates the skew of the trace image from the shift of the retrace one
+ * against it, measured by phase correlation in overlapping vertical strips.
+ * A pixel in column j is scanned on the retrace about (2*xres - 2*j)*T_px
+ * after the trace, so a drift v makes the shift change by -2*v*T_px per
+ * column, while the trace itself is sheared by v*T_line = 2*xres*v*T_px per
+ * row horizontally and by v*T_px per column vertically.  The line
+ * turn-around time is neglected and the retrace is assumed stored in the
+ * same orientation as the trace, as instruments normally do.
+ *
+ * The shifts are hundredths of a pixel.  A window fixed in both strips
+ * mixes its own zero shift into the measured one, so the measurement is
+ * repeated with the windows moved by the previous estimate, which converges
+ * to the shift of the content.  The strips are measured in parallel when
+ * FFTW planning is thread-safe, as their cost is mostly transforms.
+ * Fails when the image is too small for enough strips, or when the strips
+ * carry no usable correlation at two column positions at least. */
+static DriftStatus
+drift_estimate(GwyDataField *trace, GwyDataField *retrace,
+               gdouble *hskew, gdouble *vskew)
+{
+    gdouble *cx, *sx, *sy, *wt;
+    gdouble sw, swc, swcc, swx, swcx, swy, swcy, den, slopex, slopey;
+    gint xres, yres, width, step, nstrips, k;
+    xres = gwy_data_field_get_xres(trace);
+    yres = gwy_data_field_get_yres(trace);
+    width = DRIFT_STRIP_MAX;
+    while (width > DRIFT_STRIP_MIN && width*DRIFT_MIN_STRIPS > xres)
+        width /= 2;
+    step = width/2;
+    nstrips = (xres - width)/step + 1;
+    if (nstrips < DRIFT_MIN_STRIPS || yres < DRIFT_STRIP_MIN)
+        return DRIFT_TOO_SMALL;
+    cx = g_new(gdouble, nstrips);
+    sx = g_new(gdouble, nstrips);
+    sy = g_new(gdouble, nstrips);
+    wt = g_new(gdouble, nstrips);
+#ifdef _OPENMP
+#pragma omp parallel if(fft_parallel)
+#endif
+    {
+        GwyDataField *a, *b, *sa, *sb, *are, *aim, *bre, *bim, *ore, *oim;
+        gdouble *ar, *ai, *br, *bi;
+        const gdouble *c;
+        gdouble re, im, mod;
+        gint i, iter, pi = 0, pj = 0, col, n;
+        n = width*yres;
+        a = gwy_data_field_new(width, yres, width, yres, FALSE);
+        b = gwy_data_field_new_alike(a, FALSE);
+        sa = gwy_data_field_new_alike(a, FALSE);
+        sb = gwy_data_field_new_alike(a, FALSE);
+        are = gwy_data_field_new_alike(a, FALSE);
+        aim = gwy_data_field_new_alike(a, FALSE);
+        bre = gwy_data_field_new_alike(a, FALSE);
+        bim = gwy_data_field_new_alike(a, FALSE);
+        ore = gwy_data_field_new_alike(a, FALSE);
+        oim = gwy_data_field_new_alike(a, FALSE);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (k = 0; k < nstrips; k++)
+        {
+            col = k*step;
+            gwy_data_field_area_copy(trace, sa, col, 0, width, yres, 0, 0);
+            gwy_data_field_area_copy(retrace, sb, col, 0, width, yres, 0, 0);
+            sx[k] = sy[k] = 0.0;
+            wt[k] = 0.0;
+            for (iter = 0; iter < DRIFT_ITERATIONS; iter++)
+            {
+                drift_window(sa, a, -0.5*sx[k], -0.5*sy[k]);
+                drift_window(sb, b, 0.5*sx[k], 0.5*sy[k]);
+                skew_fft_raw(a, NULL, are, aim,
+                             GWY_TRANSFORM_DIRECTION_FORWARD);
+                skew_fft_raw(b, NULL, bre, bim,
+                             GWY_TRANSFORM_DIRECTION_FORWARD);
+                ar = gwy_data_field_get_data(are);
+                ai = gwy_data_field_get_data(aim);
+                br = gwy_data_field_get_data(bre);
+                bi = gwy_data_field_get_data(bim);
+                for (i = 0; i < n; i++)
+                {
+                    re = br[i]*ar[i] + bi[i]*ai[i];
+                    im = bi[i]*ar[i] - br[i]*ai[i];
+                    mod = hypot(re, im);
+                    ar[i] = re;
+                    ai[i] = im;
+                    br[i] = (mod > 0.0) ? re/mod : 0.0;
+                    bi[i] = (mod > 0.0) ? im/mod : 0.0;
+                }
+                if (!iter)
+                {
+                    pi = pj = 0;
+                    gwy_data_field_invalidate(bre);
+                    gwy_data_field_invalidate(bim);
+                    skew_fft_raw(bre, bim, ore, oim,
+                                 GWY_TRANSFORM_DIRECTION_BACKWARD);
+                    c = gwy_data_field_get_data_const(ore);
+                    for (i = 1; i < n; i++)
+                    {
+                        if (c[i] > c[pi*width + pj])
+                        {
+                            pi = i/width;
+                            pj = i % width;
+                        }
+                    }
+                    wt[k] = MAX(c[pi*width + pj], 0.0);
+                    if (pj > width/2)
+                        pj -= width;
+                    if (pi > yres/2)
+                        pi -= yres;
+                }
+                drift_phase_slope(ar, ai, width, yres, pj, pi, sx + k, sy + k);
+            }
+            cx[k] = col + 0.5*width;
+        }
+        g_object_unref(a);
+        g_object_unref(b);
+        g_object_unref(sa);
+        g_object_unref(sb);
+        g_object_unref(are);
+        g_object_unref(aim);
+        g_object_unref(bre);
+        g_object_unref(bim);
+        g_object_unref(ore);
+        g_object_unref(oim);
+    }
+    sw = swc = swcc = swx = swcx = swy = swcy = 0.0;
+    for (k = 0; k < nstrips; k++)
+    {
+        sw += wt[k];
+        swc += wt[k]*cx[k];
+        swcc += wt[k]*cx[k]*cx[k];
+        swx += wt[k]*sx[k];
+        swcx += wt[k]*cx[k]*sx[k];
+        swy += wt[k]*sy[k];
+        swcy += wt[k]*cx[k]*sy[k];
+    }
+    g_free(cx);
+    g_free(sx);
+    g_free(sy);
+    g_free(wt);
+    den = sw*swcc - swc*swc;
+    if (!(den > 0.0))
+        return DRIFT_NO_CORRELATION;
+    slopex = (sw*swcx - swc*swx)/den;
+    slopey = (sw*swcy - swc*swy)/den;
+    *hskew = atan(slopex*xres)*180.0/PI;
+    *vskew = atan(0.5*slopey)*180.0/PI;
+    return DRIFT_OK;
+}
+
+/* Skew of the channel being corrected, which may be either of the pair; the
+ * retrace is sheared vertically the other way. */
+static DriftStatus
+drift_estimate_pair(GwyContainer *data, gint id, gint partner_id,
+                    gboolean is_retrace, gdouble *hskew, gdouble *vskew)
+{
+    GwyDataField *dfield, *partner;
+    DriftStatus status;
+    dfield = GWY_DATA_FIELD(gwy_container_get_object(data,
+                                    gwy_app_get_data_key_for_id(id)));
+    partner = GWY_DATA_FIELD(gwy_container_get_object(data,
+                                   gwy_app_get_data_key_for_id(partner_id)));
+    if (is_retrace)
+    {
+        status = drift_estimate(partner, dfield, hskew, vskew);
+        if (status == DRIFT_OK)
+            *vskew = -*vskew;
+        return status;
+    }
+    return drift_estimate(dfield, partner, hskew, vskew);
+}
+
+static const gchar*
+drift_status_message(DriftStatus status)
+{
+    if (status == DRIFT_TOO_SMALL)
+        return _("Drift estimate failed: image too small.");
+    return _("Drift estimate failed: trace and retrace do not correlate.");
+}
+
+static void
+drift_from_partner(ThresholdControls *controls)
+{
+    DriftStatus status;
+    gdouble hskew, vskew;
+    gchar *title, *s;
+    if (controls->drift_id < 0)
+        return;
+    status = drift_estimate_pair(controls->container, controls->id,
+                                 controls->drift_id, controls->drift_retrace,
+                                 &hskew, &vskew);
+    if (status != DRIFT_OK)
+    {
+        gtk_label_set_text(GTK_LABEL(controls->fit_label),
+                           drift_status_message(status));
+        return;
+    }
+    title = gwy_app_get_data_field_title(controls->container,
+                                         controls->drift_id);
+    s = g_strdup_printf(_("Drift from %s"), title);
+    gtk_label_set_text(GTK_LABEL(controls->fit_label), s);
+    g_free(s);
+    g_free(title);
+    mosaic_forget(controls);
+    gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Xadjust, hskew);
+    gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Yadjust, vskew);
+}
+
+/* First positive number under any of keys in meta, scaled by the SI prefix
+ * of a unit written after it, so "0.5 ms" gives 5e-4. */
+static gboolean
+drift_meta_number(GwyContainer *meta, const gchar *const *keys, guint nkeys,
+                  gdouble *value)
+{
+    GwySIUnit *unit;
+    const guchar *str;
+    gchar *end;
+    gint power10;
+    guint i;
+    for (i = 0; i < nkeys; i++)
+    {
+        if (!gwy_container_gis_string_by_name(meta, keys[i], &str))
+            continue;
+        *value = g_ascii_strtod((const gchar*)str, &end);
+        if (end == (gchar*)str || !(*value > 0.0))
+            continue;
+        while (g_ascii_isspace(*end))
+            end++;
+        if (g_ascii_isalpha(*end) || (guchar)*end == 0xc2)
+        {
+            unit = gwy_si_unit_new_parse(end, &power10);
+            *value *= pow(10.0, power10);
+            g_object_unref(unit);
+        }
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* Time between successive lines of channel id from its metadata, and the
+ * signs of the slow and fast scan directions: negative for frames scanned
+ * upwards and for retrace channels. */
+static gboolean
+drift_scan_timing(GwyContainer *data, gint id, gdouble *t_line,
+                  gdouble *sign)
+{
+    GwyContainer *meta;
+    const guchar *str;
+    gchar *key, *title, *partner, *lower;
+    gboolean is_retrace = FALSE, found;
+    gdouble rate;
+    guint i;
+    key = g_strdup_printf("/%i/meta", id);
+    found = gwy_container_gis_object_by_name(data, key, &meta);
+    g_free(key);
+    if (!found)
+        return FALSE;
+    if (!drift_meta_number(meta, line_time_keys,
+                           G_N_ELEMENTS(line_time_keys), t_line))
+    {
+        if (!drift_meta_number(meta, line_rate_keys,
+                               G_N_ELEMENTS(line_rate_keys), &rate))
+            return FALSE;
+        *t_line = 1.0/rate;
+    }
+    sign[0] = 1.0;
+    for (i = 0; i < G_N_ELEMENTS(frame_direction_keys); i++)
+    {
+        if (!gwy_container_gis_string_by_name(meta, frame_direction_keys[i],
+                                              &str))
+            continue;
+        lower = g_utf8_strdown((const gchar*)str, -1);
+        if (strstr(lower, "up"))
+            sign[0] = -1.0;
+        g_free(lower);
+        break;
+    }
+    title = gwy_app_get_data_field_title(data, id);
+    partner = drift_partner_title(title, &is_retrace);
+    sign[1] = (partner && is_retrace) ? -1.0 : 1.0;
+    g_free(partner);
+    g_free(title);
+    return TRUE;
+}
+
+/* Drift velocity in xy units per second that shears a scan by hskew, vskew.
+ * Rows are t_line apart, giving the horizontal shear, and a trace takes
+ * half of t_line, giving the vertical one. */
+static void
+drift_skew_to_velocity(GwyDataField *dfield, gdouble t_line,
+                       const gdouble *sign, gdouble hskew, gdouble vskew,
+                       gdouble *v)
+{
+    gdouble dx, dy;
+    gint xres;
+    dx = gwy_data_field_get_xmeasure(dfield);
+    dy = gwy_data_field_get_ymeasure(dfield);
+    xres = gwy_data_field_get_xres(dfield);
+    v[0] = -sign[0]*tan(deg2rad(hskew))*dx/t_line;
+    v[1] = -sign[1]*tan(deg2rad(vskew))*2.0*xres*dy/t_line;
+}
+
+static gchar*
+drift_format_velocity(GwySIUnit *xyunit, gdouble v)
+{
+    GwySIUnit *second, *unit;
+    GwySIValueFormat *vf;
+    gchar *s;
+    second = gwy_si_unit_new("s");
+    unit = gwy_si_unit_divide(xyunit, second, NULL);
+    vf = gwy_si_unit_get_format_with_digits(unit, GWY_SI_UNIT_FORMAT_PLAIN,
+                                            fabs(v), 3, NULL);
+    s = g_strdup_printf("%.*f %s", vf->precision, v/vf->magnitude,
+                        vf->units);
+    gwy_si_unit_value_format_free(vf);
+    g_object_unref(unit);
+    g_object_unref(second);
+    return s;
+}
+
+/* Adds the drift of a corrected scan to the session, taking it to follow
+ * the last recorded scan directly.  Correcting a recorded scan again only
+ * replaces its velocity. */
+static void
+drift_session_record(GwyContainer *data, gint id, gdouble hskew,
+                     gdouble vskew)
+{
+    GwyDataField *dfield;
+    DriftRecord rec, *last;
+    gdouble t_line, sign[2];
+    guint i;
+    if (!drift_scan_timing(data, id, &t_line, sign))
+        return;
+    dfield = GWY_DATA_FIELD(gwy_container_get_object(data,
+                                    gwy_app_get_data_key_for_id(id)));
+    rec.data = data;
+    rec.id = id;
+    rec.frame = gwy_data_field_get_yres(dfield)*t_line;
+    drift_skew_to_velocity(dfield, t_line, sign, hskew, vskew, rec.v);
+    if (!drift_session)
+        drift_session = g_array_new(FALSE, FALSE, sizeof(DriftRecord));
+    for (i = 0; i < drift_session->len; i++)
+    {
+        last = &g_array_index(drift_session, DriftRecord, i);
+        if (last->data == data && last->id == id)
+        {
+            last->v[0] = rec.v[0];
+            last->v[1] = rec.v[1];
+            return;
+        }
+    }
+    rec.t = 0.5*rec.frame;
+    if (drift_session->len)
+    {
+        last = &g_array_index(drift_session, DriftRecord,
+                              drift_session->len - 1);
+        rec.t += last->t + 0.5*last->frame;
+    }
+    g_array_append_val(drift_session, rec);
+    if (drift_session->len > DRIFT_SESSION_MAX)
+        g_array_remove_index(drift_session, 0);
+}
+
+/* Skew of scan id predicted from the session, modelling the drift as
+ * decaying exponentially in time in a fixed direction, as thermal drift
+ * does after a move.  The decay rate is fitted to the logarithm of the
+ * recorded speeds; a single record or a growing drift predict the last
+ * velocity unchanged.  A recorded scan gets its own skew back. */
+static gboolean
+drift_session_predict(GwyContainer *data, gint id, gdouble *hskew,
+                      gdouble *vskew)
+{
+    GwyDataField *dfield;
+    const DriftRecord *rec, *last;
+    gdouble t_line, sign[2], v[2], t, speed, rate, dx, dy;
+    gdouble sw, st, sl, stt, stl, det;
+    guint i;
+    if (!drift_session || !drift_session->len
+        || !drift_scan_timing(data, id, &t_line, sign))
+        return FALSE;
+    dfield = GWY_DATA_FIELD(gwy_container_get_object(data,
+                                    gwy_app_get_data_key_for_id(id)));
+    for (i = 0; i < drift_session->len; i++)
+    {
+        rec = &g_array_index(drift_session, DriftRecord, i);
+        if (rec->data == data && rec->id == id)
+            break;
+    }
+    rate = 0.0;
+    if (i < drift_session->len)
+    {
+        last = rec;
+        t = rec->t;
+    }
+    else
+    {
+        last = &g_array_index(drift_session, DriftRecord, i - 1);
+        t = last->t + 0.5*(last->frame
+                           + gwy_data_field_get_yres(dfield)*t_line);
+        sw = st = sl = stt = stl = 0.0;
+        for (i = 0; i < drift_session->len; i++)
+        {
+            rec = &g_array_index(drift_session, DriftRecord, i);
+            speed = hypot(rec->v[0], rec->v[1]);
+            if (!(speed > 0.0))
+                continue;
+            sw += 1.0;
+            st += rec->t;
+            sl += log(speed);
+            stt += rec->t*rec->t;
+            stl += rec->t*log(speed);
+        }
+        det = sw*stt - st*st;
+        if (sw > 1.0 && det > 0.0)
+            rate = MAX(-(sw*stl - st*sl)/det, 0.0);
+    }
+    v[0] = last->v[0]*exp(-rate*(t - last->t));
+    v[1] = last->v[1]*exp(-rate*(t - last->t));
+    dx = gwy_data_field_get_xmeasure(dfield);
+    dy = gwy_data_field_get_ymeasure(dfield);
+    *hskew = atan(-sign[0]*v[0]*t_line/dx)*180.0/PI;
+    *vskew = atan(-sign[1]*v[1]*t_line
+                  /(2.0*gwy_data_field_get_xres(dfield)*dy))*180.0/PI;
+    return TRUE;
+}
+
+/* Channels that can be tiles of one mosaic with id: the same pixel
+ * dimensions, pixel size and units, and an offset at least a pixel away
+ * from that of every tile taken before, so that trace/retrace pairs and
+ * files without offsets do not make tiles of nothing.  The current
+ * channel comes first. */
+static GArray*
+mosaic_collect_tiles(GwyContainer *data, gint id)
+{
+    GwyDataField *dfield, *other, *tile;
+    GArray *tiles;
+    gint *ids;
+    gint i, k;
+    dfield = GWY_DATA_FIELD(gwy_container_get_object(data,
+                                    gwy_app_get_data_key_for_id(id)));
+    tiles = g_array_new(FALSE, FALSE, sizeof(gint));
+    g_array_append_val(tiles, id);
+    ids = gwy_app_data_browser_get_data_ids(data);
+    for (i = 0; ids[i] != -1; i++)
+    {
+        if (ids[i] == id)
+            continue;
+        other = GWY_DATA_FIELD(gwy_container_get_object(data,
+                                     gwy_app_get_data_key_for_id(ids[i])));
+        if (gwy_data_field_get_xres(other) != gwy_data_field_get_xres(dfield)
+            || gwy_data_field_get_yres(other)
+               != gwy_data_field_get_yres(dfield)
+            || fabs(gwy_data_field_get_xmeasure(other)
+                    /gwy_data_field_get_xmeasure(dfield) - 1.0) > 1e-6
+            || fabs(gwy_data_field_get_ymeasure(other)
+                    /gwy_data_field_get_ymeasure(dfield) - 1.0) > 1e-6
+            || !gwy_si_unit_equal(gwy_data_field_get_si_unit_xy(other),
+                                  gwy_data_field_get_si_unit_xy(dfield))
+            || !gwy_si_unit_equal(gwy_data_field_get_si_unit_z(other),
+                                  gwy_data_field_get_si_unit_z(dfield)))
+            continue;
+        for (k = 0; k < (gint)tiles->len; k++)
+        {
+            tile = GWY_DATA_FIELD(gwy_container_get_object(data,
+                        gwy_app_get_data_key_for_id(
+                            g_array_index(tiles, gint, k))));
+            if (fabs(gwy_data_field_get_xoffset(other)
+                     - gwy_data_field_get_xoffset(tile))
+                < gwy_data_field_get_xmeasure(dfield)
+                && fabs(gwy_data_field_get_yoffset(other)
+                        - gwy_data_field_get_yoffset(tile))
+                   < gwy_data_field_get_ymeasure(dfield))
+                break;
+        }
+        if (k < (gint)tiles->len)
+            continue;
+        g_array_append_val(tiles, ids[i]);
+    }
+    g_free(ids);
+    return tiles;
+}
+
+/* Fits the lattice in the full spectrum of one raw tile and gives its
+ * real-space basis.  The window must already be filled; nothing shared is
+ * modified, so tiles can be fitted in parallel. */
+static gboolean
+mosaic_tile_basis(GwyDataField *tile, const WindowCacheEntry *win,
+                  LatticeBasis *real)
+{
+    const SpectrumHistogram *hist;
+    GwyDataField *rin, *raout, *ipout;
+    LatticeBasis recip;
+    GArray *peaks;
+    gdouble rms, threshold;
+    gboolean ok;
+    rin = gwy_data_field_new_alike(tile, FALSE);
+    raout = gwy_data_field_new_alike(tile, FALSE);
+    ipout = gwy_data_field_new_alike(tile, FALSE);
+    window_apply(win, tile, rin);
+    skew_fft_raw(rin, NULL, raout, ipout, GWY_TRANSFORM_DIRECTION_FORWARD);
+    set_dfield_modulus(raout, ipout, rin);
+    fft_postprocess(rin);
+    hist = g_object_get_data(G_OBJECT(rin), histogram_key);
+    threshold = spectrum_histogram_quantile(hist, fit_peak_quantile);
+    peaks = g_array_new(FALSE, FALSE, sizeof(SpectrumPeak));
+    spectrum_find_peaks(rin, threshold, peaks);
+    ok = lattice_fit_peaks(peaks, &recip, &rms);
+    if (ok)
+        lattice_real_basis(&recip, real);
+    g_array_free(peaks, TRUE);
+    g_object_unref(rin);
+    g_object_unref(raout);
+    g_object_unref(ipout);
+    return ok;
+}
+
+/* Correlation of two equally sized crops.  A lattice correlates equally
+ * well at every lattice translation, so the frequencies near its peaks are
+ * notched out when the real basis is known, and the cross-power is
+ * whitened by its square root only, which keeps the aperiodic features
+ * that fix the shift above the noise.  Gives the displacement e for which
+ * cb(u) = ca(u + e) and returns the height of the correlation peak
+ * relative to that of identical crops. */
+static gdouble
+mosaic_correlate(GwyDataField *ca, GwyDataField *cb, const LatticeBasis *real,
+                 gdouble *e)
+{
+    GwyDataField *wa, *wb, *ra, *ia, *rb, *ib;
+    LatticeBasis recip;
+    const gdouble *c;
+    gdouble *pra, *pia, *prb, *pib, *pwa, *pwb;
+    gdouble re, im, mod, cmax, peak, sm, sp, den, sum;
+    gdouble dx, dy, fx, fy, u, v, rx, ry;
+    gint cw, ch, n, k, kmax, i, j, im1, ip1;
+    cw = gwy_data_field_get_xres(ca);
+    ch = gwy_data_field_get_yres(ca);
+    n = cw*ch;
+    wa = gwy_data_field_new_alike(ca, FALSE);
+    wb = gwy_data_field_new_alike(ca, FALSE);
+    ra = gwy_data_field_new_alike(ca, FALSE);
+    ia = gwy_data_field_new_alike(ca, FALSE);
+    rb = gwy_data_field_new_alike(ca, FALSE);
+    ib = gwy_data_field_new_alike(ca, FALSE);
+    drift_window(ca, wa, 0.0, 0.0);
+    drift_window(cb, wb, 0.0, 0.0);
+    skew_fft_raw(wa, NULL, ra, ia, GWY_TRANSFORM_DIRECTION_FORWARD);
+    skew_fft_raw(wb, NULL, rb, ib, GWY_TRANSFORM_DIRECTION_FORWARD);
+    pra = gwy_data_field_get_data(ra);
+    pia = gwy_data_field_get_data(ia);
+    prb = gwy_data_field_get_data(rb);
+    pib = gwy_data_field_get_data(ib);
+    pwa = gwy_data_field_get_data(wa);
+    pwb = gwy_data_field_get_data(wb);
+    dx = gwy_data_field_get_xmeasure(ca);
+    dy = gwy_data_field_get_ymeasure(ca);
+    if (real)
+        lattice_real_basis(real, &recip);
+    sum = 0.0;
+    for (k = 0; k < n; k++)
+    {
+        re = pra[k]*prb[k] + pia[k]*pib[k];
+        im = pra[k]*pib[k] - pia[k]*prb[k];
+        mod = sqrt(hypot(re, im));
+        pwa[k] = pwb[k] = 0.0;
+        if (real)
+        {
+            i = k/cw;
+            j = k % cw;
+            fx = ((j > cw/2) ? j - cw : j)/(cw*dx);
+            fy = ((i > ch/2) ? i - ch : i)/(ch*dy);
+            u = fx*real->a[0] + fy*real->a[1];
+            v = fx*real->b[0] + fy*real->b[1];
+            if (fabs(u) >= 0.5 || fabs(v) >= 0.5)
+            {
+                u -= GWY_ROUND(u);
+                v -= GWY_ROUND(v);
+                rx = (u*recip.a[0] + v*recip.b[0])*cw*dx;
+                ry = (u*recip.a[1] + v*recip.b[1])*ch*dy;
+                if (rx*rx + ry*ry < MOSAIC_NOTCH*MOSAIC_NOTCH)
+                    continue;
+            }
+        }
+        if (mod > 0.0)
+        {
+            pwa[k] = re/mod;
+            pwb[k] = im/mod;
+            sum += mod;
+        }
+    }
+    gwy_data_field_invalidate(wa);
+    gwy_data_field_invalidate(wb);
+    skew_fft_raw(wa, wb, ra, ia, GWY_TRANSFORM_DIRECTION_BACKWARD);
+    c = gwy_data_field_get_data_const(ra);
+    kmax = 0;
+    for (k = 1; k < n; k++)
+        if (c[k] > c[kmax])
+            kmax = k;
+    cmax = c[kmax];
+    peak = (sum > 1e-12*n) ? cmax*sqrt(n)/sum : 0.0;
+    i = kmax/cw;
+    j = kmax % cw;
+    im1 = (j + cw - 1) % cw;
+    ip1 = (j + 1) % cw;
+    sm = c[i*cw + im1];
+    sp = c[i*cw + ip1];
+    den = sm - 2.0*cmax + sp;
+    e[0] = ((j > cw/2) ? cw - j : -j)
+           - ((den < 0.0) ? 0.5*(sm - sp)/den : 0.0);
+    im1 = (i + ch - 1) % ch;
+    ip1 = (i + 1) % ch;
+    sm = c[im1*cw + j];
+    sp = c[ip1*cw + j];
+    den = sm - 2.0*cmax + sp;
+    e[1] = ((i > ch/2) ? ch - i : -i)
+           - ((den < 0.0) ? 0.5*(sm - sp)/den : 0.0);
+    g_object_unref(wa);
+    g_object_unref(wb);
+    g_object_unref(ra);
+    g_object_unref(ia);
+    g_object_unref(rb);
+    g_object_unref(ib);
+    return peak;
+}
+
+/* Displacement of the common content of tiles a and b between their raw
+ * frames in pixels, where b nominally starts ox, oy pixels from a, from the
+ * largest power-of-two crops of their overlap.  The overlap is recomputed
+ * from each estimate so that the windows of the final correlation cover
+ * the same content and do not pull the result towards the nominal offset.
+ * Corner overlaps, spanning less than half of the tile in both directions,
+ * are too small for a reliable shift and are skipped.  Returns the height
+ * of the last correlation peak, zero for no usable overlap. */
+static gdouble
+mosaic_overlap_shift(GwyDataField *a, GwyDataField *b, gint ox, gint oy,
+                     const LatticeBasis *real, gdouble *d)
+{
+    GwyDataField *ca, *cb;
+    gdouble e[2], peak = 0.0;
+    gint xres, yres, x0, y0, w, h, cw, ch, iter;
+    xres = gwy_data_field_get_xres(a);
+    yres = gwy_data_field_get_yres(a);
+    for (iter = 0; iter < MOSAIC_ITERATIONS; iter++)
+    {
+        x0 = MAX(0, ox);
+        y0 = MAX(0, oy);
+        w = MIN(xres, ox + xres) - x0;
+        h = MIN(yres, oy + yres) - y0;
+        if (w < MOSAIC_CROP_MIN || h < MOSAIC_CROP_MIN
+            || (2*w < xres && 2*h < yres))
+            break;
+        for (cw = MOSAIC_CROP_MAX; cw > w; cw /= 2)
+            ;
+        for (ch = MOSAIC_CROP_MAX; ch > h; ch /= 2)
+            ;
+        x0 += (w - cw)/2;
+        y0 += (h - ch)/2;
+        ca = gwy_data_field_area_extract(a, x0, y0, cw, ch);
+        cb = gwy_data_field_area_extract(b, x0 - ox, y0 - oy, cw, ch);
+        peak = mosaic_correlate(ca, cb, real, e);
+        g_object_unref(ca);
+        g_object_unref(cb);
+        d[0] = ox + e[0];
+        d[1] = oy + e[1];
+        if (fabs(e[0]) < 0.5 && fabs(e[1]) < 0.5)
+            break;
+        ox = GWY_ROUND(d[0]);
+        oy = GWY_ROUND(d[1]);
+    }
+    return peak;
+}
+
+/* Solves one skew for all tiles of a mosaic from the lattice of every tile
+ * together with the displacements measured in every overlap, which fix the
+ * rotation-like part the lattice shape cannot see.  Tiles and overlaps are
+ * processed in parallel when FFTW planning is thread-safe, their cost being
+ * mostly transforms.  Once solved, OK writes every tile corrected. */
+static void
+mosaic_solve(ThresholdControls *controls)
+{
+    const WindowCacheEntry *win;
+    GwyDataField **fields;
+    LatticeBasis *bases;
+    MosaicLink *links;
+    GArray *tiles;
+    gboolean *ok;
+    gint *pairs;
+    gdouble dx, dy, hskew, vskew;
+    gint n, npairs, nbases, nlinks, i, j, k;
+    gchar *s;
+    tiles = mosaic_collect_tiles(controls->container, controls->id);
+    n = tiles->len;
+    if (n < 2)
+    {
+        g_array_free(tiles, TRUE);
+        gtk_label_set_text(GTK_LABEL(controls->fit_label),
+                           _("Mosaic needs two or more similar channels."));
+        return;
+    }
+    fields = g_new(GwyDataField*, n);
+    for (i = 0; i < n; i++)
+        fields[i] = GWY_DATA_FIELD(gwy_container_get_object(
+                                    controls->container,
+                                    gwy_app_get_data_key_for_id(
+                                        g_array_index(tiles, gint, i))));
+    dx = gwy_data_field_get_xmeasure(fields[0]);
+    dy = gwy_data_field_get_ymeasure(fields[0]);
+    win = window_cache_lookup(&controls->window_cache,
+                              controls->args->window_type,
+                              controls->args->kaiser_beta,
+                              gwy_data_field_get_xres(fields[0]),
+                              gwy_data_field_get_yres(fields[0]));
+    npairs = n*(n - 1)/2;
+    pairs = g_new(gint, 2*npairs);
+    for (i = k = 0; i < n; i++)
+        for (j = i+1; j < n; j++, k++)
+        {
+            pairs[2*k] = i;
+            pairs[2*k + 1] = j;
+        }
+    bases = g_new(LatticeBasis, n);
+    links = g_new(MosaicLink, npairs);
+    ok = g_new(gboolean, n + npairs);
+#ifdef _OPENMP
+#pragma omp parallel if(fft_parallel) private(i, j, k)
+#endif
+    {
+        const LatticeBasis *real;
+        gdouble d[2];
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (i = 0; i < n; i++)
+            ok[i] = mosaic_tile_basis(fields[i], win, bases + i);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (k = 0; k < npairs; k++)
+        {
+            i = pairs[2*k];
+            j = pairs[2*k + 1];
+            links[k].o[0] = gwy_data_field_get_xoffset(fields[j])
+                            - gwy_data_field_get_xoffset(fields[i]);
+            links[k].o[1] = gwy_data_field_get_yoffset(fields[j])
+                            - gwy_data_field_get_yoffset(fields[i]);
+            /* The residual of a link is relative to its nominal length. */
+            if (hypot(links[k].o[0]/dx, links[k].o[1]/dy) < 1.0)
+            {
+                ok[n + k] = FALSE;
+                continue;
+            }
+            real = ok[i] ? bases + i : (ok[j] ? bases + j : NULL);
+            ok[n + k] = (mosaic_overlap_shift(fields[i], fields[j],
+                                              GWY_ROUND(links[k].o[0]/dx),
+                                              GWY_ROUND(links[k].o[1]/dy),
+                                              real, d)
+                         >= mosaic_min_peak);
+            links[k].d[0] = d[0]*dx;
+            links[k].d[1] = d[1]*dy;
+        }
+    }
+    for (i = nbases = 0; i < n; i++)
+        if (ok[i])
+            bases[nbases++] = bases[i];
+    for (k = nlinks = 0; k < npairs; k++)
+        if (ok[n + k])
+            links[nlinks++] = links[k];
+    hskew = controls->args->Xskew;
+    vskew = controls->args->Yskew;
+    if (!lattice_solve_skew(bases, nbases, links, nlinks,
+                            lattice_target_angle(controls->args->lattice_type),
+                            dx/dy, &hskew, &vskew))
+    {
+        s = g_strdup_printf(_("Mosaic: no solution from %d lattices "
+                              "and %d overlaps."), nbases, nlinks);
+        mosaic_forget(controls);
+        g_array_free(tiles, TRUE);
+    }
+    else
+    {
+        s = g_strdup_printf(_("Mosaic: %d tiles, %d lattices, %d overlaps; "
+                              "OK writes all tiles."), n, nbases, nlinks);
+        /* Setting the sliders forgets any previous mosaic, so the new one
+         * is only stored afterwards. */
+        gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Xadjust,
+                                 hskew);
+        gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Yadjust,
+                                 vskew);
+        mosaic_forget(controls);
+        controls->mosaic = tiles;
+        controls->fit.ci_valid = FALSE;
+    }
+    gtk_label_set_text(GTK_LABEL(controls->fit_label), s);
+    g_free(s);
+    g_free(ok);
+    g_free(links);
+    g_free(bases);
+    g_free(pairs);
+    g_free(fields);
+}
+
+/* Drops the solved mosaic, so that OK writes only the current channel; any
+ * skew not coming from mosaic_solve() invalidates it. */
+static void
+mosaic_forget(ThresholdControls *controls)
+{
+    if (controls->mosaic)
+        g_array_free(controls->mosaic, TRUE);
+    controls->mosaic = NULL;
+}
+
+/* Corrects every mosaic tile with the current skew, in parallel, and adds
+ * them as new channels offset so that the corrected content lies where the
+ * nominal tile offsets put it, ready for stitching.  The tiles are spread
+ * over the NUMA nodes, each corrected in memory of the node doing it. */
+static void
+mosaic_create_output(GwyContainer *data, ThresholdControls *controls)
+{
+    GwyDataField **sources, **results;
+    MosaicBatch batch;
+    GwyContainer *meta;
+    gdouble *trans, *fill;
+    gchar *title, *s;
+    gint n, i, id, newid;
+    n = controls->mosaic->len;
+    sources = g_new(GwyDataField*, 2*n);
+    results = sources + n;
+    trans = g_new(gdouble, 7*n);
+    fill = trans + 6*n;
+    for (i = 0; i < n; i++)
+        sources[i] = GWY_DATA_FIELD(gwy_container_get_object(data,
+                        gwy_app_get_data_key_for_id(
+                            g_array_index(controls->mosaic, gint, i))));
+    batch.sources = sources;
+    batch.results = results;
+    batch.trans = trans;
+    batch.fill = fill;
+    batch.hskew = controls->args->Xskew;
+    batch.vskew = controls->args->Yskew;
+    batch.fixed_point = controls->args->fixed_point;
+    skew_batch_run(n, mosaic_correct_tile, &batch, 0);
+    for (i = 0; i < n; i++)
+    {
+        id = g_array_index(controls->mosaic, gint, i);
+        gwy_data_field_set_xoffset(results[i],
+                gwy_data_field_get_xoffset(sources[i])
+                - trans[6*i + 4]*gwy_data_field_get_xmeasure(sources[i]));
+        gwy_data_field_set_yoffset(results[i],
+                gwy_data_field_get_yoffset(sources[i])
+                - trans[6*i + 5]*gwy_data_field_get_ymeasure(sources[i]));
+        gwy_data_field_set_si_unit_xy(results[i],
+                gwy_data_field_get_si_unit_xy(sources[i]));
+        gwy_data_field_set_si_unit_z(results[i],
+                gwy_data_field_get_si_unit_z(sources[i]));
+        meta = skew_output_meta(data, id, results[i], controls);
+        skew_stats_detach(results[i]);
+        newid = gwy_app_data_browser_add_data_field(results[i], data, TRUE);
+        g_object_unref(results[i]);
+        s = g_strdup_printf("/%i/meta", newid);
+        gwy_container_set_object_by_name(data, s, meta);
+        g_object_unref(meta);
+        g_free(s);
+        title = gwy_app_get_data_field_title(data, id);
+        s = g_strdup_printf(_("%s (skewed)"), title);
+        gwy_app_set_data_field_title(data, newid, s);
+        g_free(s);
+        g_free(title);
+        gwy_app_channel_log_add(data, id, newid, "proc::skew_lattice", NULL);
+    }
+    g_free(trans);
+    g_free(sources);
+}
+
+static void
+mosaic_correct_tile(gint i, gpointer user_data)
+{
+    MosaicBatch *batch = (MosaicBatch*)user_data;
+    batch->results[i] = skew_correct_field(batch->sources[i],
+                                           batch->hskew, batch->vskew,
+                                           batch->fixed_point,
+                                           batch->trans + 6*i,
+                                           batch->fill + i);
+}
+
+static void
+lattice_type_changed(GtkComboBox *combo, ThresholdControls *controls)
+{
+    controls->args->lattice_type = gwy_enum_combo_box_get_active(combo);
+    threshold_save_args(controls);
+}
+
+static void
+domains_changed(GtkComboBox *combo, ThresholdControls *controls)
+{
+    controls->args->domains = gwy_enum_combo_box_get_active(combo);
+    threshold_save_args(controls);
+}
+
+/* Only the mosaic and the non-interactive correction resample on 16-bit
+ * samples, the dialog keeps its floating point tiles. */
+static void
+fixed_point_changed(GtkToggleButton *toggle, ThresholdControls *controls)
+{
+    controls->args->fixed_point = gtk_toggle_button_get_active(toggle);
+    threshold_save_args(controls);
+}
+
+static void
+reset_Xskew(ThresholdControls *controls)
+{
+    gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Xadjust, 0.0);
+}
+
+static void
+reset_Yskew(ThresholdControls *controls)
+{
+    gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Yadjust, 0.0);
+}
+
+static void
+gwy_tool_level3_radius_changed(GwyToolLevel3 *tool)
+{
+    tool->rpx = gwy_adjustment_get_int(tool->radius);
+    guint i;
+    GwyNullStore *store = GWY_NULL_STORE(tool->model);
+    for (i = 0; i < 4; i++)
+        gwy_null_store_row_changed(store, i);
+}
+
+static void
+perform_fft(ThresholdControls *controls, GwyDataField *dfield)
+{
+    GwyDataField *rin, *raout, *ipout;
+    const WindowCacheEntry *win;
+    gint xres, yres, tile;
+    xres = gwy_data_field_get_xres(dfield);
+    yres = gwy_data_field_get_yres(dfield);
+    tile = controls->args->tile_size;
+    SKEW_PROBE4(fft_entry, xres, yres, (gint)controls->args->spectrum_mode,
+                tile);
+    if (controls->args->spectrum_mode == SPECTRUM_WELCH
+        && xres > tile && yres > tile)
+        spectrum_welch(controls, dfield, tile);
+    else
+    {
+        win = window_cache_lookup(&controls->window_cache,
+                                  controls->args->window_type,
+                                  controls->args->kaiser_beta, xres, yres);
+        rin = gwy_data_field_new_alike(dfield, FALSE);
+        raout = gwy_data_field_new_alike(dfield, FALSE);
+        ipout = gwy_data_field_new_alike(dfield, FALSE);
+        window_apply(win, dfield, rin);
+        gwy_data_field_2dfft_raw(rin, NULL, raout, ipout,
+                                 GWY_TRANSFORM_DIRECTION_FORWARD);
+        set_dfield_modulus(raout, ipout, dfield);
+        g_object_unref(rin);
+        g_object_unref(raout);
+        g_object_unref(ipout);
+    }
+    fft_postprocess(dfield);
+    gchar *key;
+    key = g_strdup_printf("/%i/base/palette", 0);
+    gwy_container_set_string_by_name(controls->mydata, key, g_strdup("Gray"));
+    g_free(key);
+    key = g_strdup_printf("/%i/base/range-type", 0);
+    gwy_container_set_enum_by_name(controls->mydata, key,
+                                   GWY_LAYER_BASIC_RANGE_ADAPT);
+    g_free(key);
+    SKEW_PROBE2(fft_return, xres, yres);
+}
+
+/* Averages the power spectra of windowed tiles overlapping by half.  The
+ * tiles are small enough to stay in cache and are transformed in parallel
+ * when FFTW planning is thread-safe, each thread accumulating into its own
+ * buffer.  On return dfield holds the
+ * RMS modulus on the tile-sized grid with the original pixel size. */
+static void
+spectrum_welch(ThresholdControls *controls, GwyDataField *dfield, gint tile)
+{
+    const WindowCacheEntry *win;
+    const gdouble *src;
+    SkewStats stats;
+    gdouble *power, *data;
+    gdouble dx, dy;
+    gint xres, yres, step, nx, ny, ntiles, n, k;
+    xres = gwy_data_field_get_xres(dfield);
+    yres = gwy_data_field_get_yres(dfield);
+    dx = gwy_data_field_get_xmeasure(dfield);
+    dy = gwy_data_field_get_ymeasure(dfield);
+    win = window_cache_lookup(&controls->window_cache,
+                              controls->args->window_type,
+                              controls->args->kaiser_beta, tile, tile);
+    step = tile/2;
+    nx = (xres - tile)/step + 1;
+    ny = (yres - tile)/step + 1;
+    ntiles = nx*ny;
+    n = tile*tile;
+    src = gwy_data_field_get_data_const(dfield);
+    power = g_new0(gdouble, n);
+#ifdef _OPENMP
+#pragma omp parallel if(fft_parallel && ntiles > 1) private(k)
+#endif
+    {
+        GwyDataField *rin, *rout, *iout;
+        gdouble *acc;
+        gint t;
+        rin = gwy_data_field_new(tile, tile, tile*dx, tile*dy, FALSE);
+        rout = gwy_data_field_new_alike(rin, FALSE);
+        iout = gwy_data_field_new_alike(rin, FALSE);
+        acc = g_new0(gdouble, n);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (t = 0; t < ntiles; t++)
+            spectrum_tile_power(src, xres, (t % nx)*step, (t / nx)*step, win,
+                                rin, rout, iout, acc);
+#ifdef _OPENMP
+#pragma omp critical(skew_welch)
+#endif
+        for (k = 0; k < n; k++)
+            power[k] += acc[k];
+        g_free(acc);
+        g_object_unref(rin);
+        g_object_unref(rout);
+        g_object_unref(iout);
+    }
+    gwy_data_field_resample(dfield, tile, tile, GWY_INTERPOLATION_NONE);
+    gwy_data_field_set_xreal(dfield, tile*dx);
+    gwy_data_field_set_yreal(dfield, tile*dy);
+    data = gwy_data_field_get_data(dfield);
+    skew_stats_init(&stats);
+    for (k = 0; k < n; k++)
+    {
+        data[k] = sqrt(power[k]/ntiles);
+        skew_stats_add(&stats, data[k]);
+    }
+    gwy_data_field_invalidate(dfield);
+    skew_stats_attach(dfield, &stats);
+    g_free(power);
+}
+
+/* gwy_data_field_2dfft_raw() for parallel regions.  libprocess plans with
+ * FFTW on every call; unless the planner was made thread-safe the
+ * transforms go one at a time. */
+static void
+skew_fft_raw(GwyDataField *rin, GwyDataField *iin,
+             GwyDataField *rout, GwyDataField *iout,
+             GwyTransformDirection dir)
+{
+    if (fft_parallel)
+    {
+        gwy_data_field_2dfft_raw(rin, iin, rout, iout, dir);
+        return;
+    }
+#ifdef _OPENMP
+#pragma omp critical(skew_fft)
+#endif
+    gwy_data_field_2dfft_raw(rin, iin, rout, iout, dir);
+}
+
+/* Adds the power spectrum of the mean-subtracted, windowed tile at col0,
+ * row0 of the xres wide data src to acc.  rin, rout and iout are scratch
+ * fields of the tile size. */
+static void
+spectrum_tile_power(const gdouble *src, gint xres, gint col0, gint row0,
+                    const WindowCacheEntry *win, GwyDataField *rin,
+                    GwyDataField *rout, GwyDataField *iout, gdouble *acc)
+{
+    const gdouble *re, *im, *row;
+    gdouble *d;
+    gdouble avg, wy;
+    gint tile, n, i, j, k;
+    tile = gwy_data_field_get_xres(rin);
+    n = tile*tile;
+    d = gwy_data_field_get_data(rin);
+    avg = 0.0;
+    for (i = 0; i < tile; i++)
+    {
+        row = src + (row0 + i)*xres + col0;
+        for (j = 0; j < tile; j++)
+            avg += row[j];
+    }
+    avg /= n;
+    for (i = 0; i < tile; i++)
+    {
+        row = src + (row0 + i)*xres + col0;
+        wy = win->ywin[i];
+        for (j = 0; j < tile; j++)
+            d[i*tile + j] = (row[j] - avg) * (wy*win->xwin[j]);
+    }
+    gwy_data_field_invalidate(rin);
+    skew_fft_raw(rin, NULL, rout, iout, GWY_TRANSFORM_DIRECTION_FORWARD);
+    re = gwy_data_field_get_data_const(rout);
+    im = gwy_data_field_get_data_const(iout);
+    for (k = 0; k < n; k++)
+        acc[k] += re[k]*re[k] + im[k]*im[k];
+}
+
+static void
+spectrum_mode_changed(GtkComboBox *combo, ThresholdControls *controls)
+{
+    controls->args->spectrum_mode = gwy_enum_combo_box_get_active(combo);
+    gtk_widget_set_sensitive(controls->tile_size,
+                controls->args->spectrum_mode == SPECTRUM_WELCH);
+    threshold_save_args(controls);
+    spectrum_update_source(controls);
+    skew_process(controls);
+    reFind_Peaks(controls);
+}
+
+static void
+tile_size_changed(GtkComboBox *combo, ThresholdControls *controls)
+{
+    controls->args->tile_size = gwy_enum_combo_box_get_active(combo);
+    threshold_save_args(controls);
+    if (controls->args->spectrum_mode != SPECTRUM_WELCH)
+        return;
+    spectrum_update_source(controls);
+    skew_process(controls);
+    reFind_Peaks(controls);
+}
+
+static void
+spectrum_update_source(ThresholdControls *controls)
+{
+    GwyDataField *dfield;
+    dfield = roi_extract(controls->image, controls->roi);
+    perform_fft(controls, dfield);
+    g_object_unref(controls->dfield);
+    controls->dfield = dfield;
+}
+
+static void
+spectrum_update_corrected(ThresholdControls *controls)
+{
+    GwyDataField *dfield;
+    dfield = skew_corrected_source(controls);
+    perform_fft(controls, dfield);
+    if (controls->corr_fft)
+        g_object_unref(controls->corr_fft);
+    controls->corr_fft = dfield;
+}
+
+/* Copies the pixel box x0, y0, x1, y1 out of field, or the whole field when
+ * the box is too small to give a useful spectrum. */
+static GwyDataField*
+roi_extract(GwyDataField *field, const gdouble *box)
+{
+    gint xres, yres, col, row, width, height;
+    xres = gwy_data_field_get_xres(field);
+    yres = gwy_data_field_get_yres(field);
+    col = CLAMP(GWY_ROUND(box[0]), 0, xres);
+    row = CLAMP(GWY_ROUND(box[1]), 0, yres);
+    width = CLAMP(GWY_ROUND(box[2]), 0, xres) - col;
+    height = CLAMP(GWY_ROUND(box[3]), 0, yres) - row;
+    if (width < ROI_MIN_SIZE || height < ROI_MIN_SIZE)
+        return gwy_data_field_duplicate(field);
+    return gwy_data_field_area_extract(field, col, row, width, height);
+}
+
+/* Maps a pixel box through the affine T and returns the largest axis-aligned
+ * box inside the resulting parallelogram. */
+static void
+roi_map_box(const gdouble *T, const gdouble *box, gdouble *out)
+{
+    gdouble p[3], Tp[4][3];
+    gint i;
+    for (i = 0; i < 4; i++)
+    {
+        p[0] = (i == 1 || i == 2) ? box[2] : box[0];
+        p[1] = (i >= 2) ? box[3] : box[1];
+        p[2] = 1;
+        mult_3matrix(Tp[i], T, p);
+    }
+    out[0] = MAX(Tp[0][0], Tp[3][0]);
+    out[1] = MAX(Tp[0][1], Tp[1][1]);
+    out[2] = MIN(Tp[1][0], Tp[2][0]);
+    out[3] = MIN(Tp[2][1], Tp[3][1]);
+}
+
+static gboolean
+roi_corrected_box(ThresholdControls *controls, gdouble *box)
+{
+    if (controls->roi[2] <= controls->roi[0]
+        || controls->roi[3] <= controls->roi[1])
+        return FALSE;
+    roi_map_box(controls->corr_trans, controls->roi, box);
+    return box[2] > box[0] && box[3] > box[1];
+}
+
+/* The rectangle is kept in raw image pixels; one drawn on the corrected view
+ * is mapped back through the inverse shear. */
+static void
+roi_changed(ThresholdControls *controls)
+{
+    GwyDataField *source;
+    gdouble sel[4], box[4], iTrans[6];
+    gdouble dxoff, dyoff, sxoff, syoff;
+    if (!gwy_selection_get_object(controls->roi_selection, 0, sel))
+        return;
+    recompute_flush(controls);
+    source = preview_source(controls);
+    dxoff = gwy_data_field_get_xoffset(controls->disp_data);
+    dyoff = gwy_data_field_get_yoffset(controls->disp_data);
+    sxoff = gwy_data_field_get_xoffset(source);
+    syoff = gwy_data_field_get_yoffset(source);
+    box[0] = gwy_data_field_rtoj(source, MIN(sel[0], sel[2]) + dxoff - sxoff);
+    box[1] = gwy_data_field_rtoi(source, MIN(sel[1], sel[3]) + dyoff - syoff);
+    box[2] = gwy_data_field_rtoj(source, MAX(sel[0], sel[2]) + dxoff - sxoff);
+    box[3] = gwy_data_field_rtoi(source, MAX(sel[1], sel[3]) + dyoff - syoff);
+    if (controls->args->image_mode == IMAGE_CORRECTED)
+    {
+        invert_matrix(iTrans, controls->corr_trans);
+        roi_map_box(iTrans, box, controls->roi);
+    }
+    else
+        memcpy(controls->roi, box, sizeof(box));
+    spectrum_update_source(controls);
+    spectrum_update_corrected(controls);
+    roi_show(controls);
+}
+
+static void
+roi_show(ThresholdControls *controls)
+{
+    GwyDataField *source;
+    gdouble box[4], sel[4];
+    gdouble dxoff, dyoff, sxoff, syoff;
+    if (controls->args->image_mode == IMAGE_FFT
+        || controls->args->image_mode == IMAGE_FFT_CORRECTED)
+        return;
+    if (controls->args->image_mode == IMAGE_CORRECTED)
+    {
+        if (!roi_corrected_box(controls, box))
+        {
+            gwy_selection_clear(controls->roi_selection);
+            return;
+        }
+    }
+    else if (controls->roi[2] > controls->roi[0]
+             && controls->roi[3] > controls->roi[1])
+        memcpy(box, controls->roi, sizeof(box));
+    else
+    {
+        gwy_selection_clear(controls->roi_selection);
+        return;
+    }
+    source = preview_source(controls);
+    dxoff = gwy_data_field_get_xoffset(controls->disp_data);
+    dyoff = gwy_data_field_get_yoffset(controls->disp_data);
+    sxoff = gwy_data_field_get_xoffset(source);
+    syoff = gwy_data_field_get_yoffset(source);
+    sel[0] = gwy_data_field_jtor(source, box[0]) + sxoff - dxoff;
+    sel[1] = gwy_data_field_itor(source, box[1]) + syoff - dyoff;
+    sel[2] = gwy_data_field_jtor(source, box[2]) + sxoff - dxoff;
+    sel[3] = gwy_data_field_itor(source, box[3]) + syoff - dyoff;
+    gwy_selection_set_object(controls->roi_selection, 0, sel);
+}
+
+/* Real-space views edit the spectrum rectangle, spectra edit the peaks. */
+static void
+roi_update_layer(ThresholdControls *controls)
+{
+    ImageMode mode = controls->args->image_mode;
+    if (mode == IMAGE_DATA || mode == IMAGE_CORRECTED)
+    {
+        gwy_data_view_set_top_layer(GWY_DATA_VIEW(controls->view),
+                                    controls->roi_layer);
+        roi_show(controls);
+    }
+    else
+        gwy_data_view_set_top_layer(GWY_DATA_VIEW(controls->view),
+                                    controls->vlayer);
+}
+
+static void
+roi_reset(ThresholdControls *controls)
+{
+    memset(controls->roi, 0, sizeof(controls->roi));
+    gwy_selection_clear(controls->roi_selection);
+    spectrum_update_source(controls);
+    spectrum_update_corrected(controls);
+    preview(controls);
+}
+
+static void
+window_cache_init(WindowCache *cache)
+{
+    memset(cache, 0, sizeof(WindowCache));
+}
+
+static void
+window_cache_free(WindowCache *cache)
+{
+    guint i;
+    for (i = 0; i < WINDOW_CACHE_SIZE; i++)
+    {
+        g_free(cache->entry[i].xwin);
+        g_free(cache->entry[i].ywin);
+    }
+    window_cache_init(cache);
+}
+
+/* The source and the corrected image differ in size, so a few entries are
+ * kept and replaced round-robin. */
+static const WindowCacheEntry*
+window_cache_lookup(WindowCache *cache, WindowType type, gdouble beta,
+                    gint xres, gint yres)
+{
+    WindowCacheEntry *entry;
+    guint i;
+    for (i = 0; i < WINDOW_CACHE_SIZE; i++)
+    {
+        entry = cache->entry + i;
+        if (entry->xwin && entry->type == type
+            && entry->xres == xres && entry->yres == yres
+            && (type != WINDOW_KAISER || entry->beta == beta))
+            return entry;
+    }
+    entry = cache->entry + cache->next;
+    cache->next = (cache->next + 1) % WINDOW_CACHE_SIZE;
+    entry->type = type;
+    entry->beta = beta;
+    entry->xres = xres;
+    entry->yres = yres;
+    entry->xwin = g_renew(gdouble, entry->xwin, xres);
+    entry->ywin = g_renew(gdouble, entry->ywin, yres);
+    window_fill(entry->xwin, xres, type, beta);
+    window_fill(entry->ywin, yres, type, beta);
+    return entry;
+}
+
+static gdouble
+bessel_i0(gdouble x)
+{
+    gdouble sum = 1.0, term = 1.0, q = x*x/4.0;
+    gint k;
+    for (k = 1; k < 100 && term > 1e-16*sum; k++)
+    {
+        term *= q/(k*k);
+        sum += term;
+    }
+    return sum;
+}
+
+static void
+window_fill(gdouble *w, gint n, WindowType type, gdouble beta)
+{
+    gdouble x, t, norm;
+    gint i;
+    norm = bessel_i0(beta);
+    for (i = 0; i < n; i++)
+    {
+        x = 2*PI*i/n;
+        switch (type)
+        {
+            case WINDOW_HANN:
+                w[i] = 0.5 - 0.5*cos(x);
+                break;
+            case WINDOW_BLACKMAN_HARRIS:
+                w[i] = 0.35875 - 0.48829*cos(x) + 0.14128*cos(2*x)
+                       - 0.01168*cos(3*x);
+                break;
+            case WINDOW_KAISER:
+                t = 2.0*i/n - 1.0;
+                w[i] = bessel_i0(beta*sqrt(1.0 - t*t))/norm;
+                break;
+            case WINDOW_FLAT_TOP:
+                w[i] = 0.21557895 - 0.41663158*cos(x) + 0.277263158*cos(2*x)
+                       - 0.083578947*cos(3*x) + 0.006947368*cos(4*x);
+                break;
+            default:
+                g_return_if_reached();
+                break;
+        }
+    }
+}
+
+/* Mean subtraction and the outer product of the two 1D windows, fused into
+ * the single pass that prepares the FFT input. */
+static void
+window_apply(const WindowCacheEntry *win, GwyDataField *source,
+             GwyDataField *dest)
+{
+    const gdouble *src, *xwin;
+    gdouble *dst;
+    gdouble avg, wy;
+    gint xres, yres, i, j;
+    xres = gwy_data_field_get_xres(source);
+    yres = gwy_data_field_get_yres(source);
+    g_return_if_fail(win->xres == xres && win->yres == yres);
+    avg = gwy_data_field_get_avg(source);
+    src = gwy_data_field_get_data_const(source);
+    dst = gwy_data_field_get_data(dest);
+    xwin = win->xwin;
+    for (i = 0; i < yres; i++)
+    {
+        wy = win->ywin[i];
+        for (j = 0; j < xres; j++)
+            dst[i*xres + j] = (src[i*xres + j] - avg) * (wy*xwin[j]);
+    }
+    gwy_data_field_invalidate(dest);
+}
+
+/* Windows with lower sidelobes leave narrower, cleaner peaks, so the search
+ * does not need to reach as far. */
+static gint
+window_peak_radius(WindowType type)
+{
+    switch (type)
+    {
+        case WINDOW_HANN:
+            return 3;
+        case WINDOW_BLACKMAN_HARRIS:
+        case WINDOW_KAISER:
+        case WINDOW_FLAT_TOP:
+            return 2;
+        default:
+            g_return_val_if_reached(3);
+            break;
+    }
+}
+
+static void
+window_type_changed(GtkComboBox *combo, ThresholdControls *controls)
+{
+    controls->args->window_type = gwy_enum_combo_box_get_active(combo);
+    gtk_widget_set_sensitive(controls->kaiser_beta_spin,
+                controls->args->window_type == WINDOW_KAISER);
+    gtk_adjustment_set_value((GtkAdjustment*)controls->tool->radius,
+                window_peak_radius(controls->args->window_type));
+    threshold_save_args(controls);
+    spectrum_update_source(controls);
+    skew_process(controls);
+    reFind_Peaks(controls);
+}
+
+static void
+kaiser_beta_changed(ThresholdControls *controls)
+{
+    controls->args->kaiser_beta = gtk_adjustment_get_value(
+                            (GtkAdjustment*)controls->kaiser_beta);
+    if (controls->args->window_type != WINDOW_KAISER)
+        return;
+    threshold_save_args(controls);
+    spectrum_update_source(controls);
+    skew_process(controls);
+    reFind_Peaks(controls);
+}
+
+static void
+set_dfield_modulus(GwyDataField *re, GwyDataField *im, GwyDataField *target)
+{
+    const gdouble *datare, *dataim;
+    SkewStats stats;
+    gdouble *data;
+    gint xres, yres, i;
+    xres = gwy_data_field_get_xres(re);
+    yres = gwy_data_field_get_yres(re);
+    datare = gwy_data_field_get_data_const(re);
+    dataim = gwy_data_field_get_data_const(im);
+    data = gwy_data_field_get_data(target);
+    skew_stats_init(&stats);
+    for (i = xres*yres; i; i--, datare++, dataim++, data++)
+    {
+        *data = hypot(*datare, *dataim);
+        skew_stats_add(&stats, *data);
+    }
+    gwy_data_field_invalidate(target);
+    skew_stats_attach(target, &stats);
+}
+
+static void
+fft_postprocess(GwyDataField *dfield)
+{
+    gint res;
+    gdouble r;
+    gwy_data_field_2dfft_humanize(dfield);
+    GwySIUnit *xyunit;
+    xyunit = gwy_data_field_get_si_unit_xy(dfield);
+    gwy_si_unit_power(xyunit, -1, xyunit);
+    gwy_data_field_set_xreal(dfield, 1.0/gwy_data_field_get_xmeasure(dfield));
+    gwy_data_field_set_yreal(dfield, 1.0/gwy_data_field_get_ymeasure(dfield));
+    res = gwy_data_field_get_xres(dfield);
+    r = res / 2.0;
+    gwy_data_field_set_xoffset(dfield, -gwy_data_field_jtor(dfield, r));
+    res = gwy_data_field_get_yres(dfield);
+    r = res / 2.0;
+    gwy_data_field_set_yoffset(dfield, -gwy_data_field_itor(dfield, r));
+    gdouble dmin, dmax;
+    field_min_max(dfield, &dmin, &dmax);
+    spectrum_shift_and_histogram(dfield, dmin, dmax);
+}
+
+/* The range of a field, from the statistics attached by whatever wrote it
+ * when they are there, so freshly written fields are not scanned again. */
+static void
+field_min_max(GwyDataField *dfield, gdouble *min, gdouble *max)
+{
+    const SkewStats *stats;
+    if ((stats = skew_stats_get(dfield)))
+    {
+        *min = stats->min;
+        *max = stats->max;
+    }
+    else
+        gwy_data_field_get_min_max(dfield, min, max);
+}
+
+static void
+spectrum_shift_and_histogram(GwyDataField *dfield, gdouble dmin, gdouble dmax)
+{
+    SpectrumHistogram *hist;
+    SkewStats stats;
+    gdouble *data;
+    gdouble range, logmin, binscale, v;
+    gint n, i, b;
+    hist = g_new0(SpectrumHistogram, 1);
+    skew_stats_init(&stats);
+    range = dmax - dmin;
+    logmin = (range > 0.0) ? log(range) - HISTOGRAM_DECADES*G_LN10 : 0.0;
+    binscale = HISTOGRAM_BINS/(HISTOGRAM_DECADES*G_LN10);
+    n = gwy_data_field_get_xres(dfield)*gwy_data_field_get_yres(dfield);
+    data = gwy_data_field_get_data(dfield);
+    for (i = 0; i < n; i++)
+    {
+        v = data[i] - dmin;
+        data[i] = v;
+        skew_stats_add(&stats, v);
+        b = (v > 0.0) ? (gint)((log(v) - logmin)*binscale) : 0;
+        hist->bins[CLAMP(b, 0, HISTOGRAM_BINS-1)]++;
+    }
+    hist->logmin = logmin;
+    hist->binscale = binscale;
+    hist->n = n;
+    gwy_data_field_invalidate(dfield);
+    g_object_set_data_full(G_OBJECT(dfield), histogram_key, hist, g_free);
+    skew_stats_attach(dfield, &stats);
+}
+
+static gdouble
+spectrum_histogram_quantile(const SpectrumHistogram *hist, gdouble q)
+{
+    guint target, sum = 0;
+    gint b;
+    target = (guint)(q*hist->n);
+    for (b = 0; b < HISTOGRAM_BINS; b++)
+    {
+        sum += hist->bins[b];
+        if (sum > target)
+            break;
+    }
+    if (b == 0)
+        return 0.0;
+    return exp(hist->logmin + MIN(b + 1, HISTOGRAM_BINS)/hist->binscale);
+}
+
+static void
+selection_changed(ThresholdControls *controls)
+{
+    guint i;
+    GwyNullStore *store = GWY_NULL_STORE(controls->tool->model);
+    for (i = 0; i < 4; i++)
+        gwy_null_store_row_changed(store, i);
+}
+
+static void
+skew_do(ThresholdControls *controls)
+{
+    skew_process(controls);
+    if (controls->mosaic)
+        mosaic_create_output(controls->container, controls);
+    else
+        skew_create_output(controls->container,
+                           skew_corrected_image(controls), controls);
+    g_object_unref(controls->image);
+    g_object_unref(controls->dfield);
+    if (controls->corr_image)
+        g_object_unref(controls->corr_image);
+    skew_virtual_unref(controls->corr_virtual);
+    g_object_unref(controls->corr_fft);
+}
+
+static void
+image_mode_changed(GtkToggleButton *button, ThresholdControls *controls)
+{
+    threshold_load_args(controls);
+    controls->args->image_mode =
+        gwy_radio_buttons_get_current(controls->image_mode_radios);
+    if (controls->args->image_mode != IMAGE_FFT_CORRECTED)
+        gwy_vector_layer_set_editable(controls->vlayer, FALSE);
+    else
+        gwy_vector_layer_set_editable(controls->vlayer, TRUE);
+    preview(controls);
+    roi_update_layer(controls);
+}
+
+static void
+zoom_mode_changed(GtkToggleButton *button, ThresholdControls *controls)
+{
+    controls->args->zoom_mode =
+        gwy_radio_buttons_get_current(controls->zoom_mode_radios);
+    preview(controls);
+    zoom_adjust_peaks(controls);
+    roi_show(controls);
+}
+
+static void
+clear_points(ThresholdControls *controls)
+{
+    gwy_selection_clear(controls->selection);
+    skew_update_angles(controls);
+    preview(controls);
+}
+
+static const gchar lower0_key[] = "/module/skew_lattice/lower0";
+static const gchar lower1_key[] = "/module/skew_lattice/lower1";
+static const gchar lower2_key[] = "/module/skew_lattice/lower2";
+static const gchar lower3_key[] = "/module/skew_lattice/lower3";
+static const gchar upper0_key[] = "/module/skew_lattice/upper0";
+static const gchar upper1_key[] = "/module/skew_lattice/upper1";
+static const gchar upper2_key[] = "/module/skew_lattice/upper2";
+static const gchar upper3_key[] = "/module/skew_lattice/upper3";
+static const gchar radius_key[] = "/module/skew_lattice/radius";
+static const gchar window_key[] = "/module/skew_lattice/window";
+static const gchar kaiser_beta_key[] = "/module/skew_lattice/kaiser_beta";
+static const gchar display_scale_key[] = "/module/skew_lattice/display_scale";
+static const gchar gamma_key[] = "/module/skew_lattice/gamma";
+static const gchar auto_range_key[] = "/module/skew_lattice/auto_range";
+static const gchar lattice_type_key[] = "/module/skew_lattice/lattice_type";
+static const gchar spectrum_mode_key[] = "/module/skew_lattice/spectrum_mode";
+static const gchar tile_size_key[] = "/module/skew_lattice/tile_size";
+static const gchar domains_key[] = "/module/skew_lattice/domains";
+static const gchar fixed_point_key[] = "/module/skew_lattice/fixed_point";
+
+static void
+display_load_args(ThresholdControls *controls)
+{
+    GwyContainer *settings = gwy_app_settings_get();
+    gwy_container_gis_enum_by_name(settings, window_key,
+                        &controls->args->window_type);
+    gwy_container_gis_double_by_name(settings, kaiser_beta_key,
+                        &controls->args->kaiser_beta);
+    controls->args->window_type = MIN(controls->args->window_type,
+                                      WINDOW_NTYPES - 1);
+    controls->args->kaiser_beta = CLAMP(controls->args->kaiser_beta,
+                                        0.0, 20.0);
+    gwy_container_gis_enum_by_name(settings, display_scale_key,
+                        &controls->args->display_scale);
+    gwy_container_gis_double_by_name(settings, gamma_key,
+                        &controls->args->gamma);
+    gwy_container_gis_boolean_by_name(settings, auto_range_key,
+                        &controls->args->auto_range);
+    gwy_container_gis_enum_by_name(settings, lattice_type_key,
+                        &controls->args->lattice_type);
+    controls->args->lattice_type = MIN(controls->args->lattice_type,
+                                       LATTICE_NTYPES - 1);
+    gwy_container_gis_enum_by_name(settings, spectrum_mode_key,
+                        &controls->args->spectrum_mode);
+    gwy_container_gis_int32_by_name(settings, tile_size_key,
+                        &controls->args->tile_size);
+    controls->args->spectrum_mode = MIN(controls->args->spectrum_mode,
+                                        SPECTRUM_NTYPES - 1);
+    if (controls->args->tile_size != 128 && controls->args->tile_size != 256)
+        controls->args->tile_size = 512;
+    gwy_container_gis_int32_by_name(settings, domains_key,
+                        &controls->args->domains);
+    controls->args->domains = CLAMP(controls->args->domains, 1, DOMAIN_MAX);
+    gwy_container_gis_boolean_by_name(settings, fixed_point_key,
+                        &controls->args->fixed_point);
+    controls->args->display_scale = MIN(controls->args->display_scale,
+                                        SCALE_NTYPES - 1);
+    controls->args->gamma = CLAMP(controls->args->gamma, 0.05, 4.0);
+}
+
+static void
+threshold_load_args(ThresholdControls *controls)
+{
+    GwyContainer *settings = gwy_app_settings_get();
+    gdouble *lower = &controls->args->lower;
+    gdouble *upper = &controls->args->upper;
+    switch (controls->args->image_mode)
+    {
+        case IMAGE_DATA:
+            gwy_container_gis_double_by_name(settings, lower0_key, lower);
+            gwy_container_gis_double_by_name(settings, upper0_key, upper);
+            break;
+        case IMAGE_FFT:
+            gwy_container_gis_double_by_name(settings, lower1_key, lower);
+            gwy_container_gis_double_by_name(settings, upper1_key, upper);
+            break;
+        case IMAGE_CORRECTED:
+            gwy_container_gis_double_by_name(settings, lower2_key, lower);
+            gwy_container_gis_double_by_name(settings, upper2_key, upper);
+            break;
+        case IMAGE_FFT_CORRECTED:
+            gwy_container_gis_double_by_name(settings, lower3_key, lower);
+            gwy_container_gis_double_by_name(settings, upper3_key, upper);
+            break;
+    }
+    threshold_format_value(controls,
+                        GTK_ENTRY(controls->upper), controls->args->upper);
+    threshold_format_value(controls,
+                        GTK_ENTRY(controls->lower), controls->args->lower);
+    gwy_container_gis_int32_by_name(settings,
+                        radius_key, (&controls->tool->rpx));
+}
+
+static void
+threshold_save_args(ThresholdControls *controls)
+{
+    GwyContainer *settings = gwy_app_settings_get();
+    switch (controls->args->image_mode)
+    {
+        case IMAGE_DATA:
+            gwy_container_set_double_by_name(settings,
+                                lower0_key, controls->args->lower);
+            gwy_container_set_double_by_name(settings,
+                                upper0_key, controls->args->upper);
+            break;
+        case IMAGE_FFT:
+            gwy_container_set_double_by_name(settings,
+                                lower1_key, controls->args->lower);
+            gwy_container_set_double_by_name(settings,
+                                upper1_key, controls->args->upper);
+            break;
+        case IMAGE_CORRECTED:
+            gwy_container_set_double_by_name(settings,
+                                lower2_key, controls->args->lower);
+            gwy_container_set_double_by_name(settings,
+                                upper2_key, controls->args->upper);
+            break;
+        case IMAGE_FFT_CORRECTED:
+            gwy_container_set_double_by_name(settings,
+                                lower3_key, controls->args->lower);
+            gwy_container_set_double_by_name(settings,
+                                upper3_key, controls->args->upper);
+            break;
+    }
+    gwy_container_set_int32_by_name(settings, radius_key, controls->tool->rpx);
+    gwy_container_set_enum_by_name(settings, window_key,
+                        controls->args->window_type);
+    gwy_container_set_double_by_name(settings, kaiser_beta_key,
+                        controls->args->kaiser_beta);
+    gwy_container_set_enum_by_name(settings, display_scale_key,
+                        controls->args->display_scale);
+    gwy_container_set_double_by_name(settings, gamma_key,
+                        controls->args->gamma);
+    gwy_container_set_boolean_by_name(settings, auto_range_key,
+                        controls->args->auto_range);
+    gwy_container_set_enum_by_name(settings, lattice_type_key,
+                        controls->args->lattice_type);
+    gwy_container_set_enum_by_name(settings, spectrum_mode_key,
+                        controls->args->spectrum_mode);
+    gwy_container_set_int32_by_name(settings, tile_size_key,
+                        controls->args->tile_size);
+    gwy_container_set_int32_by_name(settings, domains_key,
+                        controls->args->domains);
+    gwy_container_set_boolean_by_name(settings, fixed_point_key,
+                        controls->args->fixed_point);
+}
+
+static void
+hskew_changed(ThresholdControls *controls)
+{
+    const gchar *value = gtk_entry_get_text(GTK_ENTRY(controls->hskewtxt));
+    gdouble num = g_strtod(value, NULL);
+    if (num != controls->args->Xskew)
+    {
+        controls->args->Xskew = num;
+        gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Xadjust, num);
+    }
+    else
+    {
+        gchar *s = g_strdup_printf("%0.1f", controls->args->Xskew);
+        gtk_entry_set_text(GTK_ENTRY(controls->hskewtxt), s);
+        g_free(s);
+    }
+}
+
+static void
+vskew_changed(ThresholdControls *controls)
+{
+    const gchar *value = gtk_entry_get_text(GTK_ENTRY(controls->vskewtxt));
+    gdouble num = g_strtod(value, NULL);
+    if (num != controls->args->Yskew)
+    {
+        controls->args->Yskew = num;
+        gtk_adjustment_set_value((GtkAdjustment*)controls->skew_Yadjust, num);
+    }
+    else
+    {
+        gchar *s = g_strdup_printf("%0.1f", controls->args->Yskew);
+        gtk_entry_set_text(GTK_ENTRY(controls->vskewtxt), s);
+        g_free(s);
+    }
+}
+
+static gdouble
+matrix_det(const gdouble *m)
+{
+    return m[0]*m[3] - m[1]*m[2];
+}
+
+static void
+invert_matrix(gdouble *dest, const gdouble *src)
+{
+    gdouble D = matrix_det(src);
+    dest[0] = src[3]/D;
+    dest[1] = -src[1]/D;
+    dest[2] = -src[2]/D;
+    dest[3] = src[0]/D;
+    dest[4] = (src[2]*src[5] - src[3]*src[4])/D;
+    dest[5] = (src[1]*src[4] - src[0]*src[5])/D;
+}
+
+static void
+mult_3matrix(gdouble *dest, const gdouble *mat1, const gdouble *mat2)
+{
+    dest[0] = mat1[0]*mat2[0] + mat1[2]*mat2[1] + mat1[4]*mat2[2];
+    dest[1] = mat1[1]*mat2[0] + mat1[3]*mat2[1] + mat1[5]*mat2[2];
+    dest[2] = mat2[2];
+}
+
+static gdouble
+deg2rad(const gdouble deg)
+{
+    return deg * PI / 180.0;
+}
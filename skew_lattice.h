@@ -0,0 +1,156 @@
+/*
+ *  @(#) $Id: skew_lattice.h 2014-05-08 $
+ *  Copyright (C) 2014 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ *  Mapping coordinates between a raw channel and the channel skew_lattice
+ *  produced from it, without resampling anything.  Every skewed channel
+ *  carries the affine transform from the raw to the corrected frame and
+ *  its inverse in its metadata, as six numbers m such that
+ *
+ *      x' = m[0]*x + m[2]*y + m[4]
+ *      y' = m[1]*x + m[3]*y + m[5]
+ *
+ *  in physical coordinates, offsets included, i.e. the same coordinates
+ *  the selections on either channel use.  Everything here is inline, so
+ *  other modules only need the header.
+ */
+
+#ifndef __SKEW_LATTICE_H__
+#define __SKEW_LATTICE_H__
+
+#include <string.h>
+#include <libgwyddion/gwycontainer.h>
+#include <libgwyddion/gwyserializable.h>
+#include <libgwydgets/gwyselection.h>
+
+#define SKEW_LATTICE_META_FORWARD "Skew Transform"
+#define SKEW_LATTICE_META_INVERSE "Skew Inverse Transform"
+
+typedef enum {
+    SKEW_LATTICE_TO_CORRECTED = 0,
+    SKEW_LATTICE_TO_RAW       = 1,
+} SkewLatticeDirection;
+
+/* Parses the six numbers of a transform stored in metadata. */
+static inline gboolean
+skew_lattice_parse_transform(const gchar *s, gdouble *m)
+{
+    gchar *end;
+    gint i;
+    for (i = 0; i < 6; i++)
+    {
+        m[i] = g_ascii_strtod(s, &end);
+        if (end == s)
+            return FALSE;
+        s = end;
+    }
+    return TRUE;
+}
+
+/* Reads the transform of skewed channel id in the given direction into m.
+ * Returns FALSE if the channel was not produced by skew_lattice. */
+static inline gboolean
+skew_lattice_get_transform(GwyContainer *data, gint id,
+                           SkewLatticeDirection direction, gdouble *m)
+{
+    const guchar *s;
+    gchar key[64];
+    GObject *meta;
+    g_snprintf(key, sizeof(key), "/%i/meta", id);
+    if (!gwy_container_gis_object_by_name(data, key, &meta))
+        return FALSE;
+    if (!gwy_container_gis_string_by_name(GWY_CONTAINER(meta),
+                (direction == SKEW_LATTICE_TO_RAW)
+                ? SKEW_LATTICE_META_INVERSE : SKEW_LATTICE_META_FORWARD, &s))
+        return FALSE;
+    return skew_lattice_parse_transform((const gchar *)s, m);
+}
+
+/* Maps n points stored as x, y pairs in place. */
+static inline void
+skew_lattice_map_points(const gdouble *m, gdouble *xy, guint n)
+{
+    gdouble x, y;
+    guint i;
+    for (i = 0; i < n; i++)
+    {
+        x = xy[2*i];
+        y = xy[2*i + 1];
+        xy[2*i] = m[0]*x + m[2]*y + m[4];
+        xy[2*i + 1] = m[1]*x + m[3]*y + m[5];
+    }
+}
+
+/* Maps a point or line selection in place.  Both consist of x, y pairs, so
+ * the mapped objects are exact; shapes the affine map would turn into
+ * something else (rectangles, ellipses) are refused. */
+static inline gboolean
+skew_lattice_map_selection(const gdouble *m, GwySelection *selection)
+{
+    const gchar *name;
+    gdouble *xy;
+    guint n, size;
+    name = G_OBJECT_TYPE_NAME(selection);
+    if (strcmp(name, "GwySelectionPoint") && strcmp(name, "GwySelectionLine"))
+        return FALSE;
+    n = gwy_selection_get_data(selection, NULL);
+    if (!n)
+        return TRUE;
+    size = gwy_selection_get_object_size(selection);
+    xy = g_new(gdouble, n*size);
+    gwy_selection_get_data(selection, xy);
+    skew_lattice_map_points(m, xy, n*size/2);
+    gwy_selection_set_data(selection, n, xy);
+    g_free(xy);
+    return TRUE;
+}
+
+/* Copies the selection under key from channel from_id to channel to_id,
+ * one of them being the skewed channel that holds the transform. */
+static inline gboolean
+skew_lattice_transfer_selection(GwyContainer *data, const gchar *key,
+                                gint from_id, gint to_id)
+{
+    GwySelection *selection;
+    GObject *object;
+    gchar path[64];
+    gdouble m[6];
+    if (!skew_lattice_get_transform(data, to_id,
+                                    SKEW_LATTICE_TO_CORRECTED, m)
+        && !skew_lattice_get_transform(data, from_id,
+                                       SKEW_LATTICE_TO_RAW, m))
+        return FALSE;
+    g_snprintf(path, sizeof(path), "/%i/select/%s", from_id, key);
+    if (!gwy_container_gis_object_by_name(data, path, &object))
+        return FALSE;
+    selection = GWY_SELECTION(gwy_serializable_duplicate(object));
+    if (!skew_lattice_map_selection(m, selection))
+    {
+        g_object_unref(selection);
+        return FALSE;
+    }
+    g_snprintf(path, sizeof(path), "/%i/select/%s", to_id, key);
+    gwy_container_set_object_by_name(data, path, selection);
+    g_object_unref(selection);
+    return TRUE;
+}
+
+#endif /* __SKEW_LATTICE_H__ */
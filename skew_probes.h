@@ -0,0 +1,69 @@
+/*
+ *  @(#) $Id: skew_probes.h 2014-05-08 $
+ *  Copyright (C) 2014 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ *  Static probes at the entry and exit of the pipeline stages, for tracing
+ *  a slow dialog in the field without rebuilding, e.g. with the latency
+ *  histograms of skew_lattice.bt.  With <sys/sdt.h> each probe is a single
+ *  nop plus a note naming where its arguments live, so it costs nothing
+ *  until a tracer attaches; without it the probes vanish.  All arguments
+ *  are integers, angles in millidegrees, as tracers read them from
+ *  general registers.
+ *
+ *      provider  skew_lattice
+ *      process_entry     xres, yres, hskew, vskew
+ *      process_return    newxres, newyres
+ *      affine_entry      xres, yres, newxres, newyres, interp, fixed
+ *      affine_return     newxres, newyres
+ *      fft_entry         xres, yres, spectrum mode, tile size
+ *      fft_return        xres, yres
+ *      preview_entry     image mode, zoom
+ *      preview_return    xres, yres
+ *      peaks_entry       number of peaks
+ *      peaks_return      number of peaks found
+ *      output_entry      newxres, newyres, hskew, vskew
+ *      output_return     id of the new channel
+ */
+
+#ifndef __SKEW_PROBES_H__
+#define __SKEW_PROBES_H__
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define SKEW_PROBE1(name, a) \
+    DTRACE_PROBE1(skew_lattice, name, a)
+#define SKEW_PROBE2(name, a, b) \
+    DTRACE_PROBE2(skew_lattice, name, a, b)
+#define SKEW_PROBE4(name, a, b, c, d) \
+    DTRACE_PROBE4(skew_lattice, name, a, b, c, d)
+#define SKEW_PROBE6(name, a, b, c, d, e, f) \
+    DTRACE_PROBE6(skew_lattice, name, a, b, c, d, e, f)
+#else
+#define SKEW_PROBE1(name, a) do {} while (0)
+#define SKEW_PROBE2(name, a, b) do {} while (0)
+#define SKEW_PROBE4(name, a, b, c, d) do {} while (0)
+#define SKEW_PROBE6(name, a, b, c, d, e, f) do {} while (0)
+#endif
+
+/* Angles as probe arguments. */
+#define SKEW_PROBE_MDEG(angle) GWY_ROUND(1000.0*(angle))
+
+#endif /* __SKEW_PROBES_H__ */